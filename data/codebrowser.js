@@ -90,6 +90,25 @@ $(function () {
         return str;
     }
 
+    // The uses of a ref paginated by codebrowser_merge --paginate, from its <uses> records
+    var getUsePages = function(proj_root_path, ref, usePages) {
+        var pages = {};
+        usePages.each(function() { pages[$(this).attr("p")] = true; });
+        var requests = [];
+        for (var p in pages) {
+            if (Object.prototype.hasOwnProperty.call(pages, p))
+                requests.push($.get(proj_root_path + "/refs/_P/" + replace_invalid_filename_chars(ref) + "." + p));
+        }
+        return $.when.apply($, requests).then(function() {
+            // $.when passes the (data, status, xhr) of a single request directly
+            var results = requests.length == 1 ? [arguments] : arguments;
+            var data = "";
+            for (var i = 0; i < results.length; ++i)
+                data += results[i][0];
+            return data;
+        });
+    };
+
     var escape_selector = function (str) {
         return str.replace(/([ #;&,.+*~\':"!^$[\]()=<>|\/@{}\\])/g,'\\$1')
     }
@@ -399,46 +418,113 @@ $(function () {
 /*-------------------------------------------------------------------------------------*/
 
     //highlight the line numbers of the warnings
-    $(".warning, .error").each(function() {
-        var t = $(this);
-        var l = t.parents("tr").find("th");
-        l.css( { "border-radius": 3, "background-color": t.css("border-bottom-color") });
-        l.attr("title", t.attr("title"));
-    } );
+    var highlightWarnings = function(root) {
+        root.find(".warning, .error").each(function() {
+            var t = $(this);
+            var l = t.parents("tr").find("th");
+            l.css( { "border-radius": 3, "background-color": t.css("border-bottom-color") });
+            l.attr("title", t.attr("title"));
+        } );
+    }
+    highlightWarnings($(document));
 
     // other highlighting stuff
     var highlighted_items;
+    var highlighted_ref;
     var highlight_items = function(ref) {
         if (highlighted_items)
             highlighted_items.removeClass("highlight");
+        highlighted_ref = ref;
         if (ref) {
             highlighted_items = $("[data-ref='"+escape_selector(ref)+"']");
             highlighted_items.addClass("highlight")
         }
     }
 
+/*-------------------------------------------------------------------------------------*/
+
+    // The pages of the files longer than --page-lines only contain their first lines. The other
+    // chunks of lines are loaded from <page>.chunk<n> when they are scrolled or linked to.
+    var chunkLines = parseInt($(".code").attr("data-chunk-lines"));
+    var loadChunk = function(tbody) {
+        if (!tbody.length || !tbody.hasClass("chunk"))
+            return $.Deferred().resolve().promise();
+        var elem = tbody[0];
+        if (!elem.chunk_request) {
+            var url = file.substr(file.lastIndexOf("/") + 1) + ".html.chunk" + tbody.attr("data-chunk");
+            elem.chunk_request = $.get(url, function(data) {
+                tbody.html(data);
+                tbody.removeClass("chunk");
+                highlightWarnings(tbody);
+                if (isFirefox)
+                    tbody.find("q").replaceWith(function() { return $("<span class='string'/>").text($(this).text()); });
+                if (highlighted_ref)
+                    tbody.find("[data-ref='"+escape_selector(highlighted_ref)+"']").addClass("highlight");
+            }, "text").fail(function() { elem.chunk_request = undefined; });
+        }
+        return elem.chunk_request;
+    }
+    // The chunk not loaded yet which has the anchor, or an empty set
+    var chunkOf = function(anchor) {
+        if (!chunkLines)
+            return $();
+        var c = $("#chunk_anchors i[data-id='" + escape_selector(anchor) + "']").attr("data-c");
+        if (c === undefined && /^\d+(-\d+)?$/.test(anchor))
+            c = Math.floor((parseInt(anchor) - 1) / chunkLines);
+        return $(".code tbody.chunk[data-chunk='" + c + "']");
+    }
+    if (chunkLines) {
+        // The placeholders take the room of their lines, so that the scroll bar is right
+        var lineHeight = $(".code tr").first().height() || 16;
+        $(".code tbody.chunk").each(function() {
+            var t = $(this);
+            t.find("td").height(lineHeight * parseInt(t.attr("data-count")));
+        });
+        var loadVisibleChunks = function() {
+            var win = $(window);
+            var top = win.scrollTop() - win.height();
+            var bottom = win.scrollTop() + 2 * win.height();
+            $(".code tbody.chunk").each(function() {
+                var t = $(this);
+                var y = t.offset().top;
+                if (y + t.height() >= top && y <= bottom)
+                    loadChunk(t);
+            });
+        }
+        var chunkTimerId = null;
+        $(window).scroll(function() {
+            if (!chunkTimerId) {
+                chunkTimerId = setTimeout(function() { chunkTimerId = null; loadVisibleChunks(); }, 100);
+            }
+        });
+    }
+
     var anchor_id  = location.hash.substr(1); //Get the word after the hash from the url
-    if (/^\d+$/.test(anchor_id)) {
-        highlighted_items = $("#" + anchor_id);
-        highlighted_items.addClass("highlight")
-        scrollToAnchor(anchor_id, false);
-    } else if (/^\d+-\d+$/.test(anchor_id)) {
-        var m = anchor_id.match(/^(\d+)-(\d+)$/);
-        var a = parseInt(m[1]);
-        var b = parseInt(m[2]);
-        if (a && b && a <= b) {
-            var select = "#" + a;
-            for (var x = a + 1; x <= b; ++x) {
-                select += ",#" + x;
+    loadChunk(chunkOf(anchor_id)).always(function() {
+        if (/^\d+$/.test(anchor_id)) {
+            highlighted_items = $("#" + anchor_id);
+            highlighted_items.addClass("highlight")
+            scrollToAnchor(anchor_id, false);
+        } else if (/^\d+-\d+$/.test(anchor_id)) {
+            var m = anchor_id.match(/^(\d+)-(\d+)$/);
+            var a = parseInt(m[1]);
+            var b = parseInt(m[2]);
+            if (a && b && a <= b) {
+                var select = "#" + a;
+                for (var x = a + 1; x <= b; ++x) {
+                    select += ",#" + x;
+                }
             }
+            highlighted_items = $(select);
+            highlighted_items.addClass("highlight")
+            scrollToAnchor("" + a, false);
+        } else if (anchor_id != "") {
+            highlight_items(anchor_id);
+            scrollToAnchor(anchor_id, false);
         }
-        highlighted_items = $(select);
-        highlighted_items.addClass("highlight")
-        scrollToAnchor("" + a, false);
-    } else if (anchor_id != "") {
-        highlight_items(anchor_id);
-        scrollToAnchor(anchor_id, false);
-    }
+        if (chunkLines)
+            loadVisibleChunks();
+    });
 
 /*-------------------------------------------------------------------------------------*/
     var skipHighlightTimerId = null;
@@ -704,19 +790,35 @@ $(function () {
 
                 // Uses:
                 var uses = res.find("use");
-                if (uses.length) {
+                // The refs paginated by codebrowser_merge only have the number of uses per file
+                var usePages = res.find("uses");
+                var usesCount = uses.length;
+                usePages.each(function() { usesCount += parseInt($(this).attr("n")); });
+                if (usesCount) {
                     var href ="#";
                     if (symbolUrl) {
                         href = symbolUrl+"#uses";
                     }
-                    content += "<br/><a href='" + href + "' class='showuse'>Show Uses:</a> (" + uses.length + ")<br/><span class='uses_placeholder'></span>"
+                    content += "<br/><a href='" + href + "' class='showuse'>Show Uses:</a> (" + usesCount + ")<br/><span class='uses_placeholder'></span>"
                 }
                 var useShown = false;
+                var usesLoading = false;
                 showUseFunc = function(e) {
                     if (useShown) {
                         tt.find(".uses").toggle();
                         return false;
                     }
+                    if (usePages.length) {
+                        if (!usesLoading) {
+                            usesLoading = true;
+                            getUsePages(proj_root_path, ref, usePages).done(function(data) {
+                                uses = uses.add($("<data>"+data+"</data>").find("use"));
+                                usePages = $();
+                                showUseFunc(e);
+                            });
+                        }
+                        return false;
+                    }
                     var dict = { };
                     var usesTypeCount = { };
                     uses.each(function() {
@@ -1055,6 +1157,98 @@ $(function () {
             }
         };
 
+        // The function index written by codebrowser_indexgenerator in fnIndex/: 'dir' lists the
+        // first key of every chunk, so only the chunks covering the searched prefix are fetched.
+        // Without it, the buckets of fnSearch/ are used.
+        var fnIndex; // the first keys, false while loading, null if there is no index
+        var fnChunks = {}; // chunk number -> list of { key, name, ref }, empty while loading
+
+        // Decodes a chunk, or the dir if withPayload is false (see indexer.cpp for the format)
+        var readFnIndex = function(bytes, withPayload) {
+            var decoder = window.TextDecoder ? new TextDecoder() : null;
+            var toString = function(b) {
+                if (decoder)
+                    return decoder.decode(b);
+                return decodeURIComponent(escape(String.fromCharCode.apply(null, b)));
+            };
+            var pos = 0;
+            var readNumber = function() {
+                var value = 0, shift = 1, b;
+                do {
+                    b = bytes[pos++];
+                    value += (b & 0x7f) * shift;
+                    shift *= 128;
+                } while (b & 0x80);
+                return value;
+            };
+            var readBytes = function() {
+                var len = readNumber();
+                pos += len;
+                return bytes.subarray(pos - len, pos);
+            };
+            var result = [];
+            var key = new Uint8Array(0);
+            while (pos < bytes.length) {
+                var shared = readNumber();
+                var suffix = readBytes();
+                var k = new Uint8Array(shared + suffix.length);
+                k.set(key.subarray(0, shared));
+                k.set(suffix, shared);
+                key = k;
+                if (withPayload) {
+                    var keyStr = toString(key);
+                    var name = toString(readBytes()) + keyStr;
+                    result.push({ key: keyStr.toLowerCase(), name: name, ref: toString(readBytes()) });
+                } else {
+                    result.push(toString(key));
+                }
+            }
+            return result;
+        };
+
+        var getBinary = function(url, success, error) {
+            var xhr = new XMLHttpRequest();
+            xhr.open("GET", url);
+            xhr.responseType = "arraybuffer";
+            xhr.onload = function() {
+                if (xhr.status == 200 || (xhr.status == 0 && xhr.response))
+                    success(new Uint8Array(xhr.response));
+                else if (error)
+                    error();
+            };
+            xhr.onerror = function() { if (error) error(); };
+            xhr.send();
+        };
+
+        // The lower case key to look up in fnIndex: the last two components of the name
+        var getFnNamePrefix = function (request) {
+            if (request.indexOf('/') != -1 || request.indexOf('.') != -1)
+                return false;
+            var prefix = request.replace(/^:*/, "").split("::").slice(-2).join("::");
+            if (prefix.length < 2)
+                return false;
+            return prefix.toLowerCase();
+        }
+
+        // The chunks which may contain keys starting with prefix: [first, last]
+        var fnChunkRange = function(prefix) {
+            var lo = 0, hi = fnIndex.length;
+            while (lo < hi) {
+                var mid = (lo + hi) >> 1;
+                if (fnIndex[mid] < prefix)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            var first = Math.max(lo - 1, 0);
+            var last = first;
+            // Very short prefixes can span many chunks: the list is truncated anyway
+            while (last + 1 < fnIndex.length && last - first < 7
+                    && fnIndex[last + 1].lastIndexOf(prefix, 0) === 0)
+                ++last;
+            return [first, last];
+        };
+
         var getFnNameKey = function (request) {
             if (request.indexOf('/') != -1 || request.indexOf('.') != -1)
                 return false;
@@ -1073,7 +1267,23 @@ $(function () {
             var rx1 = new RegExp(term, 'i');
             var rx2 = new RegExp("(^|::)"+term.replace(/^:*/, ''), 'i');
             var functionList = [];
-            var k = getFnNameKey(request.term)
+            var prefix = fnIndex && fnIndex.length && getFnNamePrefix(request.term);
+            if (prefix) {
+                var range = fnChunkRange(prefix);
+                var seen = {};
+                for (var n = range[0]; n <= range[1]; ++n) {
+                    var entries = fnChunks[n] || [];
+                    for (var i = 0; i < entries.length; ++i) {
+                        var e = entries[i];
+                        if (e.key.lastIndexOf(prefix, 0) === 0 && e.name.match(rx2)
+                                && !seen[e.name]) {
+                            seen[e.name] = true;
+                            functionList.push(e.name);
+                        }
+                    }
+                }
+            }
+            var k = fnIndex === null && getFnNameKey(request.term)
             if (k && Object.prototype.hasOwnProperty.call(functionDict,k)) {
                 functionList = functionDict[k].filter(
                     function(word) { return word.match(rx2) });
@@ -1093,26 +1303,66 @@ $(function () {
             }
         });
 
-        // When the content changes, fetch the list of function that starts with ...
-        searchline.on('input', function() {
-            var value = $(this).val();
-            var k = getFnNameKey(value);
-            if (k && !Object.prototype.hasOwnProperty.call(functionDict, k)) {
-                functionDict[k] = []
-                $.get(root_path + '/fnSearch/' + k, function(data) {
-                    var list = data.split("\n");
-                    for (var i = 0; i < list.length; ++i) {
-                        var sep = list[i].indexOf('|');
-                        var ref = list[i].slice(0, sep);
-                        var name = list[i].slice(sep+1);
-                        searchTerms[name] = { type:"ref", ref: ref };
-                        functionDict[k].push(name);
-                    }
-                    if (searchline.is(":focus")) {
-                        searchline.autocomplete("search", searchline.val());
-                    }
+        var refreshSearch = function() {
+            if (searchline.is(":focus")) {
+                searchline.autocomplete("search", searchline.val());
+            }
+        };
+
+        // Fetch the list of function that starts with value
+        var fetchFunctions = function(value) {
+            if (fnIndex === undefined) {
+                fnIndex = false;
+                getBinary(root_path + '/fnIndex/dir', function(bytes) {
+                    fnIndex = readFnIndex(bytes, false);
+                    fetchFunctions(searchline.val());
+                }, function() {
+                    fnIndex = null;
+                    fetchFunctions(searchline.val());
                 });
             }
+            if (fnIndex === null) {
+                var k = getFnNameKey(value);
+                if (k && !Object.prototype.hasOwnProperty.call(functionDict, k)) {
+                    functionDict[k] = []
+                    $.get(root_path + '/fnSearch/' + k, function(data) {
+                        var list = data.split("\n");
+                        for (var i = 0; i < list.length; ++i) {
+                            var sep = list[i].indexOf('|');
+                            var ref = list[i].slice(0, sep);
+                            var name = list[i].slice(sep+1);
+                            searchTerms[name] = { type:"ref", ref: ref };
+                            functionDict[k].push(name);
+                        }
+                        refreshSearch();
+                    });
+                }
+                return;
+            }
+            var prefix = fnIndex && fnIndex.length && getFnNamePrefix(value);
+            if (!prefix)
+                return;
+            var range = fnChunkRange(prefix);
+            for (var n = range[0]; n <= range[1]; ++n) {
+                if (Object.prototype.hasOwnProperty.call(fnChunks, n))
+                    continue;
+                fnChunks[n] = [];
+                (function(n) {
+                    getBinary(root_path + '/fnIndex/' + n, function(bytes) {
+                        var entries = readFnIndex(bytes, true);
+                        for (var i = 0; i < entries.length; ++i) {
+                            searchTerms[entries[i].name] = { type:"ref", ref: entries[i].ref };
+                        }
+                        fnChunks[n] = entries;
+                        refreshSearch();
+                    });
+                })(n);
+            }
+        };
+
+        // When the content changes, fetch the list of function that starts with ...
+        searchline.on('input', function() {
+            fetchFunctions($(this).val());
         });
 
         // Pasting should show the autocompletion
@@ -1224,7 +1474,10 @@ $(function () {
     // isLink tells us if we are here because a link was cliked
     function scrollToAnchor(anchor, isLink) {
         var target = $("#" + escape_selector(anchor));
-        if (target.length) {
+        var chunk = target.length ? $() : chunkOf(anchor);
+        if (chunk.length) {
+            loadChunk(chunk).done(function() { scrollToAnchor(anchor, isLink); });
+        } else if (target.length) {
             //Smooth scrolling and let back go to the last location
             var contentTop = $("#content").offset().top;
             if (parseInt(anchor)) {
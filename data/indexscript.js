@@ -98,6 +98,98 @@ $(function() {
             }
         };
 
+        // The function index written by codebrowser_indexgenerator in fnIndex/: 'dir' lists the
+        // first key of every chunk, so only the chunks covering the searched prefix are fetched.
+        // Without it, the buckets of fnSearch/ are used.
+        var fnIndex; // the first keys, false while loading, null if there is no index
+        var fnChunks = {}; // chunk number -> list of { key, name, ref }, empty while loading
+
+        // Decodes a chunk, or the dir if withPayload is false (see indexer.cpp for the format)
+        var readFnIndex = function(bytes, withPayload) {
+            var decoder = window.TextDecoder ? new TextDecoder() : null;
+            var toString = function(b) {
+                if (decoder)
+                    return decoder.decode(b);
+                return decodeURIComponent(escape(String.fromCharCode.apply(null, b)));
+            };
+            var pos = 0;
+            var readNumber = function() {
+                var value = 0, shift = 1, b;
+                do {
+                    b = bytes[pos++];
+                    value += (b & 0x7f) * shift;
+                    shift *= 128;
+                } while (b & 0x80);
+                return value;
+            };
+            var readBytes = function() {
+                var len = readNumber();
+                pos += len;
+                return bytes.subarray(pos - len, pos);
+            };
+            var result = [];
+            var key = new Uint8Array(0);
+            while (pos < bytes.length) {
+                var shared = readNumber();
+                var suffix = readBytes();
+                var k = new Uint8Array(shared + suffix.length);
+                k.set(key.subarray(0, shared));
+                k.set(suffix, shared);
+                key = k;
+                if (withPayload) {
+                    var keyStr = toString(key);
+                    var name = toString(readBytes()) + keyStr;
+                    result.push({ key: keyStr.toLowerCase(), name: name, ref: toString(readBytes()) });
+                } else {
+                    result.push(toString(key));
+                }
+            }
+            return result;
+        };
+
+        var getBinary = function(url, success, error) {
+            var xhr = new XMLHttpRequest();
+            xhr.open("GET", url);
+            xhr.responseType = "arraybuffer";
+            xhr.onload = function() {
+                if (xhr.status == 200 || (xhr.status == 0 && xhr.response))
+                    success(new Uint8Array(xhr.response));
+                else if (error)
+                    error();
+            };
+            xhr.onerror = function() { if (error) error(); };
+            xhr.send();
+        };
+
+        // The lower case key to look up in fnIndex: the last two components of the name
+        var getFnNamePrefix = function (request) {
+            if (request.indexOf('/') != -1 || request.indexOf('.') != -1)
+                return false;
+            var prefix = request.replace(/^:*/, "").split("::").slice(-2).join("::");
+            if (prefix.length < 2)
+                return false;
+            return prefix.toLowerCase();
+        }
+
+        // The chunks which may contain keys starting with prefix: [first, last]
+        var fnChunkRange = function(prefix) {
+            var lo = 0, hi = fnIndex.length;
+            while (lo < hi) {
+                var mid = (lo + hi) >> 1;
+                if (fnIndex[mid] < prefix)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            var first = Math.max(lo - 1, 0);
+            var last = first;
+            // Very short prefixes can span many chunks: the list is truncated anyway
+            while (last + 1 < fnIndex.length && last - first < 7
+                    && fnIndex[last + 1].lastIndexOf(prefix, 0) === 0)
+                ++last;
+            return [first, last];
+        };
+
         var getFnNameKey = function (request) {
             if (request.indexOf('/') != -1 || request.indexOf('.') != -1)
                 return false;
@@ -116,7 +208,23 @@ $(function() {
             var rx1 = new RegExp(term, 'i');
             var rx2 = new RegExp("(^|::)"+term.replace(/^:*/, ''), 'i');
             var functionList = [];
-            var k = getFnNameKey(request.term)
+            var prefix = fnIndex && fnIndex.length && getFnNamePrefix(request.term);
+            if (prefix) {
+                var range = fnChunkRange(prefix);
+                var seen = {};
+                for (var n = range[0]; n <= range[1]; ++n) {
+                    var entries = fnChunks[n] || [];
+                    for (var i = 0; i < entries.length; ++i) {
+                        var e = entries[i];
+                        if (e.key.lastIndexOf(prefix, 0) === 0 && e.name.match(rx2)
+                                && !seen[e.name]) {
+                            seen[e.name] = true;
+                            functionList.push(e.name);
+                        }
+                    }
+                }
+            }
+            var k = fnIndex === null && getFnNameKey(request.term)
             if (k && Object.prototype.hasOwnProperty.call(functionDict,k)) {
                 functionList = functionDict[k].filter(
                     function(word) { return word.match(rx2) });
@@ -136,26 +244,66 @@ $(function() {
             }
         });
 
-        // When the content changes, fetch the list of function that starts with ...
-        searchline.on('input', function() {
-            var value = $(this).val();
-            var k = getFnNameKey(value);
-            if (k && !Object.prototype.hasOwnProperty.call(functionDict, k)) {
-                functionDict[k] = []
-                $.get(root_path + '/fnSearch/' + k, function(data) {
-                    var list = data.split("\n");
-                    for (var i = 0; i < list.length; ++i) {
-                        var sep = list[i].indexOf('|');
-                        var ref = list[i].slice(0, sep);
-                        var name = list[i].slice(sep+1);
-                        searchTerms[name] = { type:"ref", ref: ref };
-                        functionDict[k].push(name);
-                    }
-                    if (searchline.is(":focus")) {
-                        searchline.autocomplete("search", searchline.val());
-                    }
+        var refreshSearch = function() {
+            if (searchline.is(":focus")) {
+                searchline.autocomplete("search", searchline.val());
+            }
+        };
+
+        // Fetch the list of function that starts with value
+        var fetchFunctions = function(value) {
+            if (fnIndex === undefined) {
+                fnIndex = false;
+                getBinary(root_path + '/fnIndex/dir', function(bytes) {
+                    fnIndex = readFnIndex(bytes, false);
+                    fetchFunctions(searchline.val());
+                }, function() {
+                    fnIndex = null;
+                    fetchFunctions(searchline.val());
                 });
             }
+            if (fnIndex === null) {
+                var k = getFnNameKey(value);
+                if (k && !Object.prototype.hasOwnProperty.call(functionDict, k)) {
+                    functionDict[k] = []
+                    $.get(root_path + '/fnSearch/' + k, function(data) {
+                        var list = data.split("\n");
+                        for (var i = 0; i < list.length; ++i) {
+                            var sep = list[i].indexOf('|');
+                            var ref = list[i].slice(0, sep);
+                            var name = list[i].slice(sep+1);
+                            searchTerms[name] = { type:"ref", ref: ref };
+                            functionDict[k].push(name);
+                        }
+                        refreshSearch();
+                    });
+                }
+                return;
+            }
+            var prefix = fnIndex && fnIndex.length && getFnNamePrefix(value);
+            if (!prefix)
+                return;
+            var range = fnChunkRange(prefix);
+            for (var n = range[0]; n <= range[1]; ++n) {
+                if (Object.prototype.hasOwnProperty.call(fnChunks, n))
+                    continue;
+                fnChunks[n] = [];
+                (function(n) {
+                    getBinary(root_path + '/fnIndex/' + n, function(bytes) {
+                        var entries = readFnIndex(bytes, true);
+                        for (var i = 0; i < entries.length; ++i) {
+                            searchTerms[entries[i].name] = { type:"ref", ref: entries[i].ref };
+                        }
+                        fnChunks[n] = entries;
+                        refreshSearch();
+                    });
+                })(n);
+            }
+        };
+
+        // When the content changes, fetch the list of function that starts with ...
+        searchline.on('input', function() {
+            fetchFunctions($(this).val());
         });
 
         // Pasting should show the autocompletion
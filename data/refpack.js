@@ -0,0 +1,118 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+/* Serves the requests of the files in refs/ from the pack written by codebrowser_merge --pack
+ * (the format is described in merger/merger.cpp) once they are not found as files, so the
+ * outputs which are not packed make no other request. The refs are looked up in the index, and
+ * read from their segment, with range requests. */
+(function() {
+    // FNV-1a, 32 bit, of the UTF-8 bytes. ATTENTION: Keep in sync with hashRef in merger.cpp
+    var hashRef = function(name) {
+        var bytes = new TextEncoder().encode(name);
+        var h = 0x811c9dc5;
+        for (var i = 0; i < bytes.length; ++i) {
+            h ^= bytes[i];
+            h = Math.imul(h, 0x01000193) >>> 0;
+        }
+        return h;
+    };
+
+    // The size bytes of url from begin
+    var getRange = function(url, begin, size) {
+        if (size == 0)
+            return $.Deferred().resolve("").promise();
+        return $.ajax({ url: url, dataType: "text", refpack_bypass: true,
+                        headers: { "Range": "bytes=" + begin + "-" + (begin + size - 1) } })
+            .then(function(data, status, xhr) {
+                if (xhr.status == 206)
+                    return data;
+                // The server ignored the range and sent the whole file
+                var bytes = new TextEncoder().encode(data);
+                return new TextDecoder().decode(bytes.subarray(begin, begin + size));
+            });
+    };
+
+    // root -> promise of the pack, or of null if the refs of root are not packed
+    var packs = {};
+    var packOf = function(root) {
+        if (!packs[root]) {
+            packs[root] = $.ajax({ url: root + "/refs/_pack/meta", dataType: "text", refpack_bypass: true })
+                .then(function(data) {
+                    var m = /^buckets (\d+)$/m.exec(data);
+                    if (data.split("\n")[0] != "woboq-refpack 1" || !m)
+                        return null;
+                    return { dir: root + "/refs/_pack/", buckets: parseInt(m[1]), buckets_read: {} };
+                }, function() { return $.Deferred().resolve(null).promise(); });
+        }
+        return packs[root];
+    };
+
+    // Promise of the content of the ref, rejected if it is not in the pack
+    var readRef = function(pack, name) {
+        var bucket = hashRef(name) % pack.buckets;
+        if (!pack.buckets_read[bucket]) {
+            pack.buckets_read[bucket] = getRange(pack.dir + "index", bucket * 16, 16).then(function(entry) {
+                return getRange(pack.dir + "index", pack.buckets * 16 + parseInt(entry.substr(0, 10), 16),
+                                parseInt(entry.substr(10, 6), 16));
+            }).then(function(lines) {
+                var refs = {};
+                lines.split("\n").forEach(function(line) {
+                    var fields = line.split("\t");
+                    if (fields.length == 4)
+                        refs[fields[0]] = fields;
+                });
+                return refs;
+            });
+        }
+        return pack.buckets_read[bucket].then(function(refs) {
+            var ref = refs[name];
+            if (!ref)
+                return $.Deferred().reject().promise();
+            return getRange(pack.dir + ref[1], parseInt(ref[2]), parseInt(ref[3]));
+        });
+    };
+
+    $.ajaxTransport("+*", function(options) {
+        var m = /^(.*?)\/refs\/(.+)$/.exec(options.url);
+        if (options.refpack_bypass || options.type != "GET" || !m)
+            return;
+        var aborted = false;
+        return {
+            send: function(headers, complete) {
+                var done = function(status, text, data) {
+                    if (!aborted)
+                        complete(status, text, data === undefined ? undefined : { text: data });
+                };
+                $.ajax({ url: options.url, dataType: "text", refpack_bypass: true }).then(function(data, status, xhr) {
+                    done(xhr.status, xhr.statusText, data);
+                }, function(xhr) {
+                    if (xhr.status != 404)
+                        return done(xhr.status, xhr.statusText);
+                    packOf(m[1]).then(function(pack) {
+                        return pack ? readRef(pack, m[2]) : $.Deferred().reject().promise();
+                    }).then(function(data) { done(200, "OK", data); },
+                            function() { done(xhr.status, xhr.statusText); });
+                });
+            },
+            abort: function() { aborted = true; }
+        };
+    });
+})();
@@ -0,0 +1,64 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "annotationpass.h"
+
+static std::vector<AnnotationPipeline::Registration> &registry()
+{
+    static std::vector<AnnotationPipeline::Registration> passes = {
+        { "param-hints", "the names of the parameters before the arguments of the calls",
+          Stats::ParamHintsPass, createParamHintsPass, true },
+        { "designator-hints", "the designators of the members in the initializer lists",
+          Stats::DesignatorHintsPass, createDesignatorHintsPass, true },
+        { "qt", "the links from the SIGNAL, SLOT and invokeMethod arguments to the methods",
+          Stats::QtPass, createQtPass, true },
+        { "record-layout",
+          "the sizes of the classes and the offsets of their fields in the tooltips",
+          Stats::RecordLayoutPass, createRecordLayoutPass, true },
+    };
+    return passes;
+}
+
+const std::vector<AnnotationPipeline::Registration> &AnnotationPipeline::registered()
+{
+    return registry();
+}
+
+bool AnnotationPipeline::disable(llvm::StringRef name)
+{
+    for (auto &pass : registry()) {
+        if (name == pass.name) {
+            pass.enabled = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+AnnotationPipeline::AnnotationPipeline(Annotator &annotator)
+{
+    for (const auto &pass : registry()) {
+        if (pass.enabled)
+            passes.push_back({ pass.create(annotator), pass.phase });
+    }
+}
+
+AnnotationPipeline::~AnnotationPipeline() = default;
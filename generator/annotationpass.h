@@ -0,0 +1,128 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include "stats.h"
+#include "stringinterner.h"
+
+#include <llvm/ADT/StringRef.h>
+
+#include <memory>
+#include <vector>
+
+class Annotator;
+
+namespace clang {
+class CallExpr;
+class CXXConstructExpr;
+class Decl;
+class InitListExpr;
+class NamedDecl;
+}
+
+/**
+ * An optional part of the annotation, which can be disabled with --disable-pass to trade what
+ * it adds to the pages for the time it takes.
+ * BrowserASTVisitor and the Annotator hand the nodes to the passes through the pipeline of the
+ * Annotator. A pass only overrides the hooks it needs.
+ */
+class AnnotationPass
+{
+public:
+    virtual ~AnnotationPass() = default;
+
+    virtual void visitCallExpr(clang::CallExpr *, clang::NamedDecl * /*currentContext*/) { }
+    virtual void visitCXXConstructExpr(clang::CXXConstructExpr *, clang::NamedDecl *) { }
+    // Only the syntactic form of the non-trivial initializer lists
+    virtual void visitInitListExpr(clang::InitListExpr *) { }
+    // decl is added to the refs as ref, isDeclaration if it is not a use
+    virtual void visitReference(clang::Decl *, StringInterner::Id /*ref*/,
+                                bool /*isDeclaration*/)
+    {
+    }
+};
+
+/**
+ * The enabled passes, created for every translation unit. Each call to a pass is timed in the
+ * Stats phase of that pass (which is part of the Traverse phase).
+ */
+class AnnotationPipeline
+{
+public:
+    struct Registration
+    {
+        const char *name; // for --disable-pass
+        const char *description;
+        Stats::Phase phase;
+        std::unique_ptr<AnnotationPass> (*create)(Annotator &);
+        bool enabled;
+    };
+    // All the passes, in the order they are called
+    static const std::vector<Registration> &registered();
+    // Returns false if there is no pass with that name. To be called before any pipeline exists.
+    static bool disable(llvm::StringRef name);
+
+    explicit AnnotationPipeline(Annotator &annotator);
+    ~AnnotationPipeline();
+    AnnotationPipeline(const AnnotationPipeline &) = delete;
+    AnnotationPipeline &operator=(const AnnotationPipeline &) = delete;
+
+    void visitCallExpr(clang::CallExpr *e, clang::NamedDecl *currentContext)
+    {
+        forEach([&](AnnotationPass &pass) { pass.visitCallExpr(e, currentContext); });
+    }
+    void visitCXXConstructExpr(clang::CXXConstructExpr *e, clang::NamedDecl *currentContext)
+    {
+        forEach([&](AnnotationPass &pass) { pass.visitCXXConstructExpr(e, currentContext); });
+    }
+    void visitInitListExpr(clang::InitListExpr *e)
+    {
+        forEach([&](AnnotationPass &pass) { pass.visitInitListExpr(e); });
+    }
+    void visitReference(clang::Decl *decl, StringInterner::Id ref, bool isDeclaration)
+    {
+        forEach([&](AnnotationPass &pass) { pass.visitReference(decl, ref, isDeclaration); });
+    }
+
+private:
+    template<typename F>
+    void forEach(F &&f)
+    {
+        for (auto &p : passes) {
+            Stats::Timer timer(p.phase);
+            f(*p.pass);
+        }
+    }
+
+    struct Enabled
+    {
+        std::unique_ptr<AnnotationPass> pass;
+        Stats::Phase phase;
+    };
+    std::vector<Enabled> passes;
+};
+
+// The passes, defined next to the code they use
+std::unique_ptr<AnnotationPass> createParamHintsPass(Annotator &annotator);
+std::unique_ptr<AnnotationPass> createDesignatorHintsPass(Annotator &annotator);
+std::unique_ptr<AnnotationPass> createQtPass(Annotator &annotator);
+std::unique_ptr<AnnotationPass> createRecordLayoutPass(Annotator &annotator);
@@ -38,20 +38,24 @@
 #include <clang/Sema/Sema.h>
 #include <clang/Tooling/Tooling.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <time.h>
 
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Process.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "compat.h"
-#include "inlayhintannotator.h"
+#include "incremental.h"
 #include "projectmanager.h"
+#include "stats.h"
 #include "stringbuilder.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/fmt/fmt.h"
@@ -120,9 +124,39 @@ ssize_t getFieldOffset(const clang::Decl *decl)
     return layout.getFieldOffset(fd->getFieldIndex());
 }
 
+// The sizes of the classes and the offsets of their fields, shown in the tooltips. Computing
+// the layout of a record is expensive, and it is done for every record referenced.
+struct RecordLayoutPass : AnnotationPass
+{
+    Annotator &annotator;
+    explicit RecordLayoutPass(Annotator &annotator)
+        : annotator(annotator)
+    {
+    }
+
+    void visitReference(clang::Decl *decl, StringInterner::Id ref, bool isDeclaration) override
+    {
+        ssize_t size = getDeclSize(decl);
+        if (size >= 0)
+            annotator.setStructureSize(ref, size);
+        if (isDeclaration) {
+            ssize_t offset = getFieldOffset(decl);
+            if (offset >= 0)
+                annotator.setFieldOffset(ref, offset);
+        }
+    }
+};
+
 }
+
+std::unique_ptr<AnnotationPass> createRecordLayoutPass(Annotator &annotator)
+{
+    return std::make_unique<RecordLayoutPass>(annotator);
+}
+
 Annotator::Annotator(ProjectManager &pm)
         : projectManager(pm)
+        , passes(*this)
 {
 		SPDLOG_DEBUG("Annotator constructor");
 }
@@ -230,15 +264,20 @@ std::string Annotator::htmlNameForFile(clang::FileID id)
         cache[id] = { false, {} };
         return {};
     }
-    llvm::SmallString<256> filename;
-    canonicalize(entry->getName(), filename);
-
-    ProjectInfo *project = projectManager.projectForFile(filename);
+    const auto &resolved = projectManager.resolve(entry->getName());
+    const std::string &filename = resolved.canonical;
+    ProjectInfo *project = resolved.project;
     if (project) {
         bool should_process = projectManager.shouldProcess(filename, project);
         project_cache[id] = project;
-        std::string fn = project->name % "/" % filename.substr(project->source_path.size());
+        const std::string &fn = resolved.htmlName;
         cache[id] = { should_process, fn };
+        if (!should_process && projectManager.isSharded()
+            && !projectManager.isInShard(filename, project)
+            && project->type != ProjectInfo::External) {
+            projectManager.addForeignFile(filename, project,
+                                          htmlNameForFile(getSourceMgr().getMainFileID()));
+        }
         return fn;
     }
 
@@ -351,30 +390,65 @@ bool Annotator::generate(clang::Sema &Sema, bool WasInDatabase)
                    interestingDefinitionsInFile[FID]);
 
 #endif
-
-        if (projectinfo.type == ProjectInfo::Normal)
-            AddFileIndex(fn);
+        // "<file>\t<definitions>", the same list as in the woboq:interestingDefinitions meta
+        std::string metaLine;
+        const auto &interesting = interestingDefinitionsInFile[FID];
+        if (!interesting.empty())
+            metaLine = fn % "\t" % llvm::join(interesting.begin(), interesting.end(), ",") % "\n";
+
+        // Not needed anymore: free the tags now rather than with the Annotator, so they do not
+        // pile up for the translation units which include many files
+        generators.erase(FID);
+        interestingDefinitionsInFile.erase(FID);
+
+        if (journal) {
+            const auto &source
+                = projectManager.resolve(getSourceMgr().getFileEntryForID(FID)->getName());
+            journal->add(TUJournal::Html, fn + ".html", source.canonical);
+        }
+        if (projectinfo.type == ProjectInfo::Normal) {
+            if (journal)
+                journal->add(TUJournal::FileIndex, "fileIndex", fn + '\n');
+            else
+                AddFileIndex(fn);
+            if (!metaLine.empty()) {
+                if (journal)
+                    journal->add(TUJournal::FileIndex, "fileIndexMeta", metaLine);
+                else
+                    projectManager.AddFileIndexMeta(metaLine);
+            }
+        }
     }
 
+    generators.clear(); // the ones of the files not generated
+
     // make sure all the docs are in the references
     // (There might not be when the comment is in the .cpp file (for \class))
-    for (auto it : commentHandler.docs)
-        references[it.first];
-
-    for (const auto &it : references) {
-        if (llvm::StringRef(it.first).startswith("__builtin"))
+    for (const auto &it : commentHandler.docs)
+        references[interner.intern(it.first)];
+
+    Stats::Timer timer(Stats::Refs);
+    for (Id id : interner.sortedKeys(references)) {
+        // Freed once written, so the memory goes down while the records are written
+        std::vector<Reference> refs = std::move(references[id]);
+        llvm::StringRef ref = interner.str(id);
+        if (ref.startswith("__builtin"))
             continue;
-        if (it.first == "main")
+        if (ref == "main")
             continue;
 
-        auto refFilename = it.first;
+        std::string refFilename = ref.str();
         replace_invalid_filename_chars(refFilename);
 
         std::string filename = projectManager.outputPrefix % "/refs/" % refFilename % mp_suffix;
-		auto& myfile0 = GetRefFile(filename);
 		std::string bindstr;
 		llvm::raw_string_ostream myfile(bindstr);
-        for (const auto &it2 : it.second) {
+        // Filter out the records already written by a previous translation unit.
+        // (Not with a journal: it must have all the records, the other journals may be retracted)
+        auto isNewRecord = [&](const auto &...fields) {
+            return journal || projectManager.addRefRecord(llvm::hash_combine(ref, fields...));
+        };
+        for (const auto &it2 : refs) {
             clang::SourceRange loc = it2.loc;
             clang::SourceManager &sm = getSourceMgr();
             clang::SourceLocation expBegin = sm.getExpansionLoc(loc.getBegin());
@@ -424,6 +498,13 @@ bool Annotator::generate(clang::Sema &Sema, bool WasInDatabase)
                 tag = "inh";
             }
 
+            llvm::StringRef refType = interner.str(it2.typeOrContext);
+            unsigned endLine = fixedEnd.isValid() ? fixedEnd.getLine() : 0;
+            if (!isNewRecord(llvm::StringRef(tag), usetype, llvm::StringRef(fn),
+                             fixedBegin.getLine(), endLine, loc.getBegin().isMacroID(),
+                             WasInDatabase, refType))
+                continue;
+
             myfile << "<" << tag << " f='";
             Generator::escapeAttr(myfile, fn);
             myfile << "' l='" << fixedBegin.getLine() << "'";
@@ -435,37 +516,49 @@ bool Annotator::generate(clang::Sema &Sema, bool WasInDatabase)
                 myfile << " brk='1'";
             if (usetype)
                 myfile << " u='" << usetype << "'";
-            const auto &refType = it2.typeOrContext;
             if (!refType.empty()) {
                 myfile << ((it2.what < Use) ? " type='" : " c='");
                 Generator::escapeAttr(myfile, refType);
                 myfile << "'";
             }
             myfile << "/>\n";
+            Stats::add(Stats::References);
         }
-        auto itS = structure_sizes.find(it.first);
-        if (itS != structure_sizes.end() && itS->second != -1) {
+        auto itS = structure_sizes.find(id);
+        if (itS != structure_sizes.end() && itS->second != -1
+            && isNewRecord(llvm::StringRef("size"), itS->second)) {
             myfile << "<size>" << itS->second << "</size>\n";
         }
-        auto itF = field_offsets.find(it.first);
-        if (itF != field_offsets.end() && itF->second != -1) {
+        auto itF = field_offsets.find(id);
+        if (itF != field_offsets.end() && itF->second != -1
+            && isNewRecord(llvm::StringRef("offset"), itF->second)) {
             myfile << "<offset>" << itF->second << "</offset>\n";
         }
-        auto range = commentHandler.docs.equal_range(it.first);
+        auto range = commentHandler.docs.equal_range(ref);
         for (auto it2 = range.first; it2 != range.second; ++it2) {
             clang::SourceManager &sm = getSourceMgr();
             clang::SourceLocation exp = sm.getExpansionLoc(it2->second.loc);
             clang::PresumedLoc fixed = sm.getPresumedLoc(exp);
             std::string fn = htmlNameForFile(sm.getFileID(exp));
+            if (!isNewRecord(llvm::StringRef("doc"), llvm::StringRef(fn), fixed.getLine(),
+                             llvm::StringRef(it2->second.content)))
+                continue;
             myfile << "<doc f='";
             Generator::escapeAttr(myfile, fn);
             myfile << "' l='" << fixed.getLine() << "'>";
             Generator::escapeAttr(myfile, it2->second.content);
             myfile << "</doc>\n";
         }
-        auto itU = sub_refs.find(it.first);
+        commentHandler.docs.erase(range.first, range.second);
+        auto itU = sub_refs.find(id);
         if (itU != sub_refs.end()) {
             for (const auto &sub : itU->second) {
+                llvm::StringRef r = interner.str(sub.ref);
+                llvm::StringRef type = interner.str(sub.type);
+                auto itF = field_offsets.find(sub.ref);
+                ssize_t offset = itF != field_offsets.end() ? itF->second : -1;
+                if (!isNewRecord(llvm::StringRef("sub"), sub.what, r, offset, type))
+                    continue;
                 switch (sub.what) {
                 case SubRef::Function:
                     myfile << "<fun ";
@@ -479,22 +572,31 @@ bool Annotator::generate(clang::Sema &Sema, bool WasInDatabase)
                 case SubRef::None:
                     continue; // should not happen
                 }
-                const auto &r = sub.ref;
                 myfile << "r='" << Generator::EscapeAttr { r } << "'";
-                auto itF = field_offsets.find(r);
-                if (itF != field_offsets.end() && itF->second != -1)
-                    myfile << " o='" << itF->second << "'";
-                if (!sub.type.empty())
-                    myfile << " t='" << Generator::EscapeAttr { sub.type } << "'";
+                if (offset != -1)
+                    myfile << " o='" << offset << "'";
+                if (!type.empty())
+                    myfile << " t='" << Generator::EscapeAttr { type } << "'";
                 myfile << "/>\n";
             }
+            sub_refs.erase(itU);
+        }
+        Stats::add(Stats::BytesWritten, myfile.str().size());
+        if (journal) {
+            journal->add(TUJournal::Ref, "refs/" + refFilename, myfile.str());
+            continue;
         }
-    	myfile0.AppendLine_Locked(myfile.str());
+        // still create the file, even if all its records were already written
+        auto &myfile0 = GetRefFile(filename);
+        if (!myfile.str().empty())
+            myfile0.AppendLine_Locked(myfile.str());
     }
+    references.clear();
+    sub_refs.clear();
 
     // now the function names
-    for (auto &fnIt : functionIndex) {
-        auto fnName = fnIt.first;
+    for (Id nameId : interner.sortedKeys(functionIndex)) {
+        std::string fnName = interner.str(nameId).str();
         if (fnName.size() < 4)
             continue;
         if (fnName.find("__") != std::string::npos)
@@ -526,14 +628,20 @@ bool Annotator::generate(clang::Sema &Sema, bool WasInDatabase)
 
 				std::string bindStr;
 				llvm::raw_string_ostream indexFile(bindStr);
-                indexFile << fnIt.second << '|' << fnIt.first << '\n';
-
-				auto& funcIndexFile = GetFuncIndexFile(funcIndexFN);
-				funcIndexFile.AppendLine_Locked(indexFile.str());
+                indexFile << interner.str(functionIndex[nameId]) << '|' << fnName << '\n';
+                Stats::add(Stats::BytesWritten, indexFile.str().size());
+
+				if (journal) {
+					journal->add(TUJournal::FuncIndex, std::string("fnSearch/") + idx, indexFile.str());
+				} else {
+					auto& funcIndexFile = GetFuncIndexFile(funcIndexFN);
+					funcIndexFile.AppendLine_Locked(indexFile.str());
+				}
                 saved.append(idxRef); // include \0;
             }
         }
     }
+    functionIndex.clear();
     return true;
 }
 
@@ -580,23 +688,17 @@ std::string Annotator::pathTo(clang::FileID From, const clang::FileEntry *To)
 
     std::string fromFN = htmlNameForFile(From);
 
-    llvm::SmallString<256> filename;
-    canonicalize(To->getName(), filename);
-
-
-    ProjectInfo *project = projectManager.projectForFile(filename);
+    const auto &resolved = projectManager.resolve(To->getName());
+    ProjectInfo *project = resolved.project;
     if (!project)
         return {};
 
     if (project->type == ProjectInfo::External) {
-        return project->external_root_url % "/" % project->name % "/"
-            % (filename.c_str() + project->source_path.size()) % ".html";
+        return project->external_root_url % "/" % resolved.htmlName % ".html";
     }
 
-    return naive_uncomplete(
-        llvm::sys::path::parent_path(fromFN),
-        std::string(project->name % "/" % (filename.c_str() + project->source_path.size())
-                    % ".html"));
+    return naive_uncomplete(llvm::sys::path::parent_path(fromFN),
+                            std::string(resolved.htmlName % ".html"));
 }
 
 static const clang::Decl *getDefinitionDecl(clang::Decl *decl)
@@ -699,7 +801,7 @@ void Annotator::registerReference(clang::NamedDecl *decl, clang::SourceRange ran
             }
         } else {
             auto cached = getReferenceAndTitle(decl);
-            ref = cached.first;
+            ref = cached.first.str();
             tags %= " title='" % cached.second % "'";
         }
 
@@ -715,7 +817,8 @@ void Annotator::registerReference(clang::NamedDecl *decl, clang::SourceRange ran
 
             if (declType == Definition && ref.find('{') >= ref.size()) {
                 if (clang::FunctionDecl *fun = llvm::dyn_cast<clang::FunctionDecl>(decl)) {
-                    functionIndex.insert({ fun->getQualifiedNameAsString(), ref });
+                    functionIndex.insert(
+                        { interner.intern(fun->getQualifiedNameAsString()), interner.intern(ref) });
                 }
             }
         } else {
@@ -856,29 +959,23 @@ void Annotator::registerReference(clang::NamedDecl *decl, clang::SourceRange ran
     }
 }
 
-void Annotator::addReference(const std::string &ref, clang::SourceRange refLoc, TokenType type,
+void Annotator::addReference(llvm::StringRef ref, clang::SourceRange refLoc, TokenType type,
                              DeclType dt, const std::string &typeRef, clang::Decl *decl)
 {
     if (type == Ref || type == Member || type == Decl || type == Call || type == EnumDecl
         || (type == Type && dt != Use_NestedName && dt != Declaration)
         || (type == Enum && dt == Definition)) {
-        ssize_t size = getDeclSize(decl);
-        if (size >= 0) {
-            structure_sizes[ref] = size;
-        }
-        references[ref].push_back({ dt, refLoc, typeRef });
+        Id id = interner.intern(ref);
+        passes.visitReference(decl, id, dt < Use);
+        references[id].push_back({ dt, refLoc, interner.intern(typeRef) });
         if (dt < Use) {
-            ssize_t offset = getFieldOffset(decl);
-            if (offset >= 0) {
-                field_offsets[ref] = offset;
-            }
             clang::FullSourceLoc fulloc(decl->getSourceRange().getBegin(), getSourceMgr());
-            commentHandler.decl_offsets.insert({ fulloc.getSpellingLoc(), { ref, true } });
+            commentHandler.decl_offsets.insert({ fulloc.getSpellingLoc(), { ref.str(), true } });
             if (auto parentStruct = llvm::dyn_cast<clang::RecordDecl>(decl->getDeclContext())) {
                 auto parentRef = getReferenceAndTitle(parentStruct).first;
                 if (!parentRef.empty()) {
                     SubRef sr;
-                    sr.ref = ref;
+                    sr.ref = id;
                     if (decl->isFunctionOrFunctionTemplate())
                         sr.what = SubRef::Function;
                     else if (llvm::isa<clang::FieldDecl>(decl))
@@ -886,8 +983,8 @@ void Annotator::addReference(const std::string &ref, clang::SourceRange refLoc,
                     else if (llvm::isa<clang::VarDecl>(decl))
                         sr.what = SubRef::Static;
                     if (sr.what != SubRef::Function)
-                        sr.type = typeRef;
-                    sub_refs[parentRef].push_back(sr);
+                        sr.type = interner.intern(typeRef);
+                    sub_refs[interner.intern(parentRef)].push_back(sr);
                 }
             }
         }
@@ -905,8 +1002,8 @@ void Annotator::registerOverride(clang::NamedDecl *decl, clang::NamedDecl *overr
     if (getVisibility(overrided) != Visibility::Global)
         return;
 
-    auto ovrRef = getReferenceAndTitle(overrided).first;
-    auto declRef = getReferenceAndTitle(decl).first;
+    Id ovrRef = interner.intern(getReferenceAndTitle(overrided).first);
+    Id declRef = interner.intern(getReferenceAndTitle(decl).first);
     references[ovrRef].push_back({ Override, expensionloc, declRef });
 
     // Register the reversed relation.
@@ -917,7 +1014,7 @@ void Annotator::registerOverride(clang::NamedDecl *decl, clang::NamedDecl *overr
 void Annotator::registerMacro(const std::string &ref, clang::SourceLocation refLoc,
                               DeclType declType)
 {
-    references[ref].push_back({ declType, refLoc, std::string() });
+    references[interner.intern(ref)].push_back({ declType, refLoc, 0 });
     if (declType == Annotator::Declaration) {
         commentHandler.decl_offsets.insert({ refLoc, { ref, true } });
     }
@@ -1029,11 +1126,13 @@ static std::string getQualifiedName(clang::NamedDecl *decl)
 }
 
 
-std::pair<std::string, std::string> Annotator::getReferenceAndTitle(clang::NamedDecl *decl)
+std::pair<llvm::StringRef, llvm::StringRef> Annotator::getReferenceAndTitle(clang::NamedDecl *decl)
 {
     clang::Decl *canonDecl = decl->getCanonicalDecl();
-    auto &cached = mangle_cache[canonDecl];
-    if (cached.first.empty()) {
+    auto it = mangle_cache.find(canonDecl);
+    if (it == mangle_cache.end()) {
+        // Not a reference into mangle_cache: the recursive calls may grow it
+        std::pair<std::string, std::string> cached;
         decl = getSpecializedCursorTemplate(decl);
 
         std::string qualName = getQualifiedName(decl);
@@ -1084,7 +1183,7 @@ std::pair<std::string, std::string> Annotator::getReferenceAndTitle(clang::Named
 #endif
         } else if (clang::FieldDecl *d = llvm::dyn_cast<clang::FieldDecl>(decl)) {
             cached.first =
-                getReferenceAndTitle(d->getParent()).first + "::" + decl->getName().str();
+                (getReferenceAndTitle(d->getParent()).first + "::" + decl->getName()).str();
         } else {
             cached.first = qualName;
             cached.first.erase(std::remove(cached.first.begin(), cached.first.end(), ' '),
@@ -1103,8 +1202,12 @@ std::pair<std::string, std::string> Annotator::getReferenceAndTitle(clang::Named
             buffer.clear();
             cached.first += llvm::Twine(hash).toStringRef(buffer);
         }
+        it = mangle_cache
+                 .try_emplace(canonDecl, interner.intern(cached.first),
+                              interner.intern(cached.second))
+                 .first;
     }
-    return cached;
+    return { interner.str(it->second.first), interner.str(it->second.second) };
 }
 
 
@@ -1124,7 +1227,7 @@ std::string Annotator::getContextStr(clang::NamedDecl *usedContext)
         context = context->getParent();
     }
     if (fun)
-        return getReferenceAndTitle(fun).first;
+        return getReferenceAndTitle(fun).first.str();
     return {};
 }
 
@@ -1132,7 +1235,7 @@ std::string Annotator::getVisibleRef(clang::NamedDecl *Decl)
 {
     if (getVisibility(Decl) != Visibility::Global)
         return {};
-    return getReferenceAndTitle(Decl).first;
+    return getReferenceAndTitle(Decl).first.str();
 }
 
 // return the classes to add in the span
@@ -1147,6 +1250,101 @@ std::string Annotator::computeClas(clang::NamedDecl *decl)
 }
 
 
+// Highlights a keyword or a literal. 'identifier' is true if the token is spelled like an
+// identifier, as the keywords are (including the C++ operator keywords such as 'and')
+static void highlightToken(Generator &generator, clang::tok::TokenKind kind, bool identifier,
+                           unsigned TokOffs, unsigned TokLen)
+{
+    using namespace clang;
+    if (identifier) {
+        // If this is a pp-identifier, for a keyword, highlight it as such.
+        switch (kind) {
+        case tok::identifier:
+            break;
+
+        case tok::kw_auto:
+        case tok::kw_char:
+        case tok::kw_const:
+        case tok::kw_double:
+        case tok::kw_float:
+        case tok::kw_int:
+        case tok::kw_long:
+        case tok::kw_register:
+            //                    case tok::kw_restrict:  // ???  (type or not)
+        case tok::kw_short:
+        case tok::kw_signed:
+        case tok::kw_static:
+        case tok::kw_unsigned:
+        case tok::kw_void:
+        case tok::kw_volatile:
+        case tok::kw_bool:
+        case tok::kw_mutable:
+        case tok::kw_wchar_t:
+        case tok::kw_char16_t:
+        case tok::kw_char32_t:
+            generator.addTag("em", {}, TokOffs, TokLen);
+            break;
+        default: // other keywords
+            generator.addTag("b", {}, TokOffs, TokLen);
+        }
+        return;
+    }
+    switch (kind) {
+    default:
+        break;
+    case tok::utf8_string_literal:
+        // Chop off the u part of u8 prefix
+        ++TokOffs;
+        --TokLen;
+        LLVM_FALLTHROUGH;
+    case tok::wide_string_literal:
+    case tok::utf16_string_literal:
+    case tok::utf32_string_literal:
+        // Chop off the L, u, U or 8 prefix
+        ++TokOffs;
+        --TokLen;
+        LLVM_FALLTHROUGH;
+    case tok::string_literal:
+        // FIXME: Exclude the optional ud-suffix from the highlighted range.
+        generator.addTag("q", {}, TokOffs, TokLen);
+        break;
+
+    case tok::wide_char_constant:
+    case tok::utf16_char_constant:
+    case tok::utf32_char_constant:
+        ++TokOffs;
+        --TokLen;
+        LLVM_FALLTHROUGH;
+    case tok::char_constant:
+        generator.addTag("kbd", {}, TokOffs, TokLen);
+        break;
+    case tok::numeric_constant:
+        generator.addTag("var", {}, TokOffs, TokLen);
+        break;
+    }
+}
+
+void Annotator::recordToken(const clang::Token &Tok)
+{
+    // The annotation tokens of the pragma handlers have a file location too, but no length
+    if (Tok.isAnnotation())
+        return;
+    clang::SourceLocation loc = Tok.getLocation();
+    if (!loc.isFileID() || Tok.is(clang::tok::eof))
+        return; // the tokens of the macro expansions are highlighted from their spelling
+    auto decomposed = getSourceMgr().getDecomposedLoc(loc);
+    // Most tokens come from the same file as the previous one
+    if (decomposed.first != lastRecordedFile) {
+        lastRecordedFile = decomposed.first;
+        lastRecordedTokens
+            = shouldProcess(decomposed.first) ? &recordedTokens[decomposed.first] : nullptr;
+    }
+    if (lastRecordedTokens) {
+        lastRecordedTokens->push_back({ decomposed.second, Tok.getLength(), Tok.getKind(),
+                                        Tok.getIdentifierInfo() != nullptr });
+    }
+}
+
 /* This function is inspired From clang::html::SyntaxHighlight() from HTMLRewrite.cpp
  * from the clang 3.1 from The LLVM Compiler Infrastructure
  * distributed under the University of Illinois Open Source
@@ -1157,6 +1355,7 @@ std::string Annotator::computeClas(clang::NamedDecl *decl)
 void Annotator::syntaxHighlight(Generator &generator, clang::FileID FID, clang::Sema &Sema)
 {
     using namespace clang;
+    Stats::Timer timer(Stats::Highlight);
 
     const clang::Preprocessor &PP = Sema.getPreprocessor();
     const clang::SourceManager &SM = getSourceMgr();
@@ -1165,183 +1364,166 @@ void Annotator::syntaxHighlight(Generator &generator, clang::FileID FID, clang::
     if (!FromFile.has_value()) {
         return;
     }
-    Lexer L(FID, *FromFile, SM, getLangOpts());
 #elif CLANG_VERSION_MAJOR >= 12
     const llvm::Optional<llvm::MemoryBufferRef> FromFile = SM.getBufferOrNone(FID);
     if (!FromFile.hasValue()) {
         return;
     }
-    Lexer L(FID, FromFile.getValue(), SM, getLangOpts());
 #else
     const llvm::MemoryBuffer *FromFile = SM.getBuffer(FID);
-    Lexer L(FID, FromFile, SM, getLangOpts());
 #endif
     const char *BufferStart = FromFile->getBufferStart();
     const char *BufferEnd = FromFile->getBufferEnd();
+    const unsigned BufferSize = BufferEnd - BufferStart;
 
-    // Inform the preprocessor that we want to retain comments as tokens, so we
-    // can highlight them.
-    L.SetCommentRetentionState(true);
-
-    // Lex all the tokens in raw mode, to avoid entering #includes or expanding
-    // macros.
-    Token Tok;
-    L.LexFromRawLexer(Tok);
-
-    while (Tok.isNot(tok::eof)) {
-        // Since we are lexing unexpanded tokens, all tokens are from the main
-        // FileID.
-        unsigned TokOffs = SM.getFileOffset(Tok.getLocation());
-        unsigned TokLen = Tok.getLength();
-        switch (Tok.getKind()) {
-        default:
-            break;
-        case tok::identifier:
-            llvm_unreachable("tok::identifier in raw lexing mode!");
-        case tok::raw_identifier: {
-            // Fill in Result.IdentifierInfo and update the token kind,
-            // looking up the identifier in the identifier table.
-            PP.LookUpIdentifierInfo(Tok);
-            // If this is a pp-identifier, for a keyword, highlight it as such.
+    // Lexes the file from the offset 'pos' and highlights the tokens until the first one at or
+    // after 'limit', whose offset is returned.
+    auto highlightRaw = [&](unsigned pos, unsigned limit) -> unsigned {
+        Lexer L(SM.getLocForStartOfFile(FID), getLangOpts(), BufferStart, BufferStart + pos,
+                BufferEnd);
+
+        // Inform the preprocessor that we want to retain comments as tokens, so we
+        // can highlight them.
+        L.SetCommentRetentionState(true);
+
+        // Lex all the tokens in raw mode, to avoid entering #includes or expanding
+        // macros.
+        Token Tok;
+        L.LexFromRawLexer(Tok);
+        if (pos > 0) {
+            // The lexer assumes that it starts at the beginning of a line
+            const char *p = BufferStart + SM.getFileOffset(Tok.getLocation());
+            while (p > BufferStart && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\f'
+                                       || p[-1] == '\v'))
+                --p;
+            if (p > BufferStart && p[-1] != '\n' && p[-1] != '\r')
+                Tok.clearFlag(Token::StartOfLine);
+        }
+
+        while (Tok.isNot(tok::eof)) {
+            // Since we are lexing unexpanded tokens, all tokens are from the main
+            // FileID.
+            unsigned TokOffs = SM.getFileOffset(Tok.getLocation());
+            unsigned TokLen = Tok.getLength();
+            if (TokOffs >= limit)
+                return TokOffs;
             switch (Tok.getKind()) {
+            default:
+                highlightToken(generator, Tok.getKind(), false, TokOffs, TokLen);
+                break;
             case tok::identifier:
+                llvm_unreachable("tok::identifier in raw lexing mode!");
+            case tok::raw_identifier:
+                // Fill in Result.IdentifierInfo and update the token kind,
+                // looking up the identifier in the identifier table.
+                PP.LookUpIdentifierInfo(Tok);
+                highlightToken(generator, Tok.getKind(), true, TokOffs, TokLen);
                 break;
+            case tok::comment: {
+                unsigned int CommentBegin = TokOffs;
+                unsigned int CommentLen = TokLen;
+                bool startOfLine = Tok.isAtStartOfLine();
+                SourceLocation CommentBeginLocation = Tok.getLocation();
+                L.LexFromRawLexer(Tok);
+                // Merge consecutive comments
+                if (startOfLine /*&&  BufferStart[CommentBegin+1] == '/'*/) {
+                    while (Tok.is(tok::comment)) {
+                        unsigned int Off = SM.getFileOffset(Tok.getLocation());
+                        if (BufferStart[Off + 1] != '/')
+                            break;
+                        CommentLen = Off + Tok.getLength() - CommentBegin;
+                        L.LexFromRawLexer(Tok);
+                    }
+                }
 
-            case tok::kw_auto:
-            case tok::kw_char:
-            case tok::kw_const:
-            case tok::kw_double:
-            case tok::kw_float:
-            case tok::kw_int:
-            case tok::kw_long:
-            case tok::kw_register:
-                //                    case tok::kw_restrict:  // ???  (type or not)
-            case tok::kw_short:
-            case tok::kw_signed:
-            case tok::kw_static:
-            case tok::kw_unsigned:
-            case tok::kw_void:
-            case tok::kw_volatile:
-            case tok::kw_bool:
-            case tok::kw_mutable:
-            case tok::kw_wchar_t:
-            case tok::kw_char16_t:
-            case tok::kw_char32_t:
-                generator.addTag("em", {}, TokOffs, TokLen);
-                break;
-            default: // other keywords
-                generator.addTag("b", {}, TokOffs, TokLen);
+                std::string attributes;
+
+                if (startOfLine) {
+                    unsigned int NonCommentBegin = SM.getFileOffset(Tok.getLocation());
+                    // Find the location of the next \n
+                    const char *nl_it = BufferStart + NonCommentBegin;
+                    while (nl_it < BufferEnd && *nl_it && *nl_it != '\n')
+                        ++nl_it;
+                    commentHandler.handleComment(
+                        *this, generator, Sema, BufferStart, CommentBegin, CommentLen,
+                        Tok.getLocation(),
+                        Tok.getLocation().getLocWithOffset(nl_it - (BufferStart + NonCommentBegin)),
+                        CommentBeginLocation);
+                } else {
+                    // look up the location before
+                    const char *nl_it = BufferStart + CommentBegin;
+                    while (nl_it > BufferStart && *nl_it && *nl_it != '\n')
+                        --nl_it;
+                    commentHandler.handleComment(
+                        *this, generator, Sema, BufferStart, CommentBegin, CommentLen,
+                        CommentBeginLocation.getLocWithOffset(nl_it - (BufferStart + CommentBegin)),
+                        CommentBeginLocation, CommentBeginLocation);
+                }
+                continue; // Don't skip next token
             }
-            break;
-        }
-        case tok::comment: {
-            unsigned int CommentBegin = TokOffs;
-            unsigned int CommentLen = TokLen;
-            bool startOfLine = Tok.isAtStartOfLine();
-            SourceLocation CommentBeginLocation = Tok.getLocation();
-            L.LexFromRawLexer(Tok);
-            // Merge consecutive comments
-            if (startOfLine /*&&  BufferStart[CommentBegin+1] == '/'*/) {
-                while (Tok.is(tok::comment)) {
-                    unsigned int Off = SM.getFileOffset(Tok.getLocation());
-                    if (BufferStart[Off + 1] != '/')
-                        break;
-                    CommentLen = Off + Tok.getLength() - CommentBegin;
+            case tok::hash: {
+                // If this is a preprocessor directive, all tokens to end of line are too.
+                if (!Tok.isAtStartOfLine())
+                    break;
+
+                // Eat all of the tokens until we get to the next one at the start of
+                // line.
+                unsigned TokEnd = TokOffs + TokLen;
+                L.LexFromRawLexer(Tok);
+                while (!Tok.isAtStartOfLine() && Tok.isNot(tok::eof)) {
+                    TokEnd = SM.getFileOffset(Tok.getLocation()) + Tok.getLength();
                     L.LexFromRawLexer(Tok);
                 }
-            }
 
-            std::string attributes;
-
-            if (startOfLine) {
-                unsigned int NonCommentBegin = SM.getFileOffset(Tok.getLocation());
-                // Find the location of the next \n
-                const char *nl_it = BufferStart + NonCommentBegin;
-                while (nl_it < BufferEnd && *nl_it && *nl_it != '\n')
-                    ++nl_it;
-                commentHandler.handleComment(
-                    *this, generator, Sema, BufferStart, CommentBegin, CommentLen,
-                    Tok.getLocation(),
-                    Tok.getLocation().getLocWithOffset(nl_it - (BufferStart + NonCommentBegin)),
-                    CommentBeginLocation);
-            } else {
-                // look up the location before
-                const char *nl_it = BufferStart + CommentBegin;
-                while (nl_it > BufferStart && *nl_it && *nl_it != '\n')
-                    --nl_it;
-                commentHandler.handleComment(
-                    *this, generator, Sema, BufferStart, CommentBegin, CommentLen,
-                    CommentBeginLocation.getLocWithOffset(nl_it - (BufferStart + CommentBegin)),
-                    CommentBeginLocation, CommentBeginLocation);
-            }
-            continue; // Don't skip next token
-        }
-        case tok::utf8_string_literal:
-            // Chop off the u part of u8 prefix
-            ++TokOffs;
-            --TokLen;
-            LLVM_FALLTHROUGH;
-        case tok::wide_string_literal:
-        case tok::utf16_string_literal:
-        case tok::utf32_string_literal:
-            // Chop off the L, u, U or 8 prefix
-            ++TokOffs;
-            --TokLen;
-            LLVM_FALLTHROUGH;
-        case tok::string_literal:
-            // FIXME: Exclude the optional ud-suffix from the highlighted range.
-            generator.addTag("q", {}, TokOffs, TokLen);
-            break;
+                generator.addTag("u", {}, TokOffs, TokEnd - TokOffs);
 
-        case tok::wide_char_constant:
-        case tok::utf16_char_constant:
-        case tok::utf32_char_constant:
-            ++TokOffs;
-            --TokLen;
-            LLVM_FALLTHROUGH;
-        case tok::char_constant:
-            generator.addTag("kbd", {}, TokOffs, TokLen);
-            break;
-        case tok::numeric_constant:
-            generator.addTag("var", {}, TokOffs, TokLen);
-            break;
-        case tok::hash: {
-            // If this is a preprocessor directive, all tokens to end of line are too.
-            if (!Tok.isAtStartOfLine())
-                break;
+                // Don't skip the next token.
+                continue;
+            }
+            }
 
-            // Eat all of the tokens until we get to the next one at the start of
-            // line.
-            unsigned TokEnd = TokOffs + TokLen;
             L.LexFromRawLexer(Tok);
-            while (!Tok.isAtStartOfLine() && Tok.isNot(tok::eof)) {
-                TokEnd = SM.getFileOffset(Tok.getLocation()) + Tok.getLength();
-                L.LexFromRawLexer(Tok);
-            }
+        }
+        return BufferSize;
+    };
 
-            generator.addTag("u", {}, TokOffs, TokEnd - TokOffs);
+    auto recorded = recordedTokens.find(FID);
+    if (recorded == recordedTokens.end()) {
+        highlightRaw(0, BufferSize);
+        return;
+    }
 
-            // Don't skip the next token.
+    // --reuse-tokens: the tokens the parser got from this file are not lexed again, only the
+    // text between them is: the comments, the directives, the blocks skipped by #if, and the
+    // macro names and arguments.
+    auto &tokens = recorded->second;
+    auto byOffset = [](const RecordedToken &a, const RecordedToken &b) {
+        return a.offset < b.offset;
+    };
+    if (!std::is_sorted(tokens.begin(), tokens.end(), byOffset))
+        std::stable_sort(tokens.begin(), tokens.end(), byOffset);
+    auto isSpace = [](char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+    };
+    unsigned pos = 0;
+    auto it = tokens.begin();
+    while (pos < BufferSize) {
+        // Skip the tokens already highlighted, and the ones in a directive (#pragma) or
+        // recorded twice when the parser backtracked
+        while (it != tokens.end() && it->offset < pos)
+            ++it;
+        unsigned next = it != tokens.end() ? it->offset : BufferSize;
+        if (!std::all_of(BufferStart + pos, BufferStart + next, isSpace)) {
+            pos = highlightRaw(pos, next);
             continue;
         }
-        }
-
-        L.LexFromRawLexer(Tok);
+        if (it == tokens.end())
+            break;
+        highlightToken(generator, it->kind, it->identifier, it->offset, it->length);
+        pos = it->offset + it->length;
+        ++it;
     }
+    recordedTokens.erase(recorded);
+    lastRecordedFile = {};
+    lastRecordedTokens = nullptr;
 }
-
-std::string Annotator::getParamNameForArg(clang::CallExpr *callExpr, clang::ParmVarDecl *paramDecl,
-                                          clang::Expr *arg)
-{
-    return InlayHintsAnnotatorHelper(this).getParamNameInlayHint(callExpr, paramDecl, arg);
-}
-
-llvm::DenseMap<clang::SourceLocation, std::string>
-Annotator::getDesignatorInlayHints(clang::InitListExpr *Syn)
-{
-    InlayHintsAnnotatorHelper helper(this);
-    return helper.getDesignatorInlayHints(Syn);
-}
-
-
-
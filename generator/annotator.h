@@ -21,10 +21,14 @@
 
 #pragma once
 
+#include "annotationpass.h"
 #include "commenthandler.h"
 #include "generator.h"
+#include "stringinterner.h"
 #include <clang/AST/Mangle.h>
 #include <clang/Basic/SourceLocation.h>
+#include <clang/Basic/TokenKinds.h>
+#include <llvm/ADT/DenseMap.h>
 #include <map>
 #include <set>
 #include <string>
@@ -35,6 +39,7 @@
 
 struct ProjectManager;
 struct ProjectInfo;
+class TUJournal;
 class PreprocessorCallback;
 
 namespace clang {
@@ -45,6 +50,7 @@ class Type;
 class QualType;
 class Decl;
 class FileEntry;
+class Token;
 }
 
 /* Wrapper for the change in the name in clang 3.5 */
@@ -116,22 +122,27 @@ private:
 
     std::string htmlNameForFile(clang::FileID id); // keep a cache;
 
-    void addReference(const std::string &ref, clang::SourceRange refLoc, Annotator::TokenType type,
+    void addReference(llvm::StringRef ref, clang::SourceRange refLoc, Annotator::TokenType type,
                       Annotator::DeclType dt, const std::string &typeRef, clang::Decl *decl);
 
+    // The refs, types and names of this translation unit. The tables below are keyed by their id,
+    // and sorted by name when they are written.
+    StringInterner interner;
+    using Id = StringInterner::Id;
+
     struct Reference
     {
         DeclType what;
         clang::SourceRange loc;
-        std::string typeOrContext;
+        Id typeOrContext;
     };
-    std::map<std::string, std::vector<Reference>> references;
-    std::map<std::string, ssize_t> structure_sizes;
-    std::map<std::string, ssize_t> field_offsets;
+    llvm::DenseMap<Id, std::vector<Reference>> references;
+    llvm::DenseMap<Id, ssize_t> structure_sizes;
+    llvm::DenseMap<Id, ssize_t> field_offsets;
     struct SubRef
     {
-        std::string ref;
-        std::string type;
+        Id ref = 0;
+        Id type = 0;
         enum Type {
             None,
             Function,
@@ -139,28 +150,40 @@ private:
             Static
         } what = None;
     };
-    std::map<std::string, std::vector<SubRef>> sub_refs;
+    llvm::DenseMap<Id, std::vector<SubRef>> sub_refs;
     std::unordered_map<pathTo_cache_key_t, std::string> pathTo_cache;
     CommentHandler commentHandler;
 
     std::unique_ptr<clang::MangleContext> mangle;
-    std::unordered_map<void *, std::pair<std::string, std::string>> mangle_cache; // canonical Decl*
-                                                                                  // -> ref,
-                                                                                  // escapred_title
-    std::pair<std::string, std::string> getReferenceAndTitle(clang::NamedDecl *decl);
-    // project -> { pretty name, ref }
-    std::map<std::string, std::string> functionIndex;
+    llvm::DenseMap<void *, std::pair<Id, Id>> mangle_cache; // canonical Decl* -> ref, escaped title
+    // The strings stay valid as long as the Annotator
+    std::pair<llvm::StringRef, llvm::StringRef> getReferenceAndTitle(clang::NamedDecl *decl);
+    // qualified name -> ref
+    llvm::DenseMap<Id, Id> functionIndex;
 
     std::unordered_map<unsigned, int> localeNumbers;
 
     std::map<clang::FileID, std::set<std::string>> interestingDefinitionsInFile;
 
     std::string args;
+    TUJournal *journal = nullptr;
     clang::SourceManager *sourceManager = nullptr;
     const clang::LangOptions *langOption = nullptr;
 
     void syntaxHighlight(Generator &generator, clang::FileID FID, clang::Sema &);
 
+    // With --reuse-tokens, the tokens of the files to generate as the parser got them
+    struct RecordedToken
+    {
+        unsigned int offset;
+        unsigned int length;
+        clang::tok::TokenKind kind;
+        bool identifier; // spelled like an identifier, as a keyword is
+    };
+    std::map<clang::FileID, std::vector<RecordedToken>> recordedTokens;
+    clang::FileID lastRecordedFile;
+    std::vector<RecordedToken> *lastRecordedTokens = nullptr;
+
 public:
     explicit Annotator(ProjectManager &pm);
     	/*
@@ -177,6 +200,8 @@ public:
         sourceManager = &sm;
         langOption = &lo;
     }
+    // Called for every token the preprocessor gives to the parser
+    void recordToken(const clang::Token &tok);
     void setMangleContext(clang::MangleContext *m)
     {
         mangle.reset(m);
@@ -193,6 +218,11 @@ public:
     {
         args = std::move(a);
     }
+    // In incremental mode, the refs, fnSearch and fileIndex records go to the journal
+    void setJournal(TUJournal *j)
+    {
+        journal = j;
+    }
 
     bool generate(clang::Sema &, bool WasInDatabase);
 
@@ -260,14 +290,16 @@ public:
     auto& GetFuncIndexFile(const std::string& s) ;
 	void AddFileIndex(const std::string &s); 
 
+    // Shown in the tooltip of the ref (by the record-layout pass)
+    void setStructureSize(StringInterner::Id ref, ssize_t size)
+    {
+        structure_sizes[ref] = size;
+    }
+    void setFieldOffset(StringInterner::Id ref, ssize_t offset)
+    {
+        field_offsets[ref] = offset;
+    }
 
-    /**
-     * Returns the param name in function decl for the arg @p arg
-     * Will be empty if arg->name == paramDecl->name
-     */
-    std::string getParamNameForArg(clang::CallExpr *callExpr, clang::ParmVarDecl *paramDecl,
-                                   clang::Expr *arg);
-
-    llvm::DenseMap<clang::SourceLocation, std::string>
-    getDesignatorInlayHints(clang::InitListExpr *Syn);
+    // The optional parts of the annotation (--disable-pass)
+    AnnotationPipeline passes;
 };
@@ -0,0 +1,492 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+/* codebrowser_bench (-DCODEBROWSER_BENCH=ON): benchmarks of the generator's hot paths.
+ *
+ * The micro benchmarks time Generator::addTag, Generator::generate and Generator::escapeAttr
+ * on a synthetic tag set, built from a fixed seed, and on a real one, from the tokens of a
+ * source file. --e2e times proceedCommand() over whole translation units instead, and
+ * reports the phases of Stats for them, Stats::Refs being the ref emission loop of
+ * Annotator::generate(), which needs a parsed translation unit.
+ * Every benchmark runs once untimed, then -n times; the median and the minimum are reported,
+ * with the number of allocations and the bytes allocated per run. */
+
+#include "annotationpass.h"
+#include "browseraction.h"
+#include "filesystem.h"
+#include "generator.h"
+#include "logging.h"
+#include "projectmanager.h"
+#include "stats.h"
+
+#include <clang/Basic/IdentifierTable.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace cl = llvm::cl;
+
+cl::opt<unsigned> Repetitions("n", cl::value_desc("runs"),
+                              cl::desc("Number of timed runs of each benchmark. Defaults to 10"),
+                              cl::init(10));
+
+cl::opt<std::string> Filter("filter", cl::value_desc("substring"),
+                            cl::desc("Only run the benchmarks whose name contains it"));
+
+cl::opt<std::string> WorkPath(
+    "o", cl::value_desc("directory"),
+    cl::desc("Where the benchmarks write their files. Defaults to a temporary directory, "
+             "removed at the end"));
+
+cl::opt<std::string> RealFile(
+    "real-file", cl::value_desc("path"),
+    cl::desc("Source file whose tokens make the real tag set. Defaults to tests/test.cc"),
+    cl::init(CODEBROWSER_SOURCE_DIR "/tests/test.cc"));
+
+cl::opt<bool> EndToEnd(
+    "e2e", cl::desc("Run proceedCommand() over the source files instead of the micro benchmarks"));
+
+cl::list<std::string> SourceFiles(
+    cl::Positional,
+    cl::desc("<sources>* processed with --e2e. Defaults to tests/test.cc and tests/testqt.cc"),
+    cl::ZeroOrMore);
+
+cl::list<std::string> ExtraArgs(
+    "extra-arg", cl::value_desc("argument"),
+    cl::desc("Argument appended to the compile command of the sources with --e2e, such as the "
+             "-I for the Qt headers"),
+    cl::ZeroOrMore);
+
+cl::list<std::string> DisabledPasses(
+    "disable-pass", cl::value_desc("pass"), cl::CommaSeparated,
+    cl::desc("Annotation passes not run with --e2e, as with codebrowser_generator"),
+    cl::ZeroOrMore);
+
+// Every allocation of the process is counted, the ones of the benchmarked code are the
+// difference over a run
+static std::atomic<uint64_t> allocationCount { 0 };
+static std::atomic<uint64_t> allocatedBytes { 0 };
+
+void *operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+static void report(llvm::StringRef name, std::vector<double> times, double work,
+                   const char *unit, uint64_t allocations, uint64_t bytes)
+{
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    if (times.size() % 2 == 0)
+        median = (median + times[times.size() / 2 - 1]) / 2;
+    llvm::outs() << llvm::format("%-26s median %10.3f ms  min %10.3f ms  %12.1f %s/s  "
+                                 "%9llu allocs  %11llu bytes\n",
+                                 name.str().c_str(), median, times.front(),
+                                 median > 0 ? work * 1000 / median : 0., unit,
+                                 (unsigned long long)allocations, (unsigned long long)bytes);
+    llvm::outs().flush();
+}
+
+/**
+ * Runs body(setup()) once untimed then Repetitions times, and reports its time and the
+ * allocations it made. setup() and the destruction of what it returned are not timed.
+ * work is how many units one run processes, for the throughput.
+ */
+template<typename Setup, typename Body>
+static void runBenchmark(llvm::StringRef name, double work, const char *unit, Setup &&setup,
+                         Body &&body)
+{
+    if (!Filter.empty() && !name.contains(Filter))
+        return;
+    std::vector<double> times;
+    uint64_t allocations = 0, bytes = 0;
+    for (unsigned int i = 0; i <= Repetitions; ++i) {
+        auto state = setup();
+        uint64_t allocationsBefore = allocationCount, bytesBefore = allocatedBytes;
+        auto start = std::chrono::steady_clock::now();
+        body(state);
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (i == 0)
+            continue; // warm up
+        times.push_back(elapsed.count());
+        allocations += allocationCount - allocationsBefore;
+        bytes += allocatedBytes - bytesBefore;
+    }
+    report(name, std::move(times), work, unit, allocations / Repetitions, bytes / Repetitions);
+}
+
+struct TagSet
+{
+    struct Tag
+    {
+        const char *name;
+        std::string attributes;
+        int pos;
+        int len;
+    };
+    std::string source;
+    std::vector<Tag> tags;
+};
+
+// About size bytes of C++ looking code, tagged like the annotator would
+static TagSet syntheticTagSet(std::size_t size)
+{
+    static const char *const keywords[] = { "int", "const", "return", "template", "auto" };
+    static const char *const separators[] = { " ", " ", " = ", "(", ")", ", ", "->", " && ",
+                                              " < ", "> ", "::", ";\n", " & ", " \"s\" " };
+    std::mt19937 rng(42);
+    TagSet set;
+    set.source.reserve(size + 200);
+    while (set.source.size() < size) {
+        int pos = set.source.size();
+        switch (rng() % 16) {
+        case 0:
+        case 1: {
+            const char *keyword = keywords[rng() % 5];
+            set.source += keyword;
+            set.tags.push_back({ "b", {}, pos, int(set.source.size()) - pos });
+            break;
+        }
+        case 2: {
+            set.source += std::to_string(rng() % 100000);
+            set.tags.push_back({ "var", {}, pos, int(set.source.size()) - pos });
+            break;
+        }
+        case 3: {
+            // A comment over a few lines, with a reference to a declaration in it
+            int lines = 1 + rng() % 3;
+            set.source += "// ";
+            for (int l = 0; l < lines; ++l)
+                set.source += "some <documentation> & text\n// ";
+            set.tags.push_back({ "i", {}, pos, int(set.source.size()) - pos });
+            break;
+        }
+        default: {
+            unsigned int id = rng() % 4096;
+            std::string name = "identifier" + std::to_string(id);
+            set.source += name;
+            std::string ref = "_ZN2ns" + std::to_string(name.size()) + name + "Ev";
+            if (id % 8 == 0) {
+                set.tags.push_back({ "dfn", "class=\"decl def\" id=\"" + ref + "\" title='ns::"
+                                         + name + "' data-ref=\"" + ref + "\"",
+                                     pos, int(name.size()) });
+            } else {
+                set.tags.push_back({ "a", "class=\"ref\" href=\"../ns/" + name
+                                         + ".h.html#" + ref + "\" title='ns::" + name
+                                         + "' data-ref=\"" + ref + "\"",
+                                     pos, int(name.size()) });
+            }
+            break;
+        }
+        }
+        set.source += separators[rng() % (sizeof(separators) / sizeof(*separators))];
+    }
+    return set;
+}
+
+// The tokens of the file, tagged like Annotator::syntaxHighlight and with a ref on every
+// identifier
+static bool realTagSet(const std::string &path, TagSet &set)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        std::cerr << "Cannot read " << path << ": " << buffer.getError().message() << std::endl;
+        return false;
+    }
+    set.source = buffer.get()->getBuffer().str();
+
+    clang::LangOptions lang;
+    lang.CPlusPlus = lang.CPlusPlus11 = true;
+    lang.Bool = true;
+    lang.LineComment = true;
+    clang::IdentifierTable identifiers(lang);
+    const char *begin = set.source.data();
+    clang::Lexer lexer(clang::SourceLocation(), lang, begin, begin, begin + set.source.size());
+    lexer.SetCommentRetentionState(true);
+    clang::Token tok;
+    for (lexer.LexFromRawLexer(tok); tok.isNot(clang::tok::eof); lexer.LexFromRawLexer(tok)) {
+        int len = tok.getLength();
+        // The raw lexer stops right after the token it returned
+        int pos = lexer.getBufferLocation() - begin - len;
+        switch (tok.getKind()) {
+        case clang::tok::comment:
+            set.tags.push_back({ "i", {}, pos, len });
+            break;
+        case clang::tok::numeric_constant:
+            set.tags.push_back({ "var", {}, pos, len });
+            break;
+        case clang::tok::string_literal:
+        case clang::tok::char_constant:
+        case clang::tok::utf8_string_literal:
+            set.tags.push_back({ "q", {}, pos, len });
+            break;
+        case clang::tok::raw_identifier: {
+            llvm::StringRef name = tok.getRawIdentifier();
+            if (identifiers.get(name).getTokenID() != clang::tok::identifier) {
+                set.tags.push_back({ "b", {}, pos, len });
+                break;
+            }
+            std::string ref = "_Z" + std::to_string(name.size()) + name.str();
+            set.tags.push_back(
+                { "a", "class=\"ref\" href=\"#" + ref + "\" data-ref=\"" + ref + "\"", pos, len });
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+static void addTags(Generator &generator, const TagSet &set)
+{
+    for (const auto &tag : set.tags)
+        generator.addTag(tag.name, tag.attributes, tag.pos, tag.len);
+}
+
+static void benchmarkTagSet(llvm::StringRef name, const TagSet &set, const std::string &workDir)
+{
+    std::cerr << name.str() << ": " << set.source.size() << " bytes, " << set.tags.size()
+              << " tags" << std::endl;
+    runBenchmark(
+        "addTag/" + name.str(), set.tags.size(), "tags",
+        [] { return std::make_unique<Generator>(); },
+        [&](std::unique_ptr<Generator> &generator) { addTags(*generator, set); });
+
+    std::string filename = "bench/" + name.str() + ".cpp";
+    runBenchmark(
+        "generate/" + name.str(), set.source.size() / 1e6, "MB",
+        [&] {
+            auto generator = std::make_unique<Generator>();
+            addTags(*generator, set);
+            return generator;
+        },
+        [&](std::unique_ptr<Generator> &generator) {
+            generator->generate(workDir, "../data", filename, set.source.data(),
+                                set.source.data() + set.source.size(), "footer", {}, {});
+        });
+}
+
+static void benchmarkEscapeAttr(const TagSet &real)
+{
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    llvm::StringRef(real.source).split(lines, '\n');
+    runBenchmark(
+        "escapeAttr/lines", real.source.size() / 1e6, "MB", [] { return 0; },
+        [&](int) {
+            std::size_t total = 0;
+            llvm::SmallString<256> buffer;
+            for (llvm::StringRef line : lines)
+                total += Generator::escapeAttr(line, buffer).size();
+            if (total == 1) // so it is not optimized out
+                std::cerr << std::endl;
+        });
+    runBenchmark(
+        "escapeAttr/stream", real.source.size() / 1e6, "MB",
+        [&] {
+            std::string out;
+            out.reserve(real.source.size() * 2);
+            return out;
+        },
+        [&](std::string &out) {
+            llvm::raw_string_ostream os(out);
+            Generator::escapeAttr(os, real.source);
+            os.flush();
+        });
+}
+
+static int runMicroBenchmarks(const std::string &workDir)
+{
+    TagSet real;
+    if (!realTagSet(RealFile, real))
+        return EXIT_FAILURE;
+    benchmarkTagSet("synthetic", syntheticTagSet(4 * 1024 * 1024), workDir);
+    benchmarkTagSet("real", real, workDir);
+    benchmarkEscapeAttr(real);
+    return EXIT_SUCCESS;
+}
+
+static int runEndToEnd(const std::string &workDir)
+{
+    std::vector<std::string> files(SourceFiles.begin(), SourceFiles.end());
+    if (files.empty())
+        files = { CODEBROWSER_SOURCE_DIR "/tests/test.cc",
+                  CODEBROWSER_SOURCE_DIR "/tests/testqt.cc" };
+    // One project for each directory of the sources
+    std::map<std::string, std::string> projects;
+    for (std::string &file : files) {
+        llvm::SmallString<256> path;
+        if (auto error = canonicalize(file, path)) {
+            std::cerr << "Cannot find " << file << ": " << error.message() << std::endl;
+            return EXIT_FAILURE;
+        }
+        file = path.str().str();
+        std::string dir = llvm::sys::path::parent_path(file).str();
+        projects.emplace(dir, llvm::sys::path::filename(dir).str());
+    }
+
+    for (const std::string &pass : DisabledPasses) {
+        if (!AnnotationPipeline::disable(pass)) {
+            std::cerr << "Unknown pass " << pass << " for --disable-pass" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string statsPath = workDir + "/stats.jsonl";
+    if (!Stats::open(statsPath))
+        return EXIT_FAILURE;
+
+    std::string outputPath = workDir + "/e2e";
+    unsigned int failures = 0;
+    auto run = [&] {
+        llvm::sys::fs::remove_directories(outputPath);
+        create_directories(outputPath);
+        ProjectManager projectManager(outputPath, "../data");
+        for (const auto &project : projects)
+            projectManager.addProject(ProjectInfo { project.second, project.first });
+        BrowserAction::projectManager = &projectManager;
+        // So the same files are processed again
+        BrowserAction::forgetProcessed();
+        for (const std::string &file : files) {
+            std::vector<std::string> command = { "clang++", "-std=c++17" };
+            command.insert(command.end(), ExtraArgs.begin(), ExtraArgs.end());
+            command.push_back(file);
+            if (!proceedCommand(std::move(command), llvm::sys::path::parent_path(file), file,
+                                DatabaseType::InDatabase))
+                ++failures;
+        }
+        if (!projectManager.flush())
+            ++failures;
+        BrowserAction::projectManager = nullptr;
+    };
+    runBenchmark(
+        "e2e", files.size(), "TUs", [] { return 0; }, [&](int) { run(); });
+    if (failures) // the times are still reported, but they are not comparable
+        std::cerr << "Warning: " << failures << " runs of a translation unit failed" << std::endl;
+
+    // The phases and counters of the timed runs, the first line of each file being untimed
+    auto buffer = llvm::MemoryBuffer::getFile(statsPath);
+    if (!buffer) {
+        std::cerr << "Cannot read " << statsPath << std::endl;
+        return EXIT_FAILURE;
+    }
+    static const char *const phases[] = {
+        "total_ms", "traverse_ms", "highlight_ms", "html_ms", "refs_ms",
+        "param_hints_ms", "designator_hints_ms", "qt_ms", "record_layout_ms"
+    };
+    static const char *const counters[] = { "tags", "references", "bytes_written" };
+    std::map<std::string, std::map<std::string, double>> perFile;
+    std::set<std::string> seen;
+    llvm::SmallVector<llvm::StringRef, 16> lines;
+    buffer.get()->getBuffer().split(lines, '\n', -1, false);
+    for (llvm::StringRef line : lines) {
+        auto value = llvm::json::parse(line);
+        if (!value) {
+            llvm::consumeError(value.takeError());
+            continue;
+        }
+        const llvm::json::Object *object = value->getAsObject();
+        if (!object)
+            continue;
+        auto file = object->getString("file");
+        if (!file || seen.insert(file->str()).second)
+            continue;
+        auto &sums = perFile[file->str()];
+        for (const char *key : phases)
+            sums[key] += object->getNumber(key) ? *object->getNumber(key) / Repetitions : 0;
+        for (const char *key : counters)
+            sums[key] += object->getNumber(key) ? *object->getNumber(key) / Repetitions : 0;
+    }
+    for (const auto &file : perFile) {
+        llvm::outs() << "  " << llvm::sys::path::filename(file.first) << ":";
+        for (const char *phase : phases)
+            llvm::outs() << llvm::format(" %s %.3f", phase, file.second.at(phase));
+        for (const char *counter : counters)
+            llvm::outs() << llvm::format(" %s %.0f", counter, file.second.at(counter));
+        llvm::outs() << "\n";
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+    cl::ParseCommandLineOptions(argc, argv, "Benchmarks of codebrowser_generator\n");
+    if (Repetitions == 0) {
+        std::cerr << "-n must be at least 1" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string workDir = WorkPath;
+    if (workDir.empty()) {
+        llvm::SmallString<256> path;
+        if (auto error = llvm::sys::fs::createUniqueDirectory("codebrowser_bench", path)) {
+            std::cerr << "Cannot create a temporary directory: " << error.message() << std::endl;
+            return EXIT_FAILURE;
+        }
+        workDir = path.str().str();
+    } else if (auto error = create_directories(workDir)) {
+        std::cerr << "Cannot create " << workDir << ": " << error.message() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int result;
+    {
+        Logging logging;
+        if (!logging.setup("warning", workDir + "/codebrowser.log"))
+            return EXIT_FAILURE;
+        result = EndToEnd ? runEndToEnd(workDir) : runMicroBenchmarks(workDir);
+    }
+    if (WorkPath.empty())
+        llvm::sys::fs::remove_directories(workDir);
+    return result;
+}
@@ -0,0 +1,406 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "browseraction.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/Tooling.h"
+
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/Utils.h>
+#include <llvm/Support/Path.h>
+
+#include "annotator.h"
+#include "browserastvisitor.h"
+#include "compat.h"
+#include "filesystem.h"
+#include "incremental.h"
+#include "preprocessorcallback.h"
+#include "projectmanager.h"
+#include "stats.h"
+#include "stringbuilder.h"
+#include <iostream>
+#include <mutex>
+#include <set>
+
+#if CLANG_VERSION_MAJOR <= 10
+// main() maps them with the later versions
+#include "embedded_includes.h"
+#endif
+#include "logger.h"
+
+#if 1
+std::string locationToString(clang::SourceLocation loc, clang::SourceManager &sm)
+{
+    clang::PresumedLoc fixed = sm.getPresumedLoc(loc);
+    if (!fixed.isValid())
+        return "???";
+    return (llvm::Twine(fixed.getFilename()) + ":" + llvm::Twine(fixed.getLine())).str();
+}
+#endif
+
+struct BrowserDiagnosticClient : clang::DiagnosticConsumer
+{
+    Annotator &annotator;
+    BrowserDiagnosticClient(Annotator &fm)
+        : annotator(fm)
+    {
+    }
+
+    static bool isImmintrinDotH(const clang::PresumedLoc &loc)
+    {
+        return llvm::StringRef(loc.getFilename()).contains("immintrin.h");
+    }
+
+    virtual void HandleDiagnostic(clang::DiagnosticsEngine::Level DiagLevel,
+                                  const clang::Diagnostic &Info) override
+    {
+        std::string clas;
+        llvm::SmallString<1000> diag;
+        Info.FormatDiagnostic(diag);
+
+        switch (DiagLevel) {
+        case clang::DiagnosticsEngine::Fatal:
+            // ignore tons of errors in immintrin.h
+            if (isImmintrinDotH(annotator.getSourceMgr().getPresumedLoc(Info.getLocation())))
+                return;
+            std::cerr << "FATAL ";
+            LLVM_FALLTHROUGH;
+        case clang::DiagnosticsEngine::Error:
+            std::cerr << "Error: " << locationToString(Info.getLocation(), annotator.getSourceMgr())
+                      << ": " << diag.c_str() << std::endl;
+            clas = "error";
+            break;
+        case clang::DiagnosticsEngine::Warning:
+            clas = "warning";
+            break;
+        default:
+            return;
+        }
+        clang::SourceRange Range = Info.getLocation();
+        annotator.reportDiagnostic(Range, diag.c_str(), clas);
+    }
+};
+
+// Every file read by the translation unit, including the headers from a PCH
+struct DependencyList : clang::DependencyCollector
+{
+    bool needSystemDependencies() override
+    {
+        return true;
+    }
+};
+
+class BrowserASTConsumer : public clang::ASTConsumer
+{
+    clang::CompilerInstance &ci;
+    Annotator annotator;
+    DatabaseType WasInDatabase;
+    Incremental *incremental;
+    std::string mainFile;
+    uint64_t commandHash;
+    TUJournal journal;
+    std::shared_ptr<DependencyList> dependencies;
+
+public:
+    BrowserASTConsumer(clang::CompilerInstance &ci, ProjectManager &projectManager,
+                       DatabaseType WasInDatabase, Incremental *incremental = nullptr,
+                       std::string mainFile = {}, uint64_t commandHash = 0)
+        : clang::ASTConsumer()
+        , ci(ci)
+        , annotator(projectManager)
+        , WasInDatabase(WasInDatabase)
+        , incremental(incremental)
+        , mainFile(std::move(mainFile))
+        , commandHash(commandHash)
+    {
+		SPDLOG_DEBUG("BrowserASTConsumer constructor");
+        if (incremental) {
+            annotator.setJournal(&journal);
+            dependencies = std::make_shared<DependencyList>();
+            dependencies->attachToPreprocessor(ci.getPreprocessor());
+            // so the files of a PCH are reported too (it is not loaded yet)
+            ci.addDependencyCollector(dependencies);
+        }
+        // ci.getLangOpts().DelayedTemplateParsing = (true);
+#if CLANG_VERSION_MAJOR < 16
+        // the meaning of this function has changed which causes
+        // a lot of issues in clang 16
+        ci.getPreprocessor().enableIncrementalProcessing();
+#endif
+    }
+    virtual ~BrowserASTConsumer()
+    {
+		SPDLOG_DEBUG("BrowserASTConsumer destructor");
+        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer, true);
+    }
+
+    virtual void Initialize(clang::ASTContext &Ctx) override
+    {
+        annotator.setSourceMgr(Ctx.getSourceManager(), Ctx.getLangOpts());
+        annotator.setMangleContext(Ctx.createMangleContext());
+        ci.getPreprocessor().addPPCallbacks(maybe_unique(new PreprocessorCallback(
+            annotator, ci.getPreprocessor(), WasInDatabase == DatabaseType::ProcessFullDirectory)));
+#if CLANG_VERSION_MAJOR >= 9
+        if (BrowserAction::reuseTokens) {
+            ci.getPreprocessor().setTokenWatcher(
+                [this](const clang::Token &tok) { annotator.recordToken(tok); });
+        }
+#endif
+        ci.getDiagnostics().setClient(new BrowserDiagnosticClient(annotator), true);
+        ci.getDiagnostics().setErrorLimit(0);
+    }
+
+    virtual bool HandleTopLevelDecl(clang::DeclGroupRef D) override
+    {
+        if (ci.getDiagnostics().hasFatalErrorOccurred()) {
+			SPDLOG_DEBUG("Reset errors: (Hack to ignore the fatal errors.)");
+            // Reset errors: (Hack to ignore the fatal errors.)
+            ci.getDiagnostics().Reset();
+            // When there was fatal error, processing the warnings may cause crashes
+            ci.getDiagnostics().setIgnoreAllWarnings(true);
+        }
+        return true;
+    }
+
+    virtual void HandleTranslationUnit(clang::ASTContext &Ctx) override
+    {
+
+        /* if (PP.getDiagnostics().hasErrorOccurred())
+             return;*/
+        ci.getPreprocessor().getDiagnostics().getClient();
+
+
+        BrowserASTVisitor v(annotator);
+		SPDLOG_DEBUG("Create BrowserASTVisitor");
+        {
+            Stats::Timer timer(Stats::Traverse);
+            v.TraverseDecl(Ctx.getTranslationUnitDecl());
+        }
+		SPDLOG_DEBUG("TraverseDecl done");
+
+
+        annotator.generate(ci.getSema(), WasInDatabase != DatabaseType::NotInDatabase);
+        // Makes up most of the memory used by a translation unit, to schedule by memory later
+        Stats::add(Stats::MemoryBytes,
+                   Ctx.getASTAllocatedMemory() + Ctx.getSideTableAllocatedMemory()
+                       + ci.getPreprocessor().getTotalMemory()
+                       + ci.getSourceManager().getMemoryBufferSizes().malloc_bytes);
+
+        if (incremental) {
+            // So this translation unit is processed again when one of its files changes
+            std::vector<std::string> files;
+            for (llvm::StringRef name : dependencies->getDependencies()) {
+                if (name.startswith("/builtins"))
+                    continue; // the embedded includes
+                llvm::SmallString<256> path;
+                if (!canonicalize(name, path))
+                    files.emplace_back(path.str());
+            }
+            incremental->commit(mainFile, commandHash, files, journal);
+        }
+    }
+
+    virtual bool shouldSkipFunctionBody(clang::Decl *D) override
+    {
+        return !annotator.shouldProcess(
+            clang::FullSourceLoc(D->getLocation(), annotator.getSourceMgr())
+                .getExpansionLoc()
+                .getFileID());
+    }
+};
+
+class ProcessedSet {
+	public:
+		bool try_insert(const std::string& s) {
+			std::lock_guard lg(mutex_);
+			auto [_,suc] = processed_.insert(s);
+			return suc;
+		}
+		void clear() {
+			std::lock_guard lg(mutex_);
+			processed_.clear();
+		}
+		static ProcessedSet& get() {
+			static ProcessedSet inst;
+			return inst;
+		}
+	private:
+		std::mutex mutex_;
+    	std::set<std::string> processed_;
+};
+
+#if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR <= 5
+clang::ASTConsumer *
+#else
+std::unique_ptr<clang::ASTConsumer>
+#endif
+BrowserAction::CreateASTConsumer(clang::CompilerInstance &CI, llvm::StringRef InFile)
+{
+	SPDLOG_DEBUG("Start CreateASTConsumer for:{}", InFile.str());
+    if(!ProcessedSet::get().try_insert(InFile.str())) {
+		SPDLOG_ERROR("Skipping already processed:{}", InFile.str());
+        std::cerr << "Skipping already processed " << InFile.str() << std::endl;
+        return nullptr;
+    }
+
+    CI.getFrontendOpts().SkipFunctionBodies = true;
+
+    return maybe_unique(new BrowserASTConsumer(CI, *projectManager, WasInDatabase,
+                                               incremental, mainFile, commandHash));
+}
+
+BrowserAction::BrowserAction(DatabaseType WasInDatabase, std::string mainFile,
+                             uint64_t commandHash)
+    : WasInDatabase(WasInDatabase)
+    , mainFile(std::move(mainFile))
+    , commandHash(commandHash)
+{
+	SPDLOG_DEBUG("BrowserAction constructor");
+}
+
+void BrowserAction::forgetProcessed()
+{
+    ProcessedSet::get().clear();
+}
+
+ProjectManager *BrowserAction::projectManager = nullptr;
+Incremental *BrowserAction::incremental = nullptr;
+bool BrowserAction::reuseTokens = false;
+
+bool adjustCommand(std::vector<std::string> &command, llvm::StringRef Directory,
+                   llvm::StringRef file)
+{
+    // This code change all the paths to be absolute paths
+    //  FIXME:  it is a bit fragile.
+    bool previousIsDashI = false;
+    bool previousNeedsMacro = false;
+    bool hasNoStdInc = false;
+    for (std::string &A : command) {
+        if (previousIsDashI && !A.empty() && A[0] != '/') {
+            A = Directory % "/" % A;
+            previousIsDashI = false;
+            continue;
+        } else if (A == "-I") {
+            previousIsDashI = true;
+            continue;
+        } else if (A == "-nostdinc" || A == "-nostdinc++") {
+            hasNoStdInc = true;
+            continue;
+        } else if (A == "-U" || A == "-D") {
+            previousNeedsMacro = true;
+            continue;
+        }
+        if (previousNeedsMacro) {
+            previousNeedsMacro = false;
+            continue;
+        }
+        previousIsDashI = false;
+        if (A.empty())
+            continue;
+        if (llvm::StringRef(A).startswith("-I") && A[2] != '/') {
+            A = "-I" % Directory % "/" % llvm::StringRef(A).substr(2);
+            continue;
+        }
+        if (A[0] == '-' || A[0] == '/')
+            continue;
+        std::string PossiblePath = Directory % "/" % A;
+        if (llvm::sys::fs::exists(PossiblePath))
+            A = PossiblePath;
+    }
+
+#if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR < 6
+    auto Ajust = [&](clang::tooling::ArgumentsAdjuster &&aj) { command = aj.Adjust(command); };
+    Ajust(clang::tooling::ClangSyntaxOnlyAdjuster());
+    Ajust(clang::tooling::ClangStripOutputAdjuster());
+#elif CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR < 8
+    command = clang::tooling::getClangSyntaxOnlyAdjuster()(command);
+    command = clang::tooling::getClangStripOutputAdjuster()(command);
+#else
+    command = clang::tooling::getClangSyntaxOnlyAdjuster()(command, file);
+    command = clang::tooling::getClangStripOutputAdjuster()(command, file);
+#endif
+
+    if (!hasNoStdInc) {
+#ifndef _WIN32
+        command.push_back("-isystem");
+#else
+        command.push_back("-I");
+#endif
+
+        command.push_back("/builtins");
+    }
+
+    command.push_back("-Qunused-arguments");
+    command.push_back("-Wno-unknown-warning-option");
+    return hasNoStdInc;
+}
+
+bool runInvocation(std::vector<std::string> command, clang::FrontendAction *action,
+                   bool hasNoStdInc)
+{
+    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> VFS(
+        new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
+    clang::FileManager FM({ "." }, VFS);
+
+    FM.Retain();
+    clang::tooling::ToolInvocation Inv(command, maybe_unique(action), &FM);
+
+#if CLANG_VERSION_MAJOR <= 10
+    if (!hasNoStdInc) {
+    	SPDLOG_DEBUG("hasNoStdInc, Map the builtins includes");
+        // Map the builtins includes
+        const EmbeddedFile *f = EmbeddedFiles;
+        while (f->filename) {
+            Inv.mapVirtualFile(f->filename, { f->content, f->size });
+            f++;
+        }
+    }
+#endif
+
+    return Inv.run();
+}
+
+bool proceedCommand(std::vector<std::string> command, llvm::StringRef Directory,
+                    llvm::StringRef file, DatabaseType WasInDatabase, uint64_t commandHash,
+                    llvm::StringRef pch)
+{
+	SPDLOG_DEBUG("Start proceedCommand with: command: {}, Directory: {}, file:{}, was in db:{}", command, Directory.data(), file.data(), (int)WasInDatabase);
+    Stats::TranslationUnit stats(file);
+    Stats::Timer timer(Stats::Total);
+    bool hasNoStdInc = adjustCommand(command, Directory, file);
+    if (!pch.empty()) {
+        command.push_back("-include-pch");
+        command.push_back(pch.str());
+    }
+	SPDLOG_DEBUG("Start proceedCommand with adjusted: command: {}", command);
+    bool result = runInvocation(std::move(command),
+                                new BrowserAction(WasInDatabase, file.str(), commandHash),
+                                hasNoStdInc);
+    if (!result) {
+        stats.setFailed();
+		SPDLOG_ERROR("Error: The file was not recognized as source code: : {}", file.str());
+        std::cerr << "Error: The file was not recognized as source code: " << file.str()
+                  << std::endl;
+    }
+    return result;
+}
@@ -0,0 +1,85 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ProjectManager;
+class Incremental;
+
+/* What the generator does with one translation unit: parses it with a BrowserAction, whose
+ * consumer visits the AST and generates the files. Used by codebrowser_generator and by
+ * codebrowser_bench. */
+
+enum class DatabaseType {
+    InDatabase,
+    NotInDatabase,
+    ProcessFullDirectory
+};
+
+class BrowserAction : public clang::ASTFrontendAction
+{
+    DatabaseType WasInDatabase;
+    std::string mainFile; // as passed to proceedCommand, identifies the translation unit
+    uint64_t commandHash;
+
+protected:
+#if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR <= 5
+    virtual clang::ASTConsumer *
+#else
+    virtual std::unique_ptr<clang::ASTConsumer>
+#endif
+    CreateASTConsumer(clang::CompilerInstance &CI, llvm::StringRef InFile) override;
+
+public:
+    BrowserAction(DatabaseType WasInDatabase = DatabaseType::InDatabase,
+                  std::string mainFile = {}, uint64_t commandHash = 0);
+    virtual bool hasCodeCompletionSupport() const override
+    {
+        return true;
+    }
+
+    // Forgets which main files were already processed, so they can be processed again
+    static void forgetProcessed();
+
+    static ProjectManager *projectManager;
+    static Incremental *incremental;
+    static bool reuseTokens; // --reuse-tokens
+};
+
+// Returns true if the command uses -nostdinc
+bool adjustCommand(std::vector<std::string> &command, llvm::StringRef Directory,
+                   llvm::StringRef file);
+
+// Runs the action on the adjusted command. Takes the ownership of action.
+bool runInvocation(std::vector<std::string> command, clang::FrontendAction *action,
+                   bool hasNoStdInc);
+
+bool proceedCommand(std::vector<std::string> command, llvm::StringRef Directory,
+                    llvm::StringRef file, DatabaseType WasInDatabase, uint64_t commandHash = 0,
+                    llvm::StringRef pch = {});
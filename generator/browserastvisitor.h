@@ -22,7 +22,6 @@
 #pragma once
 
 #include "annotator.h"
-#include "qtsupport.h"
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/Attr.h>
 #include <clang/AST/Decl.h>
@@ -319,8 +318,7 @@ struct BrowserASTVisitor : clang::RecursiveASTVisitor<BrowserASTVisitor>
                                       Annotator::Ref, currentContext, Annotator::Use_Call);
             }
         }
-        QtSupport qt { annotator, currentContext };
-        qt.visitCXXConstructExpr(ctr);
+        annotator.passes.visitCXXConstructExpr(ctr, currentContext);
         return true;
     }
 
@@ -334,21 +332,16 @@ struct BrowserASTVisitor : clang::RecursiveASTVisitor<BrowserASTVisitor>
             // And also because of the wierd rules regarding the member operators and their number
             // of arguments
             for (unsigned int i = 0; decl && i < e->getNumArgs() && i < decl->getNumParams(); ++i) {
-                auto paramDecl = decl->getParamDecl(i);
-                auto t = paramDecl->getType();
-                auto arg = e->getArg(i);
-                std::string prefix = annotator.getParamNameForArg(e, paramDecl, arg);
+                auto t = decl->getParamDecl(i)->getType();
                 if (t->isLValueReferenceType() && !t.getNonReferenceType().isConstQualified()) {
                     annotator.annotateSourceRange(e->getArg(i)->getSourceRange(), "span",
                                                   "class='refarg'");
                 }
-                annotator.addInlayHint(e->getArg(i)->getBeginLoc(), prefix);
             }
         }
 
-        // support QObject::connect SIGNAL and SLOT
-        QtSupport qt { annotator, currentContext };
-        qt.visitCallExpr(e);
+        // the parameter names as inlay hints, QObject::connect SIGNAL and SLOT
+        annotator.passes.visitCallExpr(e, currentContext);
         return true;
     }
 
@@ -358,11 +351,7 @@ struct BrowserASTVisitor : clang::RecursiveASTVisitor<BrowserASTVisitor>
             return false;
         if (Syn->isIdiomaticZeroInitializer(annotator.getLangOpts()))
             return false;
-        llvm::DenseMap<clang::SourceLocation, std::string> designators =
-            annotator.getDesignatorInlayHints(Syn);
-        for (const auto &d : designators) {
-            annotator.addInlayHint(d.getFirst(), d.getSecond());
-        }
+        annotator.passes.visitInitListExpr(Syn);
         return true;
     }
 
@@ -0,0 +1,81 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CODEBROWSER_SCAN_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CODEBROWSER_SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define CODEBROWSER_SCAN_NEON
+#endif
+#endif
+
+/**
+ * Returns a pointer to the first character in [p, end) that is one of Cs, or end.
+ * Used to skip over the text that does not need to be escaped, so it can be written in one go.
+ */
+template<char... Cs>
+inline const char *findFirstOf(const char *p, const char *end)
+{
+#if defined(CODEBROWSER_SCAN_AVX2)
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i m = _mm256_setzero_si256();
+        ((m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Cs)))), ...);
+        if (unsigned int mask = _mm256_movemask_epi8(m))
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#elif defined(CODEBROWSER_SCAN_SSE2)
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i m = _mm_setzero_si128();
+        ((m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(Cs)))), ...);
+        if (unsigned int mask = _mm_movemask_epi8(m))
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(CODEBROWSER_SCAN_NEON)
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+        uint8x16_t m = vdupq_n_u8(0);
+        ((m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(Cs))))), ...);
+        // 4 bits per byte
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p) {
+        char c = *p;
+        if (((c == Cs) || ...))
+            return p;
+    }
+    return end;
+}
@@ -22,6 +22,8 @@
 #pragma once
 
 #include <clang/Basic/SourceLocation.h>
+#include <llvm/ADT/StringRef.h>
+#include <functional>
 #include <map>
 #include <string>
 #include "logger.h"
@@ -45,7 +47,10 @@ public:
         clang::SourceLocation loc;
     };
 
-    std::multimap<std::string, Doc> docs;
+    // ref -> doc. Only the files generated by this translation unit are highlighted, so these
+    // are the docs of the files whose page it writes, which no other translation unit writes.
+    // Looked up with the ref of every reference: std::less<> avoids copying them to a string.
+    std::multimap<std::string, Doc, std::less<>> docs;
 
     // fileId -> [ref, global_visibility]
     std::multimap<clang::SourceLocation, std::pair<std::string, bool>> decl_offsets;
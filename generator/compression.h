@@ -0,0 +1,45 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <string>
+
+/**
+ * --compress: the HTML pages and the refs are written gzip compressed, to <file>.gz, so they
+ * can be served as they are with "Content-Encoding: gzip".
+ *
+ * The refs are appended to by many translation units: every append is a gzip member of its
+ * own. A sequence of gzip members is itself a valid gzip file.
+ */
+class Compression
+{
+public:
+    static bool enabled;
+
+    // The suffix of the files written compressed
+    static const char *suffix() { return enabled ? ".gz" : ""; }
+
+    // Returns data compressed as one gzip member
+    static std::string gzip(llvm::StringRef data);
+};
@@ -0,0 +1,110 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+/* Containers shared by the threads processing the translation units.
+ * The elements are distributed over independently locked stripes so that threads
+ * working on different keys do not contend on a single mutex. */
+
+inline std::size_t stripeIndex(std::size_t hash, std::size_t stripes)
+{
+    // The containers in a stripe also use the low bits: mix the high bits in.
+    return (hash ^ (hash >> 29) ^ (hash >> 47)) % stripes;
+}
+
+template<typename T, typename Hash = std::hash<T>, std::size_t Stripes = 64>
+class StripedSet
+{
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        std::unordered_set<T, Hash> set;
+    };
+    std::array<Stripe, Stripes> stripes;
+
+public:
+    // returns true if the value was not yet in the set
+    bool insert(const T &value)
+    {
+        auto &s = stripes[stripeIndex(Hash {}(value), Stripes)];
+        std::lock_guard lg(s.mutex);
+        return s.set.insert(value).second;
+    }
+    bool erase(const T &value)
+    {
+        auto &s = stripes[stripeIndex(Hash {}(value), Stripes)];
+        std::lock_guard lg(s.mutex);
+        return s.set.erase(value);
+    }
+    bool contains(const T &value)
+    {
+        auto &s = stripes[stripeIndex(Hash {}(value), Stripes)];
+        std::lock_guard lg(s.mutex);
+        return s.set.count(value);
+    }
+};
+
+/* The values are never removed and keep their address, so references to them stay valid.
+ * Looking up an existing key only takes a shared lock on its stripe. */
+template<typename K, typename V, typename Hash = std::hash<K>, std::size_t Stripes = 64>
+class StripedMap
+{
+    struct alignas(64) Stripe
+    {
+        std::shared_mutex mutex;
+        std::unordered_map<K, V, Hash> map;
+    };
+    std::array<Stripe, Stripes> stripes;
+
+public:
+    // returns the value for key, constructing it with args if it was not there
+    template<typename... Args>
+    V &getOrCreate(const K &key, Args &&...args)
+    {
+        auto &s = stripes[stripeIndex(Hash {}(key), Stripes)];
+        {
+            std::shared_lock lock(s.mutex);
+            auto it = s.map.find(key);
+            if (it != s.map.end())
+                return it->second;
+        }
+        std::unique_lock lock(s.mutex);
+        return s.map.try_emplace(key, std::forward<Args>(args)...).first->second;
+    }
+    // returns nullptr if the key is not there
+    V *find(const K &key)
+    {
+        auto &s = stripes[stripeIndex(Hash {}(key), Stripes)];
+        std::shared_lock lock(s.mutex);
+        auto it = s.map.find(key);
+        return it == s.map.end() ? nullptr : &it->second;
+    }
+};
@@ -20,13 +20,19 @@
  ****************************************************************************/
 
 #include "generator.h"
+#include "charscanner.h"
 #include "stringbuilder.h"
 #include "filesystem.h"
+#include "stats.h"
+#include "compression.h"
+#include "objectstore.h"
 
 #include "../global.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/ADT/StringExtras.h>
@@ -40,41 +46,54 @@ static void bufferAppend(llvm::SmallVectorImpl<char> &buffer, const char (&val)[
     buffer.append(val, val + N - 1);
 }
 
+static inline const char *findAttrSpecial(const char *p, const char *end)
+{
+    return findFirstOf<'<', '>', '&', '\"', '\''>(p, end);
+}
+
 llvm::StringRef Generator::escapeAttr(llvm::StringRef s, llvm::SmallVectorImpl< char >& buffer)
 {
     buffer.clear();
-    unsigned len = s.size();
-    for (unsigned i = 0 ; i < len; ++i) {
-        char c = s[i];
-        switch (c) {
-            default: buffer.push_back(c); break;
+    const char *p = s.begin();
+    const char *end = s.end();
+    while (true) {
+        // copy the span that does not need escaping at once
+        const char *special = findAttrSpecial(p, end);
+        buffer.append(p, special);
+        if (special == end)
+            break;
+        switch (*special) {
             case '<': bufferAppend(buffer, "&lt;"); break;
             case '>': bufferAppend(buffer, "&gt;"); break;
             case '&': bufferAppend(buffer, "&amp;"); break;
             case '\"': bufferAppend(buffer, "&quot;"); break;
             case '\'': bufferAppend(buffer, "&apos;"); break;
         }
+        p = special + 1;
     }
     return llvm::StringRef(buffer.begin(), buffer.size());
 }
 
 void Generator::escapeAttr(llvm::raw_ostream &os, llvm::StringRef s)
 {
-    unsigned len = s.size();
-    for (unsigned i = 0 ; i < len; ++i) {
-        char c = s[i];
-        switch (c) {
-            default:
-                os << c; break;
-
+    const char *p = s.begin();
+    const char *end = s.end();
+    while (true) {
+        // write the span that does not need escaping at once
+        const char *special = findAttrSpecial(p, end);
+        if (special != p)
+            os.write(p, special - p);
+        if (special == end)
+            break;
+        switch (*special) {
             case '<': os << "&lt;"; break;
             case '>': os << "&gt;"; break;
             case '&': os << "&amp;"; break;
             case '\"': os << "&quot;"; break;
             case '\'': os << "&apos;"; break;
         }
+        p = special + 1;
     }
-
 }
 
 // ATTENTION: Keep in sync with `replace_invalid_filename_chars` functions in filesystem.cpp and in .js files
@@ -92,6 +111,50 @@ llvm::StringRef Generator::escapeAttrForFilename(llvm::StringRef s, llvm::SmallV
     return llvm::StringRef(buffer.begin(), buffer.size());
 }
 
+unsigned int Generator::pageLines = 0;
+
+// The value of the id attribute, if there is one
+static llvm::StringRef idAttribute(llvm::StringRef attributes)
+{
+    for (auto pos = attributes.find("id="); pos != llvm::StringRef::npos;
+         pos = attributes.find("id=", pos + 3)) {
+        if ((pos == 0 || attributes[pos - 1] == ' ') && pos + 3 < attributes.size()) {
+            char quote = attributes[pos + 3];
+            return attributes.drop_front(pos + 4).take_until([&](char c) { return c == quote; });
+        }
+    }
+    return {};
+}
+
+// Writes a file of the page at once, compressed with --compress, and to the store with --cas
+static void writeWholeFile(const std::string &path, std::string content)
+{
+    if (Compression::enabled)
+        content = Compression::gzip(content);
+    Stats::add(Stats::BytesWritten, content.size());
+    std::string realPath = path + Compression::suffix();
+    if (ObjectStore::enabled()) {
+        if (!ObjectStore::write(realPath, content))
+            std::cerr << "Error generating " << path << std::endl;
+        return;
+    }
+    if (ObjectStore::hasLinks())
+        llvm::sys::fs::remove(realPath);
+    std::error_code error_code;
+#if CLANG_VERSION_MAJOR >= 13
+    llvm::raw_fd_ostream file(realPath, error_code, llvm::sys::fs::OF_None);
+#else
+    llvm::raw_fd_ostream file(realPath, error_code, llvm::sys::fs::F_None);
+#endif
+    if (!error_code)
+        file << content;
+    if (error_code || file.has_error()) {
+        spdlog::error("Error generating real_filename: {}", path);
+        std::cerr << "Error generating " << path << std::endl;
+        file.clear_error();
+    }
+}
+
 void Generator::Tag::open(llvm::raw_ostream &myfile) const
 {
     myfile << "<" << name;
@@ -117,37 +180,71 @@ void Generator::Tag::close(llvm::raw_ostream &myfile) const
     myfile << "</" << name << ">";
 }
 
+void Generator::sortTags()
+{
+    std::sort(tags.begin(), tags.end());
+    // Remove the tags that are the same as the first tag with the same position and length
+    // (Hapens in macro for example). Tags of length 0 are not deduplicated.
+    auto out = tags.begin();
+    auto groupBegin = tags.begin();
+    for (auto it = tags.begin(); it != tags.end(); ++it) {
+        if (out == tags.begin() || it->pos != groupBegin->pos || it->len != groupBegin->len) {
+            groupBegin = out;
+        } else if (it->len != 0 && it->name == groupBegin->name
+                   && it->attributes == groupBegin->attributes) {
+            continue;
+        }
+        *out++ = *it;
+    }
+    tags.erase(out, tags.end());
+}
+
 void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, const std::string &filename,
                          const char* begin, const char* end, llvm::StringRef footer, llvm::StringRef warningMessage,
                          const std::set<std::string> &interestingDefinitions)
 {
+    Stats::Timer timer(Stats::Html);
     std::string real_filename = outputPrefix % "/" % filename % ".html";
     SPDLOG_DEBUG("generate file with real_filename: {}", real_filename);
     // Make sure the parent directory exist:
     create_directories(llvm::StringRef(real_filename).rsplit('/').first);
 
+    // With --compress or --cas, the page is built in memory and written at the end
+    std::string buffer;
+    llvm::raw_string_ostream memfile(buffer);
+    std::unique_ptr<llvm::raw_fd_ostream> file;
+    if (ObjectStore::enabled()) {
+        buffer.reserve(2 * (end - begin));
+    } else {
+        // Not written through to the object a previous run with --cas linked it to
+        if (ObjectStore::hasLinks())
+            llvm::sys::fs::remove(real_filename + Compression::suffix());
 #if CLANG_VERSION_MAJOR==3 && CLANG_VERSION_MINOR<=5
-    std::string error;
-    llvm::raw_fd_ostream myfile(real_filename.c_str(), error, llvm::sys::fs::F_None);
-    if (!error.empty()) {
-        std::cerr << "Error generating " << real_filename << " ";
-        std::cerr << error<< std::endl;
-        return;
-    }
+        std::string error;
+        file = std::make_unique<llvm::raw_fd_ostream>((real_filename + Compression::suffix()).c_str(), error, llvm::sys::fs::F_None);
+        if (!error.empty()) {
+            std::cerr << "Error generating " << real_filename << " ";
+            std::cerr << error<< std::endl;
+            return;
+        }
 #else
-    std::error_code error_code;
+        std::error_code error_code;
 #if CLANG_VERSION_MAJOR >= 13
-    llvm::raw_fd_ostream myfile(real_filename, error_code, llvm::sys::fs::OF_None);
+        file = std::make_unique<llvm::raw_fd_ostream>(real_filename + Compression::suffix(), error_code, llvm::sys::fs::OF_None);
 #else
-    llvm::raw_fd_ostream myfile(real_filename, error_code, llvm::sys::fs::F_None);
+        file = std::make_unique<llvm::raw_fd_ostream>(real_filename + Compression::suffix(), error_code, llvm::sys::fs::F_None);
 #endif
-    if (error_code) {
-    	spdlog::error("Error generating real_filename: {}", real_filename);
-        std::cerr << "Error generating " << real_filename << " ";
-        std::cerr << error_code.message() << std::endl;
-        return;
-    }
+        if (error_code) {
+            spdlog::error("Error generating real_filename: {}", real_filename);
+            std::cerr << "Error generating " << real_filename << " ";
+            std::cerr << error_code.message() << std::endl;
+            return;
+        }
 #endif
+        if (Compression::enabled)
+            buffer.reserve(2 * (end - begin));
+    }
+    llvm::raw_ostream &myfile = file && !Compression::enabled ? static_cast<llvm::raw_ostream &>(*file) : memfile;
 
     int count = std::count(filename.begin(), filename.end(), '/');
     std::string root_path = "..";
@@ -170,6 +267,7 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
     myfile << "<link rel=\"alternate stylesheet\" href=\"" << dataPath << "/kdevelop.css\" title=\"KDevelop\"/>\n";
     myfile << "<script type=\"text/javascript\" src=\"" << dataPath << "/jquery/jquery.min.js\"></script>\n";
     myfile << "<script type=\"text/javascript\" src=\"" << dataPath << "/jquery/jquery-ui.min.js\"></script>\n";
+    myfile << "<script type=\"text/javascript\" src=\"" << dataPath << "/refpack.js\"></script>\n";
     myfile << "<script>var file = '"<< filename  <<"'; var root_path = '"<< root_path <<"'; var data_path = '"<< dataPath <<"'; var ecma_script_api_version = 2;";
     if (!projects.empty()) {
         myfile << "var projects = {";
@@ -213,14 +311,39 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
         myfile << "</p>\n";
     }
 
+    // With --page-lines, the lines after the first chunk go to <page>.chunk<i>, and the table
+    // only has a placeholder for them, which codebrowser.js fills once it is scrolled to
+    unsigned int chunkLines = 0;
+    unsigned int lineCount = 0;
+    if (pageLines) {
+        lineCount = std::count(begin, end, '\n') + 1;
+        if (lineCount > pageLines)
+            chunkLines = pageLines;
+    }
+    unsigned int chunk = 0;
+    std::string chunkBuffer;
+    llvm::raw_string_ostream chunkFile(chunkBuffer);
+    std::vector<std::pair<unsigned int, llvm::StringRef>> chunkAnchors; // chunk, id
+    auto writeChunk = [&] {
+        std::string path = real_filename % ".chunk" % llvm::Twine(chunk).str();
+        writeWholeFile(path, std::move(chunkFile.str()));
+        chunkBuffer.clear();
+    };
+
     //** here we put the code
-    myfile << "<table class=\"code\">\n";
+    if (chunkLines)
+        myfile << "<table class=\"code\" data-chunk-lines=\"" << chunkLines << "\" data-lines=\""
+               << lineCount << "\">\n<tbody>\n";
+    else
+        myfile << "<table class=\"code\">\n";
+    llvm::raw_ostream *os = &myfile; // the page, or the current chunk
 
 
     const char *c = begin;
     unsigned int line = 1;
     const char *bufferStart = c;
 
+    sortTags();
     auto tags_it = tags.cbegin();
     const char *next_start = tags_it != tags.cend() ? (begin + tags_it->pos) : end;
     const char *next_end = end;
@@ -229,7 +352,7 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
 
     auto flush = [&]() {
         if (bufferStart != c)
-            myfile.write(bufferStart, c - bufferStart);
+            os->write(bufferStart, c - bufferStart);
         bufferStart = c;
     };
 
@@ -244,7 +367,7 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
             while (!stack.empty() && c >= next_end) {
                 const Tag *top = stack.back();
                 stack.pop_back();
-                top->close(myfile);
+                top->close(*os);
                 next_end = end;
                 if (!stack.empty()) {
                     top = stack.back();
@@ -256,7 +379,12 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
             assert(c < end);
             while (c == next_start && tags_it != tags.cend()) {
                 assert(c == begin + tags_it->pos);
-                tags_it->open(myfile);
+                tags_it->open(*os);
+                if (chunk) {
+                    llvm::StringRef id = idAttribute(tags_it->attributes);
+                    if (!id.empty())
+                        chunkAnchors.emplace_back(chunk, id);
+                }
                 if (tags_it->len) {
                     stack.push_back(&(*tags_it));
                     next_end =  c + tags_it->len;
@@ -270,30 +398,59 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
             //next = std::min(end, next);
         }
 
+        // Skip to the next character to escape, or to the next tag boundary.
+        // The skipped characters are written by the next flush()
+        c = findFirstOf<'\n', '&', '<', '>'>(c, next);
+        if (c == next)
+            continue;
+
         switch (*c) {
             case '\n':
                 flush();
                 ++bufferStart; //skip the new line
                 ++line;
                 for (auto it = stack.crbegin(); it != stack.crend(); ++it)
-                    (*it)->close(myfile);
-                myfile << "</td></tr>\n"
-                          "<tr><th id=\"" << line << "\">"<< line << "</th><td>";
+                    (*it)->close(*os);
+                *os << "</td></tr>\n";
+                if (chunkLines && (line - 1) % chunkLines == 0) {
+                    if (chunk)
+                        writeChunk();
+                    else
+                        myfile << "</tbody>\n";
+                    ++chunk;
+                    myfile << "<tbody class=\"chunk\" data-chunk=\"" << chunk << "\" data-first=\""
+                           << line << "\" data-count=\"" << std::min(chunkLines, lineCount - line + 1)
+                           << "\"><tr><th></th><td></td></tr></tbody>\n";
+                    os = &chunkFile;
+                }
+                *os << "<tr><th id=\"" << line << "\">"<< line << "</th><td>";
                 for (auto it = stack.cbegin(); it != stack.cend(); ++it)
-                     (*it)->open(myfile);
+                     (*it)->open(*os);
                 break;
-            case '&': flush(); ++bufferStart; myfile << "&amp;"; break;
-            case '<': flush(); ++bufferStart; myfile << "&lt;"; break;
-            case '>': flush(); ++bufferStart; myfile << "&gt;"; break;
+            case '&': flush(); ++bufferStart; *os << "&amp;"; break;
+            case '<': flush(); ++bufferStart; *os << "&lt;"; break;
+            case '>': flush(); ++bufferStart; *os << "&gt;"; break;
             default: break;
         }
         ++c;
     }
 
 
-    myfile << "</td></tr>\n"
-              "</table>"
-              "<hr/>";
+    *os << "</td></tr>\n";
+    if (chunk) {
+        writeChunk();
+    } else if (chunkLines) {
+        myfile << "</tbody>";
+    }
+    myfile << "</table>";
+    if (!chunkAnchors.empty()) {
+        // So that the anchors of the chunks not loaded yet can be found
+        myfile << "<div id=\"chunk_anchors\" hidden>";
+        for (const auto &anchor : chunkAnchors)
+            myfile << "<i data-c=\"" << anchor.first << "\" data-id=\"" << anchor.second << "\"></i>";
+        myfile << "</div>\n";
+    }
+    myfile << "<hr/>";
 
     if (!warningMessage.empty()) {
         myfile << "<p class=\"warnmsg\">";
@@ -307,5 +464,16 @@ void Generator::generate(llvm::StringRef outputPrefix, std::string dataPath, con
 
     myfile << "<br />Powered by <a href='https://woboq.com'><img alt='Woboq' src='https://code.woboq.org/woboq-16.png' width='41' height='16' /></a> <a href='https://code.woboq.org'>Code Browser</a> "
               CODEBROWSER_VERSION "\n<br/>Generator usage only permitted with license.</p>\n</div></body></html>\n";
+    Stats::add(Stats::Tags, tags.size());
+    if (ObjectStore::enabled()) {
+        std::string content = Compression::enabled ? Compression::gzip(memfile.str()) : std::move(memfile.str());
+        if (!ObjectStore::write(real_filename + Compression::suffix(), content))
+            std::cerr << "Error generating " << real_filename << std::endl;
+        Stats::add(Stats::BytesWritten, content.size());
+    } else {
+        if (Compression::enabled)
+            *file << Compression::gzip(memfile.str());
+        Stats::add(Stats::BytesWritten, file->tell());
+    }
     SPDLOG_DEBUG("Finished generate file with real_filename: {}", real_filename);
 }
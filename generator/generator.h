@@ -22,6 +22,9 @@
 #pragma once
 
 #include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/StringSaver.h>
 #include <map>
 #include <set>
 #include <string>
@@ -39,47 +42,61 @@ class raw_ostream;
 class Generator
 {
 
+    // The strings point into the Generator's arena (or names for the name)
     struct Tag
     {
-        std::string name;
-        std::string attributes;
+        llvm::StringRef name;
+        llvm::StringRef attributes;
+        llvm::StringRef innerHtml;
         int pos;
         int len;
-        std::string innerHtml;
+        unsigned int seq; // insertion order
         bool operator<(const Tag &other) const
         {
             // This is the order of the opening tag. Order first by position, then by length
             //  (in the reverse order) with the exception of length of 0 which always goes first.
             //  Ordered first by position, and then by lenth (reverse order)
-            return (pos != other.pos) ? pos < other.pos
-                                      : len == 0 || (other.len != 0 && len > other.len);
-        }
-        bool operator==(const Tag &other) const
-        {
-            return std::tie(pos, len, name, attributes)
-                == std::tie(other.pos, other.len, other.name, other.attributes);
+            //  Tags of length 0 at the same position are in reverse insertion order, the
+            //  others of the same length in insertion order (as the std::multiset used to do)
+            if (pos != other.pos)
+                return pos < other.pos;
+            if ((len == 0) != (other.len == 0))
+                return len == 0;
+            if (len == 0)
+                return seq > other.seq;
+            if (len != other.len)
+                return len > other.len;
+            return seq < other.seq;
         }
         void open(llvm::raw_ostream &myfile) const;
         void close(llvm::raw_ostream &myfile) const;
     };
 
-    std::multiset<Tag> tags;
+    // Appended in any order, sorted and deduplicated once in generate()
+    std::vector<Tag> tags;
+    llvm::BumpPtrAllocator arena;
+    llvm::StringSet<> names; // there are only a few different tag names
+
+    void sortTags();
 
     std::map<std::string, std::string> projects;
 
 public:
-    void addTag(std::string name, std::string attributes, int pos, int len,
-                std::string innerHtml = {})
+    void addTag(llvm::StringRef name, const std::string &attributes, int pos, int len,
+                const std::string &innerHtml = {})
     {
         if (len < 0) {
             return;
         }
-        Tag t = { std::move(name), std::move(attributes), pos, len, std::move(innerHtml) };
-        auto it = tags.find(t);
-        if (it != tags.end() && *it == t)
-            return; // Hapens in macro for example
-        tags.insert(std::move(t));
+        llvm::StringSaver saver(arena);
+        tags.push_back({ names.insert(name).first->getKey(),
+                         attributes.empty() ? llvm::StringRef() : saver.save(attributes),
+                         innerHtml.empty() ? llvm::StringRef() : saver.save(innerHtml), pos, len,
+                         static_cast<unsigned int>(tags.size()) });
     }
+    // --page-lines: the number of lines of a chunk of the pages of the longer files, 0 if disabled
+    static unsigned int pageLines;
+
     void addProject(std::string a, std::string b)
     {
         projects.insert({ std::move(a), std::move(b) });
@@ -0,0 +1,471 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "incremental.h"
+#include "../global.h"
+#include "annotationpass.h"
+#include "filesystem.h"
+#include "generator.h"
+#include "projectmanager.h"
+#include "stringbuilder.h"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+
+#include <chrono>
+#include <iostream>
+#include <unordered_set>
+
+#include "spdlog/spdlog.h"
+
+// ATTENTION: Bump when the format of the manifest or the journals changes
+static const char ManifestHeader[] = "codebrowser-incremental 1";
+
+void TUJournal::add(Kind kind, llvm::StringRef path, llvm::StringRef data)
+{
+    llvm::raw_string_ostream os(buffer);
+    os << char(kind) << ' ' << path.size() << ' ' << data.size() << '\n' << path << data;
+}
+
+// The records are lines, except in the refs where a <doc> may span several lines.
+// (A line of a <doc> cannot start with '<' because the content is escaped)
+template<typename F>
+static void forEachRecord(TUJournal::Kind kind, llvm::StringRef data, F &&f)
+{
+    std::size_t begin = 0;
+    while (begin < data.size()) {
+        std::size_t end = data.find('\n', begin);
+        if (kind == TUJournal::Ref) {
+            while (end != llvm::StringRef::npos && end + 1 < data.size() && data[end + 1] != '<')
+                end = data.find('\n', end + 1);
+        }
+        end = end == llvm::StringRef::npos ? data.size() : end + 1;
+        f(data.slice(begin, end));
+        begin = end;
+    }
+}
+
+static int64_t modificationTime(const llvm::sys::fs::file_status &st)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               st.getLastModificationTime().time_since_epoch())
+        .count();
+}
+
+static bool writeFile(const std::string &path, llvm::StringRef data)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::OF_None);
+    if (!ec) {
+        os << data;
+        os.close();
+        ec = os.error();
+        os.clear_error();
+    }
+    if (ec) {
+        SPDLOG_ERROR("Cannot write {}: {}", path, ec.message());
+        std::cerr << "Error writing " << path << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+Incremental::Incremental(ProjectManager &pm)
+    : projectManager(pm)
+    , dir(pm.outputPrefix % "/.incremental")
+{
+    // The pages also depend on the version and the projects.
+    // (xxHash64 and not llvm::hash_code, which is not stable across executions)
+    std::string settings = CODEBROWSER_VERSION;
+    auto add = [&](llvm::StringRef field) {
+        settings += '\0';
+        settings += field;
+    };
+    add(pm.dataPath);
+    for (const auto &p : pm.projects) {
+        add(p.name);
+        add(p.source_path);
+        add(p.revision);
+        add(p.external_root_url);
+        add(std::to_string(p.type));
+    }
+    for (const auto &pass : AnnotationPipeline::registered()) {
+        if (!pass.enabled)
+            add(pass.name);
+    }
+    add(std::to_string(Generator::pageLines));
+    settingsHash = llvm::xxHash64(settings);
+}
+
+void Incremental::load()
+{
+    if (auto e = create_directories(dir + "/journals")) {
+        SPDLOG_ERROR("Cannot create {}: {}", dir, e.message());
+        std::cerr << "Error creating " << dir << ": " << e.message() << std::endl;
+    }
+
+    std::string content;
+    if (!readJournal(dir % "/manifest", content))
+        return; // first incremental run
+    llvm::StringRef rest(content);
+    auto nextLine = [&] {
+        auto split = rest.split('\n');
+        rest = split.second;
+        return split.first;
+    };
+    if (nextLine() != ManifestHeader) {
+        std::cerr << "Ignoring the incremental manifest of an other version" << std::endl;
+        return;
+    }
+
+    // T <command hash> <main file>
+    //   D <size> <mtime> <hash> <file>
+    //   O <index of the source in the D lines> <page>
+    Unit *unit = nullptr;
+    while (!rest.empty()) {
+        llvm::StringRef line = nextLine();
+        if (line.size() < 2 || line[1] != ' ')
+            continue;
+        llvm::StringRef fields = line.substr(2);
+        llvm::StringRef f0, f1, f2;
+        switch (line[0]) {
+        case 'T': {
+            std::tie(f0, fields) = fields.split(' ');
+            uint64_t hash;
+            unit = f0.getAsInteger(16, hash) ? nullptr : &previous[fields.str()];
+            if (unit)
+                unit->commandHash = hash;
+            break;
+        }
+        case 'D': {
+            std::tie(f0, fields) = fields.split(' ');
+            std::tie(f1, fields) = fields.split(' ');
+            std::tie(f2, fields) = fields.split(' ');
+            Dependency dep;
+            if (!unit || f0.getAsInteger(10, dep.size) || f1.getAsInteger(10, dep.mtime)
+                || f2.getAsInteger(16, dep.hash))
+                break;
+            dep.path = fields.str();
+            unit->dependencies.push_back(std::move(dep));
+            break;
+        }
+        case 'O': {
+            std::tie(f0, fields) = fields.split(' ');
+            std::size_t index;
+            if (!unit || f0.getAsInteger(10, index) || index >= unit->dependencies.size())
+                break;
+            unit->pages.emplace_back(fields.str(), unit->dependencies[index].path);
+            break;
+        }
+        }
+    }
+    SPDLOG_DEBUG("Incremental manifest with {} translation units", previous.size());
+}
+
+uint64_t Incremental::commandHash(const std::vector<std::string> &command,
+                                  llvm::StringRef directory) const
+{
+    std::string s = llvm::utohexstr(settingsHash);
+    s += '\0';
+    s += directory;
+    for (const auto &arg : command) {
+        s += '\0';
+        s += arg;
+    }
+    return llvm::xxHash64(s);
+}
+
+std::string Incremental::journalPath(const std::string &mainFile) const
+{
+    return dir % "/journals/" % llvm::utohexstr(llvm::xxHash64(mainFile));
+}
+
+bool Incremental::readJournal(const std::string &path, std::string &content) const
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return false;
+    content = (*buffer)->getBuffer().str();
+    return true;
+}
+
+bool Incremental::stateOf(const std::string &path, Dependency &result)
+{
+    {
+        std::lock_guard lock(cacheMutex);
+        auto it = stateCache.find(path);
+        if (it != stateCache.end()) {
+            result = it->second;
+            return true;
+        }
+    }
+    llvm::sys::fs::file_status st;
+    if (llvm::sys::fs::status(path, st))
+        return false;
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return false;
+    result = { path, st.getSize(), modificationTime(st), llvm::xxHash64((*buffer)->getBuffer()) };
+    std::lock_guard lock(cacheMutex);
+    stateCache.emplace(path, result);
+    return true;
+}
+
+bool Incremental::isUnchanged(Dependency &dep)
+{
+    llvm::sys::fs::file_status st;
+    if (llvm::sys::fs::status(dep.path, st))
+        return false;
+    if (st.getSize() == dep.size && modificationTime(st) == dep.mtime)
+        return true;
+    // Only touched?
+    Dependency now;
+    if (!stateOf(dep.path, now) || now.hash != dep.hash)
+        return false;
+    dep = std::move(now);
+    return true;
+}
+
+bool Incremental::isUpToDate(const std::string &mainFile, uint64_t commandHash)
+{
+    if (upToDate.count(mainFile))
+        return true;
+    auto it = previous.find(mainFile);
+    bool result = it != previous.end() && !scheduled.count(mainFile)
+        && it->second.commandHash == commandHash && llvm::sys::fs::exists(journalPath(mainFile));
+    if (result) {
+        for (auto &dep : it->second.dependencies) {
+            if (!isUnchanged(dep)) {
+                SPDLOG_DEBUG("{} changed since the previous run of {}", dep.path, mainFile);
+                result = false;
+                break;
+            }
+        }
+    }
+    (result ? upToDate : scheduled).insert(mainFile);
+    return result;
+}
+
+void Incremental::claimUnchanged()
+{
+    // Also the ones which are not part of this run, unless their main file is gone
+    for (const auto &it : previous) {
+        if (!scheduled.count(it.first) && !llvm::sys::fs::exists(it.first))
+            removed.insert(it.first);
+        if (scheduled.count(it.first) || removed.count(it.first))
+            continue;
+        for (const auto &page : it.second.pages)
+            projectManager.claimPage(projectManager.outputPrefix % "/" % page.first);
+    }
+}
+
+void Incremental::commit(const std::string &mainFile, uint64_t commandHash,
+                         const std::vector<std::string> &dependencies, const TUJournal &journal)
+{
+    Unit unit;
+    unit.commandHash = commandHash;
+    std::set<std::string> seen;
+    for (const auto &path : dependencies) {
+        Dependency dep;
+        if (seen.insert(path).second && stateOf(path, dep))
+            unit.dependencies.push_back(std::move(dep));
+    }
+    TUJournal::forEach(journal.data(), [&](TUJournal::Kind kind, llvm::StringRef path,
+                                           llvm::StringRef data) {
+        if (kind == TUJournal::Html)
+            unit.pages.emplace_back(path.str(), data.str());
+    });
+
+    // Not renamed before finish(), so an interrupted run leaves the previous state intact
+    if (!writeFile(journalPath(mainFile) % ".new", journal.data()))
+        return; // as if the translation unit failed: processed again next time
+    std::lock_guard lock(mutex);
+    current[mainFile] = std::move(unit);
+}
+
+std::vector<std::string> Incremental::reprocessForOrphans()
+{
+    // The translation units whose pages may be orphans: processed again, or gone
+    std::set<std::string> replaced = scheduled;
+    replaced.insert(removed.begin(), removed.end());
+    std::map<std::string, std::string> candidates; // page -> source
+    for (const auto &it : previous) {
+        if (!replaced.count(it.first))
+            continue;
+        for (const auto &page : it.second.pages) {
+            if (!projectManager.isPageClaimed(projectManager.outputPrefix % "/" % page.first))
+                candidates.insert(page);
+        }
+    }
+
+    std::vector<std::string> result;
+    if (candidates.empty())
+        return result;
+    for (auto it = previous.begin(); it != previous.end() && !candidates.empty(); ++it) {
+        if (replaced.count(it->first))
+            continue;
+        std::set<llvm::StringRef> files;
+        for (const auto &dep : it->second.dependencies)
+            files.insert(dep.path);
+        bool includesOrphan = false;
+        for (auto c = candidates.begin(); c != candidates.end();) {
+            if (!files.count(c->second)) {
+                ++c;
+                continue;
+            }
+            includesOrphan = true;
+            // A translation unit which is not part of this run may still link to it: keep it
+            c = upToDate.count(it->first) ? std::next(c) : candidates.erase(c);
+        }
+        if (includesOrphan && upToDate.count(it->first)) {
+            for (const auto &page : it->second.pages)
+                projectManager.releasePage(projectManager.outputPrefix % "/" % page.first);
+            upToDate.erase(it->first);
+            scheduled.insert(it->first);
+            result.push_back(it->first);
+        }
+    }
+    for (auto &c : candidates)
+        orphans.insert(c.first);
+    return result;
+}
+
+bool Incremental::finish()
+{
+    bool ok = true;
+    const std::string &prefix = projectManager.outputPrefix;
+
+    // The shared files touched by the translation units which were processed or removed
+    std::set<std::string> affected;
+    auto collect = [&](llvm::StringRef journal) {
+        TUJournal::forEach(journal, [&](TUJournal::Kind kind, llvm::StringRef path,
+                                        llvm::StringRef) {
+            if (kind != TUJournal::Html)
+                affected.insert(path.str());
+        });
+    };
+
+    std::map<std::string, Unit> units;
+    for (auto &it : previous) {
+        if (!scheduled.count(it.first) && !removed.count(it.first)) {
+            units.emplace(it.first, std::move(it.second));
+            continue;
+        }
+        std::string content;
+        if (readJournal(journalPath(it.first), content))
+            collect(content);
+        if (!current.count(it.first))
+            llvm::sys::fs::remove(journalPath(it.first));
+    }
+    for (auto &it : current) {
+        std::string path = journalPath(it.first);
+        std::string content;
+        if (!readJournal(path % ".new", content)) {
+            std::cerr << "Error reading the journal of " << it.first << std::endl;
+            ok = false;
+            continue;
+        }
+        collect(content);
+        if (auto e = llvm::sys::fs::rename(path + ".new", path)) {
+            std::cerr << "Error renaming " << path << ": " << e.message() << std::endl;
+            ok = false;
+            continue;
+        }
+        units[it.first] = std::move(it.second);
+    }
+
+    // Rebuild them from all the journals, without duplicated records
+    std::map<std::string, std::pair<std::string, std::unordered_set<uint64_t>>> files;
+    for (const auto &it : units) {
+        std::string content;
+        if (!readJournal(journalPath(it.first), content)) {
+            std::cerr << "Error reading the journal of " << it.first << std::endl;
+            ok = false;
+            continue;
+        }
+        bool valid = TUJournal::forEach(content, [&](TUJournal::Kind kind, llvm::StringRef path,
+                                                     llvm::StringRef data) {
+            if (kind == TUJournal::Html || !affected.count(path.str()))
+                return;
+            auto &file = files[path.str()];
+            forEachRecord(kind, data, [&](llvm::StringRef record) {
+                if (file.second.insert(llvm::xxHash64(record)).second)
+                    file.first += record;
+            });
+        });
+        if (!valid) {
+            std::cerr << "Corrupted journal for " << it.first << std::endl;
+            ok = false;
+        }
+    }
+    for (const auto &path : affected) {
+        auto it = files.find(path);
+        if (it == files.end()) {
+            llvm::sys::fs::remove(prefix + "/" + path);
+            continue;
+        }
+        ok &= writeFile(prefix % "/" % path, it->second.first);
+    }
+    SPDLOG_DEBUG("Incremental: {} shared files rewritten", affected.size());
+
+    for (const auto &page : orphans) {
+        std::string fn = prefix % "/" % page;
+        if (!projectManager.isPageClaimed(fn)) {
+            SPDLOG_DEBUG("Removing stale page {}", fn);
+            llvm::sys::fs::remove(fn);
+            // and its chunks, with --page-lines
+            for (int chunk = 1;; ++chunk) {
+                std::string path = fn + ".chunk" + std::to_string(chunk);
+                if (llvm::sys::fs::remove(path, /*IgnoreNonExisting=*/false))
+                    break;
+            }
+        }
+    }
+
+    std::string manifest;
+    llvm::raw_string_ostream os(manifest);
+    os << ManifestHeader << '\n';
+    for (const auto &it : units) {
+        const Unit &unit = it.second;
+        os << "T " << llvm::utohexstr(unit.commandHash) << ' ' << it.first << '\n';
+        std::unordered_map<std::string, std::size_t> index;
+        for (const auto &dep : unit.dependencies) {
+            index.emplace(dep.path, index.size());
+            os << "D " << dep.size << ' ' << dep.mtime << ' ' << llvm::utohexstr(dep.hash) << ' '
+               << dep.path << '\n';
+        }
+        for (const auto &page : unit.pages) {
+            auto i = index.find(page.second);
+            if (i != index.end())
+                os << "O " << i->second << ' ' << page.first << '\n';
+        }
+    }
+    os.flush();
+    if (!writeFile(dir % "/manifest.new", manifest)
+        || llvm::sys::fs::rename(dir + "/manifest.new", dir + "/manifest")) {
+        std::cerr << "Error writing the incremental manifest" << std::endl;
+        ok = false;
+    }
+    return ok;
+}
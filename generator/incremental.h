@@ -0,0 +1,167 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ProjectManager;
+
+/**
+ * What one translation unit wrote to the files shared with the other translation units
+ * (refs, fnSearch and fileIndex), and which HTML pages it generated.
+ * The paths are relative to the output prefix.
+ */
+class TUJournal
+{
+public:
+    enum Kind : char {
+        Ref = 'R',
+        FuncIndex = 'F',
+        FileIndex = 'I',
+        Html = 'H' // path is the page, data the canonical source file
+    };
+    void add(Kind kind, llvm::StringRef path, llvm::StringRef data);
+    const std::string &data() const { return buffer; }
+
+    // Calls f(kind, path, data) for every record. Returns false if the journal is corrupted.
+    template<typename F>
+    static bool forEach(llvm::StringRef journal, F &&f);
+
+private:
+    std::string buffer;
+};
+
+/**
+ * Incremental regeneration (--incremental).
+ *
+ * outputPrefix/.incremental/manifest records, for every translation unit, a hash of its compile
+ * command and the size, modification time and content hash of all the files it read. A
+ * translation unit whose command and files did not change is not processed again, and the pages
+ * it generated are claimed so no other translation unit regenerates them.
+ *
+ * The shared files cannot be appended to in that mode: the records of the translation units
+ * that are processed again must be replaced. Every translation unit writes its records to its
+ * own journal instead, and finish() rewrites the shared files touched by this run from the
+ * journals of all the translation units.
+ */
+class Incremental
+{
+public:
+    explicit Incremental(ProjectManager &pm);
+
+    // Reads the manifest of the previous run. Does nothing if there is none.
+    void load();
+
+    uint64_t commandHash(const std::vector<std::string> &command, llvm::StringRef directory) const;
+
+    // Returns true if the translation unit was already processed with this command and none
+    // of its files changed. Otherwise the translation unit is expected to be processed.
+    bool isUpToDate(const std::string &mainFile, uint64_t commandHash);
+
+    // To be called once all the isUpToDate() were called, before processing anything:
+    // claims the pages of the translation units which are not processed.
+    void claimUnchanged();
+
+    // Called by each processed translation unit, once its files are generated.
+    void commit(const std::string &mainFile, uint64_t commandHash,
+                const std::vector<std::string> &dependencies, const TUJournal &journal);
+
+    /**
+     * Once the processed translation units are done, some headers may have no page anymore:
+     * their previous owner was processed again and did not include them. Returns the up to date
+     * translation units which include such a header and releases their claims: they must be
+     * processed again so the header gets a page.
+     */
+    std::vector<std::string> reprocessForOrphans();
+
+    /**
+     * Rewrites the shared files touched by this run, removes the pages nobody owns anymore,
+     * and saves the manifest. Returns false on error.
+     */
+    bool finish();
+
+private:
+    struct Dependency
+    {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t hash = 0;
+    };
+    struct Unit
+    {
+        uint64_t commandHash = 0;
+        std::vector<Dependency> dependencies;
+        std::vector<std::pair<std::string, std::string>> pages; // page -> source file
+    };
+
+    std::string journalPath(const std::string &mainFile) const;
+    bool stateOf(const std::string &path, Dependency &result);
+    bool isUnchanged(Dependency &dep); // updates the size and time if only they changed
+    bool readJournal(const std::string &path, std::string &content) const;
+
+    ProjectManager &projectManager;
+    std::string dir;
+    uint64_t settingsHash;
+
+    std::map<std::string, Unit> previous; // from the manifest
+    std::set<std::string> upToDate;
+    std::set<std::string> scheduled;
+    std::set<std::string> removed; // not part of this run, and their main file is gone
+    std::set<std::string> orphans; // pages of the previous run nobody claimed anymore
+
+    std::mutex mutex; // protects current
+    std::map<std::string, Unit> current; // committed during this run
+
+    std::mutex cacheMutex;
+    std::unordered_map<std::string, Dependency> stateCache; // files already hashed in this run
+};
+
+template<typename F>
+bool TUJournal::forEach(llvm::StringRef journal, F &&f)
+{
+    // Each record is "<kind> <path size> <data size>\n<path><data>"
+    while (!journal.empty()) {
+        auto eol = journal.find('\n');
+        if (eol == llvm::StringRef::npos || eol < 2)
+            return false;
+        Kind kind = static_cast<Kind>(journal[0]);
+        auto sizes = journal.slice(2, eol).split(' ');
+        std::size_t pathSize, dataSize;
+        if (sizes.first.getAsInteger(10, pathSize) || sizes.second.getAsInteger(10, dataSize))
+            return false;
+        journal = journal.substr(eol + 1);
+        if (journal.size() < pathSize + dataSize)
+            return false;
+        f(kind, journal.substr(0, pathSize), journal.substr(pathSize, dataSize));
+        journal = journal.substr(pathSize + dataSize);
+    }
+    return true;
+}
@@ -23,6 +23,7 @@
  * SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
  *******************************************************************************/
 #include "inlayhintannotator.h"
+#include "annotationpass.h"
 #include "annotator.h"
 #include "stringbuilder.h"
 
@@ -286,3 +287,57 @@ std::string InlayHintsAnnotatorHelper::getParamNameInlayHint(clang::CallExpr *e,
     llvm::StringRef refStr = isLValueRef ? "&amp;" : llvm::StringRef();
     return paramName % refStr % ":&nbsp;";
 }
+
+namespace {
+
+// The name of the parameter before each argument of a call, unless the argument says it already
+struct ParamHintsPass : AnnotationPass
+{
+    Annotator &annotator;
+    explicit ParamHintsPass(Annotator &annotator)
+        : annotator(annotator)
+    {
+    }
+
+    void visitCallExpr(clang::CallExpr *e, clang::NamedDecl *) override
+    {
+        // Not for the operators, as for the refargs
+        auto decl = e->getDirectCallee();
+        if (!decl || llvm::isa<clang::CXXOperatorCallExpr>(e))
+            return;
+        InlayHintsAnnotatorHelper helper(&annotator);
+        for (unsigned int i = 0; i < e->getNumArgs() && i < decl->getNumParams(); ++i) {
+            auto arg = e->getArg(i);
+            annotator.addInlayHint(arg->getBeginLoc(),
+                                   helper.getParamNameInlayHint(e, decl->getParamDecl(i), arg));
+        }
+    }
+};
+
+// The designator of the member initialized by each element of an initializer list
+struct DesignatorHintsPass : AnnotationPass
+{
+    Annotator &annotator;
+    explicit DesignatorHintsPass(Annotator &annotator)
+        : annotator(annotator)
+    {
+    }
+
+    void visitInitListExpr(clang::InitListExpr *Syn) override
+    {
+        for (const auto &d : InlayHintsAnnotatorHelper(&annotator).getDesignatorInlayHints(Syn))
+            annotator.addInlayHint(d.getFirst(), d.getSecond());
+    }
+};
+
+}
+
+std::unique_ptr<AnnotationPass> createParamHintsPass(Annotator &annotator)
+{
+    return std::make_unique<ParamHintsPass>(annotator);
+}
+
+std::unique_ptr<AnnotationPass> createDesignatorHintsPass(Annotator &annotator)
+{
+    return std::make_unique<DesignatorHintsPass>(annotator);
+}
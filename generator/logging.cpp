@@ -0,0 +1,253 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "logging.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/pattern_formatter.h"
+#include "spdlog/sinks/sink.h"
+
+namespace {
+
+/* Bounded queue of strings without locks, for many producers and one consumer.
+ * Each slot has a sequence number telling whether it is free for the producer at that position
+ * or filled for the consumer. */
+template<std::size_t Size>
+class MessageRing
+{
+    struct alignas(64) Slot
+    {
+        std::atomic<std::size_t> sequence;
+        std::string data;
+    };
+    std::array<Slot, Size> slots;
+    alignas(64) std::atomic<std::size_t> head { 0 }; // next position for the producers
+    alignas(64) std::size_t tail = 0; // next position for the consumer
+
+public:
+    MessageRing()
+    {
+        for (std::size_t i = 0; i < Size; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // returns false if the ring is full
+    bool push(std::string &data)
+    {
+        std::size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots[pos % Size];
+            std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == pos) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.data = std::move(data);
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < pos) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // only to be called by the consumer
+    bool pop(std::string &data)
+    {
+        Slot &slot = slots[tail % Size];
+        if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        data = std::move(slot.data);
+        slot.data.clear();
+        slot.sequence.store(tail + Size, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+};
+
+class AsyncFileSink;
+std::atomic<AsyncFileSink *> activeSink { nullptr };
+
+struct ThreadBuffer
+{
+    unsigned generation = 0; // of the formatter
+    std::unique_ptr<spdlog::formatter> formatter;
+    spdlog::memory_buf_t buffer;
+    ~ThreadBuffer();
+};
+thread_local ThreadBuffer threadBuffer;
+
+class AsyncFileSink final : public spdlog::sinks::sink
+{
+public:
+    explicit AsyncFileSink(std::FILE *file)
+        : file(file)
+        , formatter(std::make_unique<spdlog::pattern_formatter>())
+        , writer([this] { write(); })
+    {
+        activeSink = this;
+    }
+
+    ~AsyncFileSink() override
+    {
+        activeSink = nullptr;
+        submit(threadBuffer);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        writer.join();
+        std::fclose(file);
+    }
+
+    void log(const spdlog::details::log_msg &msg) override
+    {
+        ThreadBuffer &b = threadBuffer;
+        if (b.generation != generation.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(formatterMutex);
+            b.formatter = formatter->clone();
+            b.generation = generation.load(std::memory_order_relaxed);
+        }
+        b.formatter->format(msg, b.buffer);
+        // The warnings and errors are written right away, they might be followed by a crash
+        if (b.buffer.size() >= 4096 || msg.level >= spdlog::level::warn)
+            submit(b);
+    }
+
+    void flush() override { submit(threadBuffer); }
+
+    void set_pattern(const std::string &pattern) override
+    {
+        set_formatter(std::make_unique<spdlog::pattern_formatter>(pattern));
+    }
+
+    void set_formatter(std::unique_ptr<spdlog::formatter> f) override
+    {
+        std::lock_guard<std::mutex> lock(formatterMutex);
+        formatter = std::move(f);
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+    void submit(ThreadBuffer &b)
+    {
+        if (b.buffer.size() == 0)
+            return;
+        std::string message(b.buffer.data(), b.buffer.size());
+        b.buffer.clear();
+        while (!ring.push(message)) {
+            // Full: let the writer catch up
+            wakeUp.notify_one();
+            std::this_thread::yield();
+        }
+        wakeUp.notify_one();
+    }
+
+private:
+    void write()
+    {
+        std::string message;
+        while (true) {
+            bool wrote = false;
+            while (ring.pop(message)) {
+                std::fwrite(message.data(), 1, message.size(), file);
+                wrote = true;
+            }
+            if (wrote)
+                std::fflush(file);
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping) {
+                lock.unlock();
+                while (ring.pop(message))
+                    std::fwrite(message.data(), 1, message.size(), file);
+                std::fflush(file);
+                return;
+            }
+            // The producers notify without taking the mutex, so a notification can be missed
+            wakeUp.wait_for(lock, std::chrono::milliseconds(100));
+        }
+    }
+
+    std::FILE *file;
+    MessageRing<1024> ring;
+
+    std::mutex formatterMutex; // protects formatter
+    std::unique_ptr<spdlog::formatter> formatter;
+    std::atomic<unsigned> generation { 1 };
+
+    std::mutex mutex; // protects stopping
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::thread writer;
+};
+
+ThreadBuffer::~ThreadBuffer()
+{
+    // The threads exiting before the sink is destroyed
+    if (AsyncFileSink *sink = activeSink.load())
+        sink->submit(*this);
+}
+
+} // namespace
+
+bool Logging::setup(const std::string &level, const std::string &path)
+{
+    auto lvl = spdlog::level::from_str(level);
+    if (lvl == spdlog::level::off && level != "off") {
+        std::cerr << "Invalid log level: " << level << std::endl;
+        return false;
+    }
+    if (lvl == spdlog::level::off) {
+        spdlog::set_level(lvl);
+        return true;
+    }
+    std::FILE *file = std::fopen(path.c_str(), "w");
+    if (!file) {
+        std::cerr << "Could not open the log file " << path << std::endl;
+        return false;
+    }
+    auto logger = std::make_shared<spdlog::logger>("codebrowser",
+                                                   std::make_shared<AsyncFileSink>(file));
+    spdlog::set_default_logger(logger);
+    spdlog::set_pattern("%T[%t][file: %s][fun: %!][line: %#] %v");
+    spdlog::set_level(lvl);
+    active = true;
+    return true;
+}
+
+Logging::~Logging()
+{
+    if (active) {
+        // Destroys the sink, but keeps a default logger for whatever logs later
+        spdlog::default_logger()->flush();
+        spdlog::set_default_logger(std::make_shared<spdlog::logger>("codebrowser"));
+    }
+}
@@ -0,0 +1,49 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <string>
+
+/**
+ * The log of the generator (--log-level, --log-file).
+ *
+ * The messages are formatted by the thread logging them into a buffer of its own, which is
+ * queued in a lock-free ring buffer once it is big enough, or right away for warnings and
+ * errors. A background thread writes them to the file. So logging does not make the threads
+ * processing the translation units wait for each other or for the file.
+ *
+ * The levels below SPDLOG_ACTIVE_LEVEL (CODEBROWSER_LOG_LEVEL in CMake) are not compiled in.
+ */
+class Logging
+{
+public:
+    Logging() = default;
+    ~Logging(); // writes what is left and stops the background thread
+    Logging(const Logging &) = delete;
+    Logging &operator=(const Logging &) = delete;
+
+    // Returns false if the level is not valid or the file cannot be opened
+    bool setup(const std::string &level, const std::string &path);
+
+private:
+    bool active = false;
+};
@@ -26,24 +26,39 @@
 #include "llvm/Support/CommandLine.h"
 
 #include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/Utils.h>
 #include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
 
-#include "annotator.h"
-#include "browserastvisitor.h"
+#include "annotationpass.h"
+#include "browseraction.h"
 #include "compat.h"
+#include "compression.h"
 #include "filesystem.h"
-#include "preprocessorcallback.h"
+#include "generator.h"
+#include "incremental.h"
+#include "logging.h"
+#include "objectstore.h"
+#include "preamble.h"
 #include "projectmanager.h"
+#include "scheduler.h"
+#include "stats.h"
 #include "stringbuilder.h"
+#include <atomic>
 #include <ctime>
+#include <deque>
+#include <functional>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <stdexcept>
 
+#if CLANG_VERSION_MAJOR >= 12
 #include "embedded_includes.h"
-#include "threadpool.h"
+#endif
 #include "logger.h"
 
 namespace cl = llvm::cl;
@@ -87,6 +102,100 @@ cl::opt<bool>
                       cl::desc("Process all files from the compile_commands.json. If this argument "
                                "is passed, the list of sources does not need to be passed"));
 
+cl::opt<bool> IncrementalMode(
+    "incremental",
+    cl::desc("Only process the translation units whose compile command or files changed since "
+             "the previous run with this option in the same output directory"));
+
+cl::opt<bool> SharePreamble(
+    "preamble",
+    cl::desc("Parse the headers included at the beginning of the source files only once for all "
+             "the files with the same includes and flags, and load them from a precompiled "
+             "header for the other files"));
+
+cl::opt<bool> CollectStats(
+    "stats",
+    cl::desc("Write the time spent in each phase and some counters for every translation unit to "
+             "stats.jsonl in the output directory, as one JSON object per line"));
+
+cl::opt<bool> ServerMode(
+    "server",
+    cl::desc("Read the source files to process from stdin, one per line, and write a status line "
+             "to stdout once each is done, until stdin is closed. The compilation database, the "
+             "projects and the files already generated are kept between them"));
+
+cl::opt<bool> CompressOutput(
+    "compress",
+    cl::desc("Write the HTML pages and the refs gzip compressed, to files with a .gz suffix, to "
+             "be served with Content-Encoding: gzip"));
+
+cl::opt<bool> ReuseTokens(
+    "reuse-tokens",
+    cl::desc("Record the tokens of the files to generate while parsing, and only lex again the "
+             "comments, the directives and the skipped blocks to highlight them"));
+
+cl::opt<bool> CasMode(
+    "cas",
+    cl::desc("Store the HTML pages and the refs once in a content addressed store and link them "
+             "into the output directory, so an unchanged file is not written again"));
+
+cl::opt<std::string> CasStore(
+    "cas-store", cl::value_desc("dir"),
+    cl::desc("Directory of the objects of --cas, which can be shared by several output "
+             "directories on the same file system (default: <output>/.objects)"));
+
+cl::opt<std::string> CasLink(
+    "cas-link", cl::value_desc("hard|symbolic"), cl::init("hard"),
+    cl::desc("How --cas links the files to their object (default: hard)"));
+
+cl::list<std::string> DisabledPasses(
+    "disable-pass", cl::value_desc("pass"), cl::CommaSeparated,
+    cl::desc("Do not run these annotation passes, to save their time: param-hints, "
+             "designator-hints, qt, record-layout"),
+    cl::ZeroOrMore);
+
+cl::opt<std::string> Shard(
+    "shard", cl::value_desc("i/N"),
+    cl::desc("Only process the translation units, and generate the pages of the files, which "
+             "belong to the shard i of N, to be merged with the output of the other shards by "
+             "codebrowser_merge --input"));
+
+cl::opt<std::string> FillIn(
+    "fill-in", cl::value_desc("segment-missing"),
+    cl::desc("Only generate the pages of the files listed in the segment-missing file of "
+             "codebrowser_merge --input, which no shard generated, by processing the translation "
+             "units listed with them. The output is passed to codebrowser_merge as one more "
+             "--input"));
+
+cl::opt<unsigned> Jobs("j", cl::value_desc("jobs"),
+                       cl::desc("Number of translation units processed in parallel. Defaults to "
+                                "the number of cores"),
+                       cl::init(0));
+
+cl::opt<unsigned> PageLines(
+    "page-lines", cl::value_desc("lines"),
+    cl::desc("Split the pages of the files with more lines than that in chunks of that many "
+             "lines, which are loaded when they are scrolled to"),
+    cl::init(0));
+
+cl::opt<unsigned> MemoryBudget(
+    "memory-budget", cl::value_desc("MiB"),
+    cl::desc("Do not start more translation units while the resident memory, or the memory the "
+             "ones in progress are expected to use according to the previous run with --stats, "
+             "would exceed that many MiB"),
+    cl::init(0));
+
+cl::opt<std::string> LogLevel(
+    "log-level", cl::value_desc("level"),
+    cl::desc("Level of the messages written to the log: trace, debug, info, warning, error, "
+             "critical or off. Defaults to info"),
+    cl::init("info"));
+
+cl::opt<std::string>
+    LogFile("log-file", cl::value_desc("path"),
+            cl::desc("Where to write the log. Defaults to .logs/codebrowser.log in the output "
+                     "directory"));
+
 cl::extrahelp extra(
 
     R"(
@@ -100,307 +209,26 @@ With a project
   codebrowser_generator -b $PWD/build -a -p codebrowser:$PWD -o ~/public_html/code
 )");
 
-#if 1
-std::string locationToString(clang::SourceLocation loc, clang::SourceManager &sm)
-{
-    clang::PresumedLoc fixed = sm.getPresumedLoc(loc);
-    if (!fixed.isValid())
-        return "???";
-    return (llvm::Twine(fixed.getFilename()) + ":" + llvm::Twine(fixed.getLine())).str();
-}
-#endif
-
-enum class DatabaseType {
-    InDatabase,
-    NotInDatabase,
-    ProcessFullDirectory
-};
-
-struct BrowserDiagnosticClient : clang::DiagnosticConsumer
-{
-    Annotator &annotator;
-    BrowserDiagnosticClient(Annotator &fm)
-        : annotator(fm)
-    {
-    }
-
-    static bool isImmintrinDotH(const clang::PresumedLoc &loc)
-    {
-        return llvm::StringRef(loc.getFilename()).contains("immintrin.h");
-    }
-
-    virtual void HandleDiagnostic(clang::DiagnosticsEngine::Level DiagLevel,
-                                  const clang::Diagnostic &Info) override
-    {
-        std::string clas;
-        llvm::SmallString<1000> diag;
-        Info.FormatDiagnostic(diag);
-
-        switch (DiagLevel) {
-        case clang::DiagnosticsEngine::Fatal:
-            // ignore tons of errors in immintrin.h
-            if (isImmintrinDotH(annotator.getSourceMgr().getPresumedLoc(Info.getLocation())))
-                return;
-            std::cerr << "FATAL ";
-            LLVM_FALLTHROUGH;
-        case clang::DiagnosticsEngine::Error:
-            std::cerr << "Error: " << locationToString(Info.getLocation(), annotator.getSourceMgr())
-                      << ": " << diag.c_str() << std::endl;
-            clas = "error";
-            break;
-        case clang::DiagnosticsEngine::Warning:
-            clas = "warning";
-            break;
-        default:
-            return;
-        }
-        clang::SourceRange Range = Info.getLocation();
-        annotator.reportDiagnostic(Range, diag.c_str(), clas);
-    }
-};
-
-class BrowserASTConsumer : public clang::ASTConsumer
+// Rough estimate of the cost of a translation unit, from the size of its main file and the
+// number of files it includes, each of which possibly includes many more
+static double estimateCost(const std::string &file)
 {
-    clang::CompilerInstance &ci;
-    Annotator annotator;
-    DatabaseType WasInDatabase;
-
-public:
-    BrowserASTConsumer(clang::CompilerInstance &ci, ProjectManager &projectManager,
-                       DatabaseType WasInDatabase)
-        : clang::ASTConsumer()
-        , ci(ci)
-        , annotator(projectManager)
-        , WasInDatabase(WasInDatabase)
-    {
-		SPDLOG_DEBUG("BrowserASTConsumer constructor");
-        // ci.getLangOpts().DelayedTemplateParsing = (true);
-#if CLANG_VERSION_MAJOR < 16
-        // the meaning of this function has changed which causes
-        // a lot of issues in clang 16
-        ci.getPreprocessor().enableIncrementalProcessing();
-#endif
-    }
-    virtual ~BrowserASTConsumer()
-    {
-		SPDLOG_DEBUG("BrowserASTConsumer destructor");
-        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer, true);
-    }
-
-    virtual void Initialize(clang::ASTContext &Ctx) override
-    {
-        annotator.setSourceMgr(Ctx.getSourceManager(), Ctx.getLangOpts());
-        annotator.setMangleContext(Ctx.createMangleContext());
-        ci.getPreprocessor().addPPCallbacks(maybe_unique(new PreprocessorCallback(
-            annotator, ci.getPreprocessor(), WasInDatabase == DatabaseType::ProcessFullDirectory)));
-        ci.getDiagnostics().setClient(new BrowserDiagnosticClient(annotator), true);
-        ci.getDiagnostics().setErrorLimit(0);
-    }
-
-    virtual bool HandleTopLevelDecl(clang::DeclGroupRef D) override
-    {
-        if (ci.getDiagnostics().hasFatalErrorOccurred()) {
-			SPDLOG_DEBUG("Reset errors: (Hack to ignore the fatal errors.)");
-            // Reset errors: (Hack to ignore the fatal errors.)
-            ci.getDiagnostics().Reset();
-            // When there was fatal error, processing the warnings may cause crashes
-            ci.getDiagnostics().setIgnoreAllWarnings(true);
-        }
-        return true;
-    }
-
-    virtual void HandleTranslationUnit(clang::ASTContext &Ctx) override
-    {
-
-        /* if (PP.getDiagnostics().hasErrorOccurred())
-             return;*/
-        ci.getPreprocessor().getDiagnostics().getClient();
-
-
-        BrowserASTVisitor v(annotator);
-		SPDLOG_DEBUG("Create BrowserASTVisitor");
-        v.TraverseDecl(Ctx.getTranslationUnitDecl());
-		SPDLOG_DEBUG("TraverseDecl done");
-
-
-        annotator.generate(ci.getSema(), WasInDatabase != DatabaseType::NotInDatabase);
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer)
+        return 0;
+    llvm::StringRef content = buffer.get()->getBuffer();
+    std::size_t includes = 0;
+    for (auto pos = content.find('#'); pos != llvm::StringRef::npos;
+         pos = content.find('#', pos + 1)) {
+        llvm::StringRef directive = content.substr(pos + 1).ltrim(" \t");
+        if (directive.startswith("include") || directive.startswith("import"))
+            ++includes;
     }
-
-    virtual bool shouldSkipFunctionBody(clang::Decl *D) override
-    {
-        return !annotator.shouldProcess(
-            clang::FullSourceLoc(D->getLocation(), annotator.getSourceMgr())
-                .getExpansionLoc()
-                .getFileID());
-    }
-};
-
-class ProcessedSet {
-	public:
-		bool try_insert(const std::string& s) {
-			std::lock_guard lg(mutex_);
-			auto [_,suc] = processed_.insert(s);
-			return suc;
-		}
-		static ProcessedSet& get() {
-			static ProcessedSet inst;
-			return inst;
-		}
-	private:
-		std::mutex mutex_;
-    	std::set<std::string> processed_;
-};
-
-class BrowserAction : public clang::ASTFrontendAction
-{
-    //static std::set<std::string> processed;
-    DatabaseType WasInDatabase;
-
-protected:
-#if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR <= 5
-    virtual clang::ASTConsumer *
-#else
-    virtual std::unique_ptr<clang::ASTConsumer>
-#endif
-    CreateASTConsumer(clang::CompilerInstance &CI, llvm::StringRef InFile) override
-    {
-		SPDLOG_DEBUG("Start CreateASTConsumer for:{}", InFile.str());
-        //if (processed.count(InFile.str())) {
-        if(!ProcessedSet::get().try_insert(InFile.str())) {
-			SPDLOG_ERROR("Skipping already processed:{}", InFile.str());
-            std::cerr << "Skipping already processed " << InFile.str() << std::endl;
-            return nullptr;
-        }
-
-        CI.getFrontendOpts().SkipFunctionBodies = true;
-
-        return maybe_unique(new BrowserASTConsumer(CI, *projectManager, WasInDatabase));
-    }
-
-public:
-    BrowserAction(DatabaseType WasInDatabase = DatabaseType::InDatabase)
-        : WasInDatabase(WasInDatabase)
-    {
-		SPDLOG_DEBUG("BrowserAction constructor");
-    }
-    virtual bool hasCodeCompletionSupport() const override
-    {
-        return true;
-    }
-    static ProjectManager *projectManager;
-};
-
-
-//std::set<std::string> BrowserAction::processed;
-ProjectManager *BrowserAction::projectManager = nullptr;
-
-static bool proceedCommand(std::vector<std::string> command, llvm::StringRef Directory,
-                           llvm::StringRef file,  DatabaseType WasInDatabase)
-{
-	SPDLOG_DEBUG("Start proceedCommand with: command: {}, Directory: {}, file:{}, was in db:{}", command, Directory.data(), file.data(), (int)WasInDatabase);
-    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> VFS(
-        new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
-    clang::FileManager FM({ "." }, VFS);
-
-    FM.Retain();
-    // This code change all the paths to be absolute paths
-    //  FIXME:  it is a bit fragile.
-    bool previousIsDashI = false;
-    bool previousNeedsMacro = false;
-    bool hasNoStdInc = false;
-    for (std::string &A : command) {
-        if (previousIsDashI && !A.empty() && A[0] != '/') {
-            A = Directory % "/" % A;
-            previousIsDashI = false;
-            continue;
-        } else if (A == "-I") {
-            previousIsDashI = true;
-            continue;
-        } else if (A == "-nostdinc" || A == "-nostdinc++") {
-            hasNoStdInc = true;
-            continue;
-        } else if (A == "-U" || A == "-D") {
-            previousNeedsMacro = true;
-            continue;
-        }
-        if (previousNeedsMacro) {
-            previousNeedsMacro = false;
-            continue;
-        }
-        previousIsDashI = false;
-        if (A.empty())
-            continue;
-        if (llvm::StringRef(A).startswith("-I") && A[2] != '/') {
-            A = "-I" % Directory % "/" % llvm::StringRef(A).substr(2);
-            continue;
-        }
-        if (A[0] == '-' || A[0] == '/')
-            continue;
-        std::string PossiblePath = Directory % "/" % A;
-        if (llvm::sys::fs::exists(PossiblePath))
-            A = PossiblePath;
-    }
-
-#if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR < 6
-    auto Ajust = [&](clang::tooling::ArgumentsAdjuster &&aj) { command = aj.Adjust(command); };
-    Ajust(clang::tooling::ClangSyntaxOnlyAdjuster());
-    Ajust(clang::tooling::ClangStripOutputAdjuster());
-#elif CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR < 8
-    command = clang::tooling::getClangSyntaxOnlyAdjuster()(command);
-    command = clang::tooling::getClangStripOutputAdjuster()(command);
-#else
-    command = clang::tooling::getClangSyntaxOnlyAdjuster()(command, file);
-    command = clang::tooling::getClangStripOutputAdjuster()(command, file);
-#endif
-
-    if (!hasNoStdInc) {
-#ifndef _WIN32
-        command.push_back("-isystem");
-#else
-        command.push_back("-I");
-#endif
-
-        command.push_back("/builtins");
-    }
-
-    command.push_back("-Qunused-arguments");
-    command.push_back("-Wno-unknown-warning-option");
-	SPDLOG_DEBUG("Start proceedCommand with adjusted: command: {}", command);
-    clang::tooling::ToolInvocation Inv(command, maybe_unique(new BrowserAction(WasInDatabase)), &FM);
-
-#if CLANG_VERSION_MAJOR <= 10
-    if (!hasNoStdInc) {
-    	SPDLOG_DEBUG("hasNoStdInc, Map the builtins includes");
-        // Map the builtins includes
-        const EmbeddedFile *f = EmbeddedFiles;
-        while (f->filename) {
-            Inv.mapVirtualFile(f->filename, { f->content, f->size });
-            f++;
-        }
-    }
-#endif
-
-    bool result = Inv.run();
-    if (!result) {
-		SPDLOG_ERROR("Error: The file was not recognized as source code: : {}", file.str());
-        std::cerr << "Error: The file was not recognized as source code: " << file.str()
-                  << std::endl;
-    }
-    return result;
+    return content.size() + includes * 64 * 1024.;
 }
-#include "spdlog/sinks/basic_file_sink.h"
 
 int main(int argc, const char **argv)
 {
-	auto file_logger = spdlog::basic_logger_mt("codebrowser", "/tmp/codebrowserlog.txt");
-	file_logger->flush_on(spdlog::level::trace);
-	spdlog::set_default_logger(file_logger);
-	spdlog::set_pattern("%T[%t][file: %s][fun: %!][line: %#] %v");
-
-
-	spdlog::set_level(spdlog::level::trace);
-	//spdlog::flush_every(std::chrono::seconds(1));
-	SPDLOG_INFO("Start");
     std::string ErrorMessage;
     std::unique_ptr<clang::tooling::CompilationDatabase> Compilations(
         clang::tooling::FixedCompilationDatabase::loadFromCommandLine(argc, argv
@@ -420,8 +248,38 @@ int main(int argc, const char **argv)
     make_forward_slashes(OutputPath._Get_data()._Myptr());
 #endif
 
+    // The default log is not part of the published pages, and each process of MULTIPROCESS_MODE
+    // has its own, which is not merged
+    Logging logging;
+    create_directories(OutputPath + "/.logs");
+    if (!logging.setup(LogLevel,
+                       LogFile.empty()
+                           ? OutputPath + "/.logs/codebrowser.log" + getFileIndexSuffix()
+                           : LogFile))
+        return EXIT_FAILURE;
+	SPDLOG_INFO("Start");
+
+    // The refs files are appended to, and codebrowser_merge --pack moved them
+    if (llvm::sys::fs::exists(OutputPath + "/refs/_pack/meta")) {
+        std::cerr << "The refs of " << OutputPath << " are packed, run codebrowser_merge "
+                  << OutputPath << " --unpack first" << std::endl;
+        return EXIT_FAILURE;
+    }
     ProjectManager projectManager(OutputPath, DataPath);
-	ThreadPool thread_pool;
+    // Read before it is overwritten, to estimate how long each translation unit takes. Any
+    // process of MULTIPROCESS_MODE may get any translation unit: they read the stats merged by
+    // codebrowser_merge, then what their own process of a previous run left unmerged.
+    auto previousStats = Stats::readPrevious(OutputPath + "/stats.jsonl");
+    if (!getFileIndexSuffix().empty()) {
+        for (auto &it : Stats::readPrevious(OutputPath + "/stats.jsonl" + getFileIndexSuffix()))
+            previousStats[it.first] = it.second;
+    }
+    if (CollectStats) {
+        if (!Stats::open(OutputPath + "/stats.jsonl" + getFileIndexSuffix()))
+            return EXIT_FAILURE;
+    }
+    Scheduler scheduler(Jobs);
+    scheduler.setMemoryBudget(uint64_t(MemoryBudget) * 1024 * 1024);
     for (std::string &s : ProjectPaths) {
     	SPDLOG_DEBUG("Try one project path:{}", s);
         auto colonPos = s.find(':');
@@ -459,6 +317,7 @@ int main(int argc, const char **argv)
         }
     }
     BrowserAction::projectManager = &projectManager;
+    BrowserAction::reuseTokens = ReuseTokens;
 
 
     if (!Compilations && llvm::sys::fs::exists(BuildPath)) {
@@ -540,7 +399,28 @@ int main(int argc, const char **argv)
 #endif
     }
 
-    if (Sources.empty()) {
+    std::vector<std::string> FillInSources;
+    if (!FillIn.empty()) {
+        if (!Sources.empty() || ServerMode || !Shard.empty() || IncrementalMode) {
+            std::cerr << "--fill-in takes the source files from its file, it cannot be combined "
+                         "with sources, '-a', --server, --shard or --incremental"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!projectManager.setFillIn(FillIn, FillInSources)) {
+            std::cerr << "Cannot read the missing files from " << FillIn << std::endl;
+            return EXIT_FAILURE;
+        }
+        Sources = FillInSources;
+    }
+
+    if (ServerMode && !Sources.empty()) {
+        std::cerr << "--server reads the source files from stdin, they cannot be passed as "
+                     "arguments or with '-a'"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (Sources.empty() && !ServerMode) {
         std::cerr << "No source files.  Please pass source files as argument, or use '-a'"
                   << std::endl;
         return EXIT_FAILURE;
@@ -551,6 +431,160 @@ int main(int argc, const char **argv)
         return EXIT_FAILURE;
     }
 
+    // Before the incremental state, which depends on it
+    for (const std::string &pass : DisabledPasses) {
+        if (!AnnotationPipeline::disable(pass)) {
+            std::cerr << "Unknown pass " << pass << " for --disable-pass, the passes are:";
+            for (const auto &registration : AnnotationPipeline::registered())
+                std::cerr << "\n  " << registration.name << ": " << registration.description;
+            std::cerr << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    Generator::pageLines = PageLines;
+    std::unique_ptr<Incremental> incremental;
+    if (IncrementalMode) {
+        if (!getFileIndexSuffix().empty()) {
+            std::cerr << "--incremental cannot be used with MULTIPROCESS_MODE" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (CompressOutput) {
+            std::cerr << "--incremental cannot be used with --compress" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (ServerMode) {
+            std::cerr << "--incremental cannot be used with --server" << std::endl;
+            return EXIT_FAILURE;
+        }
+        // Incremental rewrites the pages and the shared files in place
+        if (CasMode || ObjectStore::detect(OutputPath)) {
+            std::cerr << "--incremental cannot be used with --cas, or in an output directory "
+                         "generated with --cas"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        incremental = std::make_unique<Incremental>(projectManager);
+        incremental->load();
+        BrowserAction::incremental = incremental.get();
+    }
+    Compression::enabled = CompressOutput;
+    if (CasMode) {
+        if (CasLink != "hard" && CasLink != "symbolic") {
+            std::cerr << "--cas-link must be hard or symbolic" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!ObjectStore::setup(OutputPath, CasStore, CasLink == "symbolic"))
+            return EXIT_FAILURE;
+    } else {
+        ObjectStore::detect(OutputPath);
+    }
+#if CLANG_VERSION_MAJOR < 9
+    if (ReuseTokens) {
+        std::cerr << "--reuse-tokens requires clang 9 or later" << std::endl;
+        return EXIT_FAILURE;
+    }
+#endif
+    if (!Shard.empty()) {
+        auto parts = llvm::StringRef(Shard).split('/');
+        unsigned int index, count;
+        if (parts.first.getAsInteger(10, index) || parts.second.getAsInteger(10, count)
+            || count == 0 || index >= count) {
+            std::cerr << "Invalid --shard " << Shard << ", expected i/N with 0 <= i < N"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (incremental) {
+            std::cerr << "--incremental cannot be used with --shard" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!projectManager.setShard(index, count)) {
+            std::cerr << "Cannot write the segment file in " << OutputPath << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::unique_ptr<PreambleCache> preambles;
+    if (SharePreamble)
+        preambles = std::make_unique<PreambleCache>();
+
+    struct TranslationUnit
+    {
+        std::vector<std::string> command;
+        std::string directory;
+        std::string file;
+        DatabaseType type;
+        uint64_t commandHash;
+        double cost = 0; // set once they are all collected
+        uint64_t memory = 0; // expected memory use, 0 if unknown
+    };
+    std::atomic<unsigned int> failures { 0 };
+    // Schedules the translation units, in groups sharing a preamble with --preamble
+    auto process = [&](const std::vector<const TranslationUnit *> &units) {
+        std::map<std::string, std::vector<const TranslationUnit *>> groups;
+        for (const TranslationUnit *tu : units) {
+            std::string key;
+            if (preambles && tu->type != DatabaseType::NotInDatabase) {
+                auto command = tu->command;
+                adjustCommand(command, tu->directory, tu->file);
+                key = preambles->groupKey(command, tu->file);
+            }
+            if (key.empty()) {
+                scheduler.schedule(tu->cost, tu->file, [&scheduler, &failures, tu] {
+                    auto admission = scheduler.admit(tu->memory);
+                    if (!proceedCommand(tu->command, tu->directory, tu->file, tu->type,
+                                        tu->commandHash))
+                        ++failures;
+                });
+            } else {
+                groups[key].push_back(tu);
+            }
+        }
+        // The first of each group builds the PCH after being processed. They are all dispatched
+        // before the others, which wait for the PCH, so the waiting never blocks the leaders.
+        std::vector<std::pair<const TranslationUnit *, std::shared_future<std::string>>> followers;
+        for (auto &group : groups) {
+            const TranslationUnit *leader = group.second.front();
+            auto pch = std::make_shared<std::promise<std::string>>();
+            std::shared_future<std::string> future = pch->get_future().share();
+            bool needed = group.second.size() > 1;
+            auto leaderTask = [&scheduler, &preambles, &failures, leader, pch, needed,
+                               key = group.first] {
+                auto admission = scheduler.admit(leader->memory);
+                if (!proceedCommand(leader->command, leader->directory, leader->file, leader->type,
+                                    leader->commandHash))
+                    ++failures;
+                std::string path;
+                if (needed) {
+                    auto command = leader->command;
+                    bool hasNoStdInc = adjustCommand(command, leader->directory, leader->file);
+                    path = preambles->build(key, leader->file, std::move(command),
+                                            [&](std::vector<std::string> command,
+                                                clang::FrontendAction *action) {
+                                                return runInvocation(std::move(command), action,
+                                                                     hasNoStdInc);
+                                            });
+                }
+                pch->set_value(path);
+            };
+            scheduler.schedule(leader->cost, leader->file, std::move(leaderTask));
+            for (std::size_t i = 1; i < group.second.size(); ++i)
+                followers.emplace_back(group.second[i], future);
+        }
+        scheduler.dispatch();
+        for (auto &follower : followers) {
+            const TranslationUnit *tu = follower.first;
+            scheduler.schedule(tu->cost, tu->file,
+                               [&scheduler, &failures, tu, pch = follower.second] {
+                // Not admitted while waiting, the leader might need the memory
+                std::string path = pch.get();
+                auto admission = scheduler.admit(tu->memory);
+                if (!proceedCommand(tu->command, tu->directory, tu->file, tu->type, tu->commandHash,
+                                    path))
+                    ++failures;
+            });
+        }
+        scheduler.dispatch();
+    };
 #if CLANG_VERSION_MAJOR >= 12
     llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> VFS(
         new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
@@ -575,173 +609,279 @@ int main(int argc, const char **argv)
     }
 #endif
 
-    int Progress = 0;
+    // Processes the sources, once they are all scheduled. Returns the number of files generated
+    // for them: 0 if they were skipped.
+    auto run = [&](llvm::ArrayRef<std::string> Sources) -> std::size_t {
+        // They are all collected first, so the most expensive ones can be started first
+        std::deque<TranslationUnit> translationUnits;
+        auto schedule = [&](TranslationUnit tu) { translationUnits.push_back(std::move(tu)); };
+        std::size_t otherFiles = 0; // generated without a translation unit
 
-    std::vector<std::string> NotInDB;
+        std::vector<std::string> NotInDB;
 
-    for (const auto &it : Sources) {
-		SPDLOG_DEBUG("Prepare work for source: {}", it);
-        std::string file = clang::tooling::getAbsolutePath(it);
-		SPDLOG_DEBUG("Absolute file path: {}", file);
-        Progress++;
-
-        if (it.empty() || it == "-")
-            continue;
+        for (const auto &it : Sources) {
+			SPDLOG_DEBUG("Prepare work for source: {}", it);
+            std::string file = clang::tooling::getAbsolutePath(it);
+			SPDLOG_DEBUG("Absolute file path: {}", file);
 
-        llvm::SmallString<256> filename;
-        canonicalize(file, filename);
+            if (it.empty() || it == "-")
+                continue;
 
-        if (auto project = projectManager.projectForFile(filename)) {
-			SPDLOG_DEBUG("The project for file: {}, {}", filename.c_str(), project->name);
-            if (!projectManager.shouldProcess0(filename, project)) {
-				SPDLOG_ERROR("Sources: Skipping already processed : {}", filename.c_str());
-                std::cerr << "Sources: Skipping already processed " << filename.c_str()
-                          << std::endl;
+            llvm::SmallString<256> filename;
+            canonicalize(file, filename);
+
+            if (auto project = projectManager.projectForFile(filename)) {
+				SPDLOG_DEBUG("The project for file: {}, {}", filename.c_str(), project->name);
+                if (!projectManager.shouldProcess0(filename, project)) {
+					SPDLOG_ERROR("Sources: Skipping already processed : {}", filename.c_str());
+                    std::cerr << "Sources: Skipping already processed " << filename.c_str()
+                              << std::endl;
+                    continue;
+                }
+                if (!projectManager.isInShard(filename, project)) {
+					SPDLOG_DEBUG("Sources: Skipping file of another shard : {}", filename.c_str());
+                    continue;
+                }
+            } else {
+				SPDLOG_ERROR("Sources: Skipping file not included by any project : {}", filename.c_str());
+                std::cerr << "Sources: Skipping file not included by any project "
+                          << filename.c_str() << std::endl;
                 continue;
             }
-        } else {
-			SPDLOG_ERROR("Sources: Skipping file not included by any project : {}", filename.c_str());
-            std::cerr << "Sources: Skipping file not included by any project " << filename.c_str()
-                      << std::endl;
-            continue;
-        }
 
-        bool isHeader = llvm::StringSwitch<bool>(llvm::sys::path::extension(filename))
-                            .Cases(".h", ".H", ".hh", ".hpp", true)
-                            .Default(false);
-
-		SPDLOG_DEBUG("File is header: {}, {}", filename.c_str(), isHeader);
-        auto compileCommandsForFile = Compilations->getCompileCommands(file);
-        if (!compileCommandsForFile.empty() && !isHeader) {
-			SPDLOG_DEBUG("compileCommandsForFile: {}", compileCommandsForFile.front().CommandLine);
-            std::cerr << '[' << (100 * Progress / Sources.size()) << "%] Processing " << file
-                      << "\n";
-            auto command = compileCommandsForFile.front().CommandLine;
-            auto dir = compileCommandsForFile.front().Directory;
-            auto tp = IsProcessingAllDirectory ? DatabaseType::ProcessFullDirectory
-                                                    : DatabaseType::InDatabase;
-			thread_pool.Schedule([command = std::move(command), dir = std::move(dir), file=std::move(file), tp=tp](){
-					proceedCommand(std::move(command), dir, file, tp);
-                    		});
-
-        } else {
-			SPDLOG_DEBUG("Add delayed file to queue: {}", filename.c_str());
-            // TODO: Try to find a command line for a file in the same path
-            std::cerr << "Delayed " << file << "\n";
-            Progress--;
-            NotInDB.push_back(std::string(filename.str()));
-            continue;
+            bool isHeader = llvm::StringSwitch<bool>(llvm::sys::path::extension(filename))
+                                .Cases(".h", ".H", ".hh", ".hpp", true)
+                                .Default(false);
+
+			SPDLOG_DEBUG("File is header: {}, {}", filename.c_str(), isHeader);
+            auto compileCommandsForFile = Compilations->getCompileCommands(file);
+            if (!compileCommandsForFile.empty() && !isHeader) {
+				SPDLOG_DEBUG("compileCommandsForFile: {}", compileCommandsForFile.front().CommandLine);
+                auto command = compileCommandsForFile.front().CommandLine;
+                auto dir = compileCommandsForFile.front().Directory;
+                auto tp = IsProcessingAllDirectory ? DatabaseType::ProcessFullDirectory
+                                                        : DatabaseType::InDatabase;
+                uint64_t hash = incremental ? incremental->commandHash(command, dir) : 0;
+                schedule({ std::move(command), std::move(dir), std::move(file), tp, hash });
+
+            } else {
+				SPDLOG_DEBUG("Add delayed file to queue: {}", filename.c_str());
+                // TODO: Try to find a command line for a file in the same path
+                std::cerr << "Delayed " << file << "\n";
+                NotInDB.push_back(std::string(filename.str()));
+                continue;
+            }
         }
-    }
 
-	SPDLOG_DEBUG("Delayed queue: {}", NotInDB);
-    for (const auto &it : NotInDB) {
-		SPDLOG_DEBUG("Start to process delay file from queue: {}", it);
-        std::string file = clang::tooling::getAbsolutePath(it);
-		SPDLOG_DEBUG("Absolute file path: {}", file);
-        Progress++;
-
-        if (auto project = projectManager.projectForFile(file)) {
-			SPDLOG_DEBUG("The project for file: {}, {}", file.c_str(), project->name);
-            if (!projectManager.shouldProcess(file, project)) {
-				SPDLOG_ERROR("NotInDB: Skipping already processed : {}", file.c_str());
-                std::cerr << "NotInDB: Skipping already processed " << file.c_str() << std::endl;
+		SPDLOG_DEBUG("Delayed queue: {}", NotInDB);
+        for (const auto &it : NotInDB) {
+			SPDLOG_DEBUG("Start to process delay file from queue: {}", it);
+            std::string file = clang::tooling::getAbsolutePath(it);
+			SPDLOG_DEBUG("Absolute file path: {}", file);
+
+            if (auto project = projectManager.projectForFile(file)) {
+				SPDLOG_DEBUG("The project for file: {}, {}", file.c_str(), project->name);
+                if (!projectManager.shouldProcess(file, project)) {
+					SPDLOG_ERROR("NotInDB: Skipping already processed : {}", file.c_str());
+                    std::cerr << "NotInDB: Skipping already processed " << file.c_str()
+                              << std::endl;
+                    continue;
+                }
+            } else {
+				SPDLOG_ERROR("NotInDB: Skipping file not included by any project", file.c_str());
+                std::cerr << "NotInDB: Skipping file not included by any project " << file.c_str()
+                          << std::endl;
                 continue;
             }
-        } else {
-			SPDLOG_ERROR("NotInDB: Skipping file not included by any project", file.c_str());
-            std::cerr << "NotInDB: Skipping file not included by any project " << file.c_str()
-                      << std::endl;
-            continue;
-        }
 
-        llvm::StringRef similar;
+            llvm::StringRef similar;
 
-        auto compileCommandsForFile = Compilations->getCompileCommands(file);
-        std::string fileForCommands = file;
-        if (compileCommandsForFile.empty()) {
-			SPDLOG_ERROR("NotInDB: compileCommandsForFile is empty:{}", file.c_str());
+            auto compileCommandsForFile = Compilations->getCompileCommands(file);
+            std::string fileForCommands = file;
+            if (compileCommandsForFile.empty()) {
+				SPDLOG_ERROR("NotInDB: compileCommandsForFile is empty:{}", file.c_str());
  
-            // Find the element with the bigger prefix
-            auto lower = std::lower_bound(AllFiles.cbegin(), AllFiles.cend(), file);
-            if (lower == AllFiles.cend())
-                lower = AllFiles.cbegin();
-            compileCommandsForFile = Compilations->getCompileCommands(*lower);
-            fileForCommands = *lower;
-        }
-
-        bool success = false;
-        if (!compileCommandsForFile.empty()) {
-            std::cerr << '[' << (100 * Progress / Sources.size()) << "%] Processing " << file
-                      << "\n";
-            auto command = compileCommandsForFile.front().CommandLine;
-			SPDLOG_ERROR("NotInDB: final compileCommandsForFile: {}", command);
-            std::replace(command.begin(), command.end(), fileForCommands, it);
-			SPDLOG_ERROR("NotInDB: final after replace compileCommandsForFile: {}", command);
-            if (llvm::StringRef(file).endswith(".qdoc")) {
-                command.insert(command.begin() + 1, "-xc++");
-                // include the header for this .qdoc file
-                command.push_back("-include");
-                command.push_back(llvm::StringRef(file).substr(0, file.size() - 5) % ".h");
+                // Find the element with the bigger prefix
+                auto lower = std::lower_bound(AllFiles.cbegin(), AllFiles.cend(), file);
+                if (lower == AllFiles.cend())
+                    lower = AllFiles.cbegin();
+                compileCommandsForFile = Compilations->getCompileCommands(*lower);
+                fileForCommands = *lower;
             }
-			
-			SPDLOG_ERROR("NotInDB: final after pushbacks compileCommandsForFile", command);
-
-			auto dir = compileCommandsForFile.front().Directory;
-			auto tp = IsProcessingAllDirectory ? DatabaseType::ProcessFullDirectory
-                                                              : DatabaseType::NotInDatabase;
-            thread_pool.Schedule([command = std::move(command), dir = std::move(dir), file=std::move(file), tp=tp](){proceedCommand(std::move(command), dir,
-                                     file, tp);
-                    });
-        } else {
-            std::cerr << "Could not find commands for " << file << "\n";
-        }
 
-		SPDLOG_DEBUG("Normal process done");
-        if (!success && !IsProcessingAllDirectory) {
-            std::cerr << "Run into !success && !IsProcessingAllDirectory" << "\n";
-            ProjectInfo *projectinfo = projectManager.projectForFile(file);
-            if (!projectinfo)
-                continue;
-            if (!projectManager.shouldProcess(file, projectinfo))
-                continue;
-
-            auto now = std::time(0);
-            auto tm = localtime(&now);
-            char buf[80];
-            std::strftime(buf, sizeof(buf), "%Y-%b-%d", tm);
+            bool success = false;
+            if (!compileCommandsForFile.empty()) {
+                auto command = compileCommandsForFile.front().CommandLine;
+				SPDLOG_ERROR("NotInDB: final compileCommandsForFile: {}", command);
+                std::replace(command.begin(), command.end(), fileForCommands, it);
+				SPDLOG_ERROR("NotInDB: final after replace compileCommandsForFile: {}", command);
+                if (llvm::StringRef(file).endswith(".qdoc")) {
+                    command.insert(command.begin() + 1, "-xc++");
+                    // include the header for this .qdoc file
+                    command.push_back("-include");
+                    command.push_back(llvm::StringRef(file).substr(0, file.size() - 5) % ".h");
+                }
+			
+				SPDLOG_ERROR("NotInDB: final after pushbacks compileCommandsForFile", command);
+
+				auto dir = compileCommandsForFile.front().Directory;
+				auto tp = IsProcessingAllDirectory ? DatabaseType::ProcessFullDirectory
+                                                                  : DatabaseType::NotInDatabase;
+                uint64_t hash = incremental ? incremental->commandHash(command, dir) : 0;
+                schedule({ std::move(command), std::move(dir), file, tp, hash });
+            } else {
+                std::cerr << "Could not find commands for " << file << "\n";
+            }
 
-            std::string footer = "Generated on <em>" % std::string(buf) % "</em>" % " from project "
-                % projectinfo->name % "</a>";
-            if (!projectinfo->revision.empty())
-                footer %= " revision <em>" % projectinfo->revision % "</em>";
+			SPDLOG_DEBUG("Normal process done");
+            if (!success && !IsProcessingAllDirectory) {
+                std::cerr << "Run into !success && !IsProcessingAllDirectory" << "\n";
+                ProjectInfo *projectinfo = projectManager.projectForFile(file);
+                if (!projectinfo)
+                    continue;
+                if (!projectManager.shouldProcess(file, projectinfo))
+                    continue;
+
+                auto now = std::time(0);
+                auto tm = localtime(&now);
+                char buf[80];
+                std::strftime(buf, sizeof(buf), "%Y-%b-%d", tm);
+
+                std::string footer = "Generated on <em>" % std::string(buf) % "</em>"
+                    % " from project " % projectinfo->name % "</a>";
+                if (!projectinfo->revision.empty())
+                    footer %= " revision <em>" % projectinfo->revision % "</em>";
 
 #if CLANG_VERSION_MAJOR == 3 && CLANG_VERSION_MINOR <= 4
-            llvm::OwningPtr<llvm::MemoryBuffer> Buf;
-            if (!llvm::MemoryBuffer::getFile(file, Buf))
-                continue;
+                llvm::OwningPtr<llvm::MemoryBuffer> Buf;
+                if (!llvm::MemoryBuffer::getFile(file, Buf))
+                    continue;
 #else
-            auto B = llvm::MemoryBuffer::getFile(file);
-            if (!B)
-                continue;
-            std::unique_ptr<llvm::MemoryBuffer> Buf = std::move(B.get());
+                auto B = llvm::MemoryBuffer::getFile(file);
+                if (!B)
+                    continue;
+                std::unique_ptr<llvm::MemoryBuffer> Buf = std::move(B.get());
 #endif
 
-            std::string fn = projectinfo->name % "/"
-                % llvm::StringRef(file).substr(projectinfo->source_path.size());
-
-            Generator g;
-            g.generate(projectManager.outputPrefix, projectManager.dataPath, fn,
-                       Buf->getBufferStart(), Buf->getBufferEnd(), footer,
-                       "Warning: This file is not a C or C++ file. It does not have highlighting.",
-                       std::set<std::string>());
-
-            std::ofstream fileIndex;
-            fileIndex.open(projectManager.outputPrefix + "/otherIndex", std::ios::app);
-            if (!fileIndex)
+                std::string fn = projectinfo->name % "/"
+                    % llvm::StringRef(file).substr(projectinfo->source_path.size());
+
+                Generator g;
+                g.generate(projectManager.outputPrefix, projectManager.dataPath, fn,
+                           Buf->getBufferStart(), Buf->getBufferEnd(), footer,
+                           "Warning: This file is not a C or C++ file. It does not have "
+                           "highlighting.",
+                           std::set<std::string>());
+                ++otherFiles;
+
+                std::ofstream fileIndex;
+                fileIndex.open(projectManager.outputPrefix + "/otherIndex", std::ios::app);
+                if (!fileIndex)
+                    continue;
+                fileIndex << fn << '\n';
+            }
+        }
+        // The time they took in the previous run is the best estimate. Otherwise, estimate from the
+        // file, scaled to the same unit as the measured ones. Only the order matters.
+        // Likewise for the memory they use, with --memory-budget.
+        {
+            double measured = 0, estimated = 0;
+            uint64_t knownMemory = 0;
+            std::size_t knownMemoryCount = 0;
+            for (auto &tu : translationUnits) {
+                tu.cost = estimateCost(tu.file);
+                auto it = previousStats.find(tu.file);
+                if (it != previousStats.end() && it->second.totalMs > 0) {
+                    measured += it->second.totalMs;
+                    estimated += tu.cost;
+                }
+            }
+            for (auto &tu : translationUnits) {
+                auto it = previousStats.find(tu.file);
+                if (it == previousStats.end())
+                    continue;
+                if (measured > 0 && it->second.totalMs > 0)
+                    tu.cost = it->second.totalMs * estimated / measured;
+                // Sema, the annotator and the allocator overhead are not in memory_bytes: they
+                // roughly take as much again
+                tu.memory = it->second.memoryBytes * 2;
+                if (tu.memory) {
+                    knownMemory += tu.memory;
+                    ++knownMemoryCount;
+                }
+            }
+            // The new ones are expected to be like the average
+            if (knownMemoryCount) {
+                for (auto &tu : translationUnits) {
+                    if (!tu.memory)
+                        tu.memory = knownMemory / knownMemoryCount;
+                }
+            }
+        }
+        if (incremental) {
+            std::map<std::string, const TranslationUnit *> upToDate;
+            std::vector<const TranslationUnit *> outdated;
+            for (const auto &tu : translationUnits) {
+                if (incremental->isUpToDate(tu.file, tu.commandHash))
+                    upToDate.emplace(tu.file, &tu);
+                else
+                    outdated.push_back(&tu);
+            }
+            std::cerr << upToDate.size() << " translation units are up to date, processing "
+                      << outdated.size() << std::endl;
+            incremental->claimUnchanged();
+            process(outdated);
+            scheduler.wait();
+
+            std::vector<const TranslationUnit *> again;
+            for (const auto &file : incremental->reprocessForOrphans()) {
+                std::cerr << "Processing again " << file << " for the headers it includes"
+                          << std::endl;
+                again.push_back(upToDate.at(file));
+            }
+            process(again);
+        } else {
+            std::vector<const TranslationUnit *> all;
+            for (const auto &tu : translationUnits)
+                all.push_back(&tu);
+            process(all);
+        }
+        // Wait for all the translation units
+        scheduler.wait();
+        return translationUnits.size() + otherFiles;
+    };
+
+    if (ServerMode) {
+        // One source file per line on stdin, answered on stdout once it is processed with
+        // "done <file>", "failed <file>", or "skipped <file>" if it was not generated (already
+        // generated, or not part of any project). The refs and the file index of a file are
+        // written before it is answered, so a file reported done survives a later crash.
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            if (line.empty())
                 continue;
-            fileIndex << fn << '\n';
+            unsigned int failedBefore = failures;
+            std::size_t generated = run(std::vector<std::string> { line });
+            bool written = projectManager.writePending();
+            if (!written)
+                std::cerr << "Error while writing the references of " << line << std::endl;
+            const char *status = !generated              ? "skipped"
+                : failures != failedBefore || !written ? "failed"
+                                                       : "done";
+            std::cout << status << ' ' << line << std::endl;
         }
+    } else {
+        run(Sources);
+    }
+
+    // Make sure everything is written
+    if (!projectManager.flush()) {
+        std::cerr << "Error while writing the references" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (incremental && !incremental->finish()) {
+        std::cerr << "Error while updating the incremental state" << std::endl;
+        return EXIT_FAILURE;
     }
 	SPDLOG_DEBUG("All process done");
 }
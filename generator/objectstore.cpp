@@ -0,0 +1,224 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "objectstore.h"
+#include "filesystem.h"
+#include "stringbuilder.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+std::string ObjectStore::store;
+bool ObjectStore::symbolic = false;
+bool ObjectStore::linked = false;
+
+static const char markerName[] = "/.cas";
+
+bool ObjectStore::setup(const std::string &outputPrefix, const std::string &storePath,
+                        bool symbolicLinks)
+{
+    llvm::SmallString<256> path(storePath.empty() ? outputPrefix + "/.objects" : storePath);
+    if (auto e = create_directories(path)) {
+        SPDLOG_ERROR("Cannot create the object store {}: {}", path.str(), e.message());
+        std::cerr << "Error creating the object store " << path.c_str() << ": " << e.message()
+                  << std::endl;
+        return false;
+    }
+    llvm::sys::fs::make_absolute(path);
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+    std::error_code ec;
+    llvm::raw_fd_ostream marker(outputPrefix + markerName, ec, llvm::sys::fs::OF_None);
+    if (!ec)
+        marker << path << '\n';
+    marker.close();
+    if (ec || marker.has_error()) {
+        SPDLOG_ERROR("Cannot write {}{}", outputPrefix, markerName);
+        std::cerr << "Error writing " << outputPrefix << markerName << std::endl;
+        marker.clear_error();
+        return false;
+    }
+    store = path.str().str();
+    symbolic = symbolicLinks;
+    linked = true;
+    return true;
+}
+
+bool ObjectStore::detect(const std::string &outputPrefix)
+{
+    if (llvm::sys::fs::exists(outputPrefix + markerName))
+        linked = true;
+    return linked;
+}
+
+// Writes the file next to path and renames it over path: what linked to the previous one
+// is left untouched.
+static bool replaceFile(const std::string &path, llvm::StringRef content)
+{
+    llvm::SmallString<256> tmp;
+    int fd;
+    if (auto e = llvm::sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tmp)) {
+        SPDLOG_ERROR("Cannot create a temporary file for {}: {}", path, e.message());
+        std::cerr << "Error creating a temporary file for " << path << ": " << e.message()
+                  << std::endl;
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+        os << content;
+        os.close();
+        if (os.has_error()) {
+            SPDLOG_ERROR("Cannot write {}: {}", tmp.str(), os.error().message());
+            std::cerr << "Error writing " << tmp.c_str() << ": " << os.error().message()
+                      << std::endl;
+            os.clear_error();
+            llvm::sys::fs::remove(tmp);
+            return false;
+        }
+    }
+    if (auto e = llvm::sys::fs::rename(tmp, path)) {
+        SPDLOG_ERROR("Cannot rename {} to {}: {}", tmp.str(), path, e.message());
+        std::cerr << "Error renaming " << tmp.c_str() << " to " << path << ": " << e.message()
+                  << std::endl;
+        llvm::sys::fs::remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+// The path of to relative to the directory from, both absolute
+static std::string relativePath(llvm::StringRef from, llvm::StringRef to)
+{
+    auto fromIt = llvm::sys::path::begin(from), fromEnd = llvm::sys::path::end(from);
+    auto toIt = llvm::sys::path::begin(to), toEnd = llvm::sys::path::end(to);
+    while (fromIt != fromEnd && toIt != toEnd && *fromIt == *toIt) {
+        ++fromIt;
+        ++toIt;
+    }
+    llvm::SmallString<256> result;
+    for (; fromIt != fromEnd; ++fromIt)
+        llvm::sys::path::append(result, "..");
+    for (; toIt != toEnd; ++toIt)
+        llvm::sys::path::append(result, *toIt);
+    return result.str().str();
+}
+
+bool ObjectStore::write(const std::string &path, llvm::StringRef content)
+{
+    llvm::SHA1 sha1;
+    sha1.update(content);
+    std::string hash = llvm::toHex(sha1.final(), /*LowerCase=*/true);
+    std::string dir = store % "/" % llvm::StringRef(hash).take_front(2);
+    std::string object = dir % "/" % llvm::StringRef(hash).drop_front(2);
+
+    if (!llvm::sys::fs::exists(object)) {
+        // Written once complete, so an object which exists is always whole: concurrent
+        // writers of the same object rename the same content
+        create_directories(dir);
+        if (!replaceFile(object, content))
+            return false;
+    } else {
+        // Unchanged since the previous run which linked it
+        bool same = false;
+        if (!llvm::sys::fs::equivalent(path, object, same) && same)
+            return true;
+    }
+
+    llvm::SmallString<256> tmp;
+    llvm::sys::fs::createUniquePath(path + "-%%%%%%.tmp", tmp, /*MakeAbsolute=*/false);
+    std::error_code e;
+    if (symbolic) {
+        llvm::SmallString<256> absolute(llvm::sys::path::parent_path(path));
+        llvm::sys::fs::make_absolute(absolute);
+        llvm::sys::path::remove_dots(absolute, /*remove_dot_dot=*/true);
+        e = llvm::sys::fs::create_link(relativePath(absolute, object), tmp);
+    } else {
+        e = llvm::sys::fs::create_hard_link(object, tmp);
+    }
+    if (!e)
+        e = llvm::sys::fs::rename(tmp, path);
+    if (e) {
+        // Too many links to the object, or another file system: a copy of its own
+        SPDLOG_DEBUG("Cannot link {} to {}: {}", path, object, e.message());
+        llvm::sys::fs::remove(tmp);
+        return replaceFile(path, content);
+    }
+    return true;
+}
+
+bool ObjectStore::ingest(const std::string &path)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        SPDLOG_ERROR("Cannot read {}: {}", path, buffer.getError().message());
+        std::cerr << "Error reading " << path << ": " << buffer.getError().message() << std::endl;
+        return false;
+    }
+    return write(path, buffer.get()->getBuffer());
+}
+
+bool ObjectStore::detach(const std::string &path)
+{
+    llvm::sys::fs::file_status status;
+    if (llvm::sys::fs::status(path, status, /*follow=*/false))
+        return true; // not there yet
+    if (status.type() != llvm::sys::fs::file_type::symlink_file && status.getLinkCount() <= 1)
+        return true;
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        SPDLOG_ERROR("Cannot read {}: {}", path, buffer.getError().message());
+        std::cerr << "Error reading " << path << ": " << buffer.getError().message() << std::endl;
+        return false;
+    }
+    return replaceFile(path, buffer.get()->getBuffer());
+}
+
+bool ObjectStore::ingestAll(const std::vector<std::string> &paths)
+{
+    std::atomic<std::size_t> next { 0 };
+    std::atomic<bool> ok { true };
+    auto work = [&] {
+        for (std::size_t i; (i = next++) < paths.size();) {
+            if (!ingest(paths[i]))
+                ok = false;
+        }
+    };
+    std::vector<std::thread> threads;
+    unsigned int count = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1u),
+                                               paths.size() / 64 + 1);
+    for (unsigned int i = 1; i < count; ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto &t : threads)
+        t.join();
+    return ok;
+}
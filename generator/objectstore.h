@@ -0,0 +1,71 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * --cas: the pages, and the refs once they are all written, go to a content-addressed object
+ * store (<output>/.objects unless --cas-store), and their path in the output is a hard or
+ * symbolic link to the object with the same content. A file whose object already exists is not
+ * written again, so the output directories of revisions sharing a store only take the space of
+ * the files which changed between them.
+ *
+ * The objects are shared: the files linked to them must never be written in place. The files
+ * are replaced by a copy of their own before being appended to (detach()), in the later runs
+ * in the same output directory too, even without --cas: a marker file (.cas) records that the
+ * directory has links.
+ */
+class ObjectStore
+{
+public:
+    // Enables the store for the output prefix. Returns false on error.
+    static bool setup(const std::string &outputPrefix, const std::string &storePath,
+                      bool symbolic);
+    // Looks for the marker of a previous --cas run in the output prefix, to detach the files
+    // from then on. Returns true if there is one.
+    static bool detect(const std::string &outputPrefix);
+
+    static bool enabled() { return !store.empty(); }
+    static bool hasLinks() { return linked; } // enabled(), or detect()ed
+
+    /**
+     * Makes path a link to the object with that content, writing the object if it is not
+     * there. Falls back to writing a plain file if it cannot be linked. Returns false on error.
+     */
+    static bool write(const std::string &path, llvm::StringRef content);
+    // Moves a file which was written in place to the store
+    static bool ingest(const std::string &path);
+    // To be called before writing in place to a file which might be linked to an object:
+    // replaces it by a copy of its own. Returns false on error.
+    static bool detach(const std::string &path);
+    // Ingests the files, in parallel. Returns false if one failed.
+    static bool ingestAll(const std::vector<std::string> &paths);
+
+private:
+    static std::string store; // absolute, empty if disabled
+    static bool symbolic;
+    static bool linked;
+};
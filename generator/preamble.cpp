@@ -0,0 +1,239 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "preamble.h"
+#include "compat.h"
+#include "stringbuilder.h"
+
+#include <clang/Basic/SourceManager.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "spdlog/spdlog.h"
+
+static llvm::StringRef preambleOf(llvm::StringRef content)
+{
+    clang::LangOptions lo;
+    lo.CPlusPlus = true;
+#if CLANG_VERSION_MAJOR >= 6
+    return content.substr(0, clang::Lexer::ComputePreamble(content, lo).Size);
+#else
+    return content.substr(0, clang::Lexer::ComputePreamble(content, lo).first);
+#endif
+}
+
+// Whether the argument is the source file (and thus differs in each command of a group)
+static bool isInputArgument(llvm::StringRef arg, llvm::StringRef file)
+{
+    return !arg.empty() && arg[0] != '-'
+        && llvm::sys::path::filename(arg) == llvm::sys::path::filename(file);
+}
+
+// Collects the files included directly by the main file
+struct DirectIncludes : clang::PPCallbacks
+{
+    clang::SourceManager &sm;
+    std::vector<clang::FileID> &files;
+    DirectIncludes(clang::SourceManager &sm, std::vector<clang::FileID> &files)
+        : sm(sm)
+        , files(files)
+    {
+    }
+    void FileChanged(clang::SourceLocation loc, FileChangeReason reason,
+                     clang::SrcMgr::CharacteristicKind, clang::FileID) override
+    {
+        if (reason != EnterFile)
+            return;
+        clang::FileID fid = sm.getFileID(loc);
+        clang::SourceLocation includeLoc = sm.getIncludeLoc(fid);
+        if (includeLoc.isValid() && sm.isInMainFile(includeLoc))
+            files.push_back(fid);
+    }
+};
+
+class BuildPreambleAction : public clang::GeneratePCHAction
+{
+    std::string output;
+    bool &usable;
+    std::vector<clang::FileID> directIncludes;
+
+public:
+    BuildPreambleAction(std::string output, bool &usable)
+        : output(std::move(output))
+        , usable(usable)
+    {
+    }
+
+protected:
+    bool BeginInvocation(clang::CompilerInstance &CI) override
+    {
+        CI.getFrontendOpts().OutputFile = output;
+        // Only the declarations are used from the PCH: the pages of the headers are already done
+        CI.getFrontendOpts().SkipFunctionBodies = true;
+        return clang::GeneratePCHAction::BeginInvocation(CI);
+    }
+
+    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &CI,
+                                                          llvm::StringRef InFile) override
+    {
+        CI.getPreprocessor().addPPCallbacks(
+            maybe_unique(new DirectIncludes(CI.getSourceManager(), directIncludes)));
+        return clang::GeneratePCHAction::CreateASTConsumer(CI, InFile);
+    }
+
+    void EndSourceFileAction() override
+    {
+        clang::CompilerInstance &CI = getCompilerInstance();
+        clang::SourceManager &sm = CI.getSourceManager();
+        clang::HeaderSearch &hs = CI.getPreprocessor().getHeaderSearchInfo();
+        for (clang::FileID fid : directIncludes) {
+#if CLANG_VERSION_MAJOR >= 18
+            auto file = sm.getFileEntryRefForID(fid);
+            bool guarded = file && hs.isFileMultipleIncludeGuarded(*file);
+#else
+            const clang::FileEntry *file = sm.getFileEntryForID(fid);
+            bool guarded = file && hs.isFileMultipleIncludeGuarded(file);
+#endif
+            if (!guarded) {
+                // Including it again after the PCH would not be the same
+                SPDLOG_DEBUG("Preamble not usable, {} is not include guarded",
+                             sm.getFilename(sm.getLocForStartOfFile(fid)).str());
+                usable = false;
+            }
+        }
+        if (CI.getDiagnostics().hasErrorOccurred())
+            usable = false;
+        clang::GeneratePCHAction::EndSourceFileAction();
+    }
+};
+
+PreambleCache::PreambleCache()
+{
+    llvm::SmallString<128> path;
+    if (auto e = llvm::sys::fs::createUniqueDirectory("codebrowser-preamble", path)) {
+        SPDLOG_ERROR("Cannot create the preamble directory: {}", e.message());
+        std::cerr << "Error creating the preamble directory: " << e.message() << std::endl;
+        return;
+    }
+    dir = path.str().str();
+}
+
+PreambleCache::~PreambleCache()
+{
+    if (!dir.empty())
+        llvm::sys::fs::remove_directories(dir);
+}
+
+std::string PreambleCache::groupKey(const std::vector<std::string> &command,
+                                    llvm::StringRef file) const
+{
+    if (dir.empty())
+        return {};
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer)
+        return {};
+    llvm::StringRef preamble = preambleOf((*buffer)->getBuffer());
+    if (!preamble.contains("#include") && !preamble.contains("#import"))
+        return {};
+
+    // The quoted includes are relative to the directory of the file
+    std::string s = llvm::sys::path::parent_path(file).str();
+    s += '\0';
+    s += preamble;
+    bool skipNext = false;
+    for (const auto &arg : command) {
+        llvm::StringRef a(arg);
+        if (skipNext || isInputArgument(a, file)) {
+            skipNext = false;
+            continue;
+        }
+        // The dependency file options are different for every file, but do not matter
+        if (a == "-MF" || a == "-MT" || a == "-MQ") {
+            skipNext = true;
+            continue;
+        }
+        if (a.startswith("-MF") || a.startswith("-MT") || a.startswith("-MQ"))
+            continue;
+        s += '\0';
+        s += arg;
+    }
+    return llvm::utohexstr(llvm::xxHash64(s));
+}
+
+std::string PreambleCache::build(const std::string &key, llvm::StringRef file,
+                                 std::vector<std::string> command, const Runner &run) const
+{
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer)
+        return {};
+    std::string header = dir % "/" % key % ".h";
+    std::string pch = dir % "/" % key % ".pch";
+    {
+        std::error_code ec;
+        llvm::raw_fd_ostream os(header, ec, llvm::sys::fs::OF_None);
+        if (ec)
+            return {};
+        os << preambleOf((*buffer)->getBuffer()) << '\n';
+    }
+
+    // Compile the header with the preamble instead of the file
+    auto input = std::find_if(command.begin(), command.end(),
+                              [&](const std::string &arg) { return isInputArgument(arg, file); });
+    if (input == command.end())
+        return {};
+    llvm::StringRef extension = llvm::sys::path::extension(file);
+    const char *language = llvm::StringSwitch<const char *>(extension)
+                               .Case(".c", "c-header")
+                               .Case(".m", "objective-c-header")
+                               .Case(".mm", "objective-c++-header")
+                               .Default("c++-header");
+    *input = header;
+    input = command.insert(input, language);
+    command.insert(input, "-x");
+    // The header is not next to the file
+    command.push_back("-iquote");
+    command.push_back(llvm::sys::path::parent_path(file).str());
+
+    bool usable = true;
+    if (!run(std::move(command), new BuildPreambleAction(pch, usable)) || !usable
+        || !llvm::sys::fs::exists(pch)) {
+        SPDLOG_DEBUG("No preamble for the group of {}", file.str());
+        llvm::sys::fs::remove(pch);
+        return {};
+    }
+    SPDLOG_DEBUG("Built the preamble {} from {}", pch, file.str());
+    return pch;
+}
@@ -0,0 +1,70 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace clang {
+class FrontendAction;
+}
+
+/**
+ * Shares the parsing of the headers included at the beginning of the source files (--preamble).
+ *
+ * The translation units with the same command (but the file), directory and preamble (the
+ * directives before the first declaration, see clang::Lexer::ComputePreamble) form a group.
+ * The first translation unit of a group is processed normally, then its preamble is compiled to
+ * a PCH that the others load with -include-pch instead of parsing the same headers again.
+ *
+ * The declarations loaded from the PCH keep their locations. The pages of the headers were
+ * generated by the first translation unit, which claimed them. The others still go through the
+ * directives of their preamble, so their main files are annotated as before: this is why the
+ * PCH is only used when the headers included directly by the preamble are include guarded.
+ */
+class PreambleCache
+{
+public:
+    // Runs the action on the given command, as proceedCommand does
+    using Runner = std::function<bool(std::vector<std::string> command, clang::FrontendAction *)>;
+
+    PreambleCache();
+    ~PreambleCache(); // removes the PCH files
+    PreambleCache(const PreambleCache &) = delete;
+    PreambleCache &operator=(const PreambleCache &) = delete;
+
+    // 'command' is the adjusted command of 'file'. Returns an empty key if it has no preamble.
+    std::string groupKey(const std::vector<std::string> &command, llvm::StringRef file) const;
+
+    /**
+     * Builds the PCH of the group from the preamble of one of its files and its adjusted command.
+     * Returns the path of the PCH, or an empty string if it could not be built or used.
+     */
+    std::string build(const std::string &key, llvm::StringRef file,
+                      std::vector<std::string> command, const Runner &run) const;
+
+private:
+    std::string dir;
+};
@@ -21,6 +21,8 @@
 
 #include "projectmanager.h"
 #include "filesystem.h"
+#include "objectstore.h"
+#include "stats.h"
 #include "stringbuilder.h"
 
 #include <clang/Basic/Version.h>
@@ -28,6 +30,9 @@
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
 
+#include <iostream>
+#include <set>
+
 #include "spdlog/spdlog.h"
 #include "spdlog/fmt/fmt.h"
 #include "spdlog/fmt/ranges.h"
@@ -36,6 +41,7 @@ ProjectManager::ProjectManager(std::string outputPrefix, std::string _dataPath)
     , dataPath(std::move(_dataPath))
 	,dir_creator_(outputPrefix)
    ,file_index_(outputPrefix + "/fileIndex" + getFileIndexSuffix())
+    , file_index_meta_(outputPrefix + "/fileIndexMeta" + getFileIndexSuffix())
 {
     if (dataPath.empty())
         dataPath = "../data";
@@ -66,27 +72,67 @@ bool ProjectManager::addProject(ProjectInfo info)
     info.source_path = filename.c_str();
 
     projects.push_back(std::move(info));
+    buildProjectTrie(); // the vector may have moved
     return true;
 }
 
-ProjectInfo *ProjectManager::projectForFile(llvm::StringRef filename)
+void ProjectManager::buildProjectTrie()
 {
-    unsigned int match_length = 0;
-    ProjectInfo *result = nullptr;
-
-    for (auto &it : projects) {
-        const std::string &source_path = it.source_path;
-        if (source_path.size() < match_length) {
-            continue;
-        }
-        if (filename.startswith(source_path)) {
-            result = &it;
-            match_length = source_path.size();
+    project_trie_.assign(1, ProjectTrieNode());
+    // When several projects have the same source_path, the last one wins
+    for (auto &project : projects) {
+        unsigned int node = 0;
+        llvm::StringRef rest = project.source_path;
+        for (auto slash = rest.find('/'); slash != llvm::StringRef::npos; slash = rest.find('/')) {
+            auto it = project_trie_[node].children.try_emplace(rest.substr(0, slash),
+                                                               project_trie_.size());
+            node = it.first->second;
+            if (it.second)
+                project_trie_.emplace_back(); // invalidates it
+            rest = rest.substr(slash + 1);
         }
+        project_trie_[node].project = &project;
+    }
+}
+
+ProjectInfo *ProjectManager::projectForFile(llvm::StringRef filename)
+{
+    // The project with the longest source_path that filename starts with. The source_path
+    // always ends with a '/', so it is made of the first components of filename.
+    const ProjectTrieNode *node = &project_trie_.front();
+    ProjectInfo *result = node->project;
+    for (auto slash = filename.find('/'); slash != llvm::StringRef::npos;
+         slash = filename.find('/')) {
+        auto it = node->children.find(filename.substr(0, slash));
+        if (it == node->children.end())
+            break;
+        node = &project_trie_[it->second];
+        if (node->project)
+            result = node->project;
+        filename = filename.substr(slash + 1);
     }
     return result;
 }
 
+const ProjectManager::ResolvedFile &ProjectManager::resolve(llvm::StringRef name)
+{
+    std::string key = name.str();
+    if (auto *resolved = resolved_files_.find(key))
+        return *resolved;
+    // A relative name is canonicalized from the working directory, which never changes.
+    // Two threads may resolve the same name, the first one to insert wins.
+    ResolvedFile resolved;
+    llvm::SmallString<256> filename;
+    canonicalize(name, filename);
+    resolved.canonical = filename.str();
+    resolved.project = projectForFile(filename);
+    if (resolved.project) {
+        resolved.htmlName = resolved.project->name % "/"
+            % filename.substr(resolved.project->source_path.size());
+    }
+    return resolved_files_.getOrCreate(key, std::move(resolved));
+}
+
 
 //TODO find the corresponding entry for create file
 bool ProjectManager::shouldProcess0(llvm::StringRef filename, ProjectInfo *project)
@@ -119,9 +165,23 @@ bool ProjectManager::shouldProcess(llvm::StringRef filename, ProjectInfo *projec
         return false;
     }
 
+    if (!fill_in_.empty()) {
+        if (!fill_in_.count(project->name % "/" % filename.substr(project->source_path.size()))) {
+            SPDLOG_DEBUG("should not process since it is not missing: {}", filename.str());
+            return false;
+        }
+    } else if (!isInShard(filename, project)) {
+        SPDLOG_DEBUG("should not process since it belongs to another shard: {}", filename.str());
+        return false;
+    }
+
     std::string fn = outputPrefix % "/" % project->name % "/"
         % filename.substr(project->source_path.size()) % ".html";
     auto has = addFile_Locked(fn);
+    if (has && !getFileIndexSuffix().empty())
+        has = claimFile(fn);
+    if (has)
+        Stats::add(Stats::FilesClaimed);
     SPDLOG_DEBUG("The final file name: {}, add lock succeed:{}", fn, has);
     return has;
     //return !llvm::sys::fs::exists(fn);
@@ -129,6 +189,106 @@ bool ProjectManager::shouldProcess(llvm::StringRef filename, ProjectInfo *projec
 }
 
 
+bool ProjectManager::setShard(unsigned int index, unsigned int count)
+{
+    shard_index_ = index;
+    shard_count_ = count;
+    segment_ = std::make_unique<FileIndex>(outputPrefix + "/segment" + getFileIndexSuffix());
+    // Every generator of the shard writes the same header, the merge removes the duplicates
+    std::string header = "segment 1\nshard " % std::to_string(index) % "/" % std::to_string(count)
+        % "\ncompress " % (Compression::enabled ? "1" : "0") % "\n";
+    for (const auto &project : projects) {
+        if (project.type == ProjectInfo::Normal)
+            header %= "project " % project.name % "\t" % project.revision % "\n";
+    }
+    segment_->AppendLine_Locked(header);
+    segment_->Flush_Locked();
+    return segment_->Good();
+}
+
+bool ProjectManager::isInShard(llvm::StringRef filename, ProjectInfo *project) const
+{
+    if (shard_count_ <= 1)
+        return true;
+    // The path relative to the project, so the nodes agree even if their checkouts are in
+    // different directories. Without the extension, so a header goes to the same shard as the
+    // source file with the same name, which is most likely to include it.
+    llvm::StringRef path = filename.substr(project->source_path.size());
+    auto dot = path.rfind('.');
+    if (dot != llvm::StringRef::npos && path.find('/', dot) == llvm::StringRef::npos)
+        path = path.substr(0, dot);
+    // FNV-1a, the same on every node
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : project->name + "/" + path.str()) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h % shard_count_ == shard_index_;
+}
+
+void ProjectManager::addForeignFile(llvm::StringRef filename, ProjectInfo *project,
+                                    llvm::StringRef mainFile)
+{
+    std::string page = project->name % "/" % filename.substr(project->source_path.size());
+    if (foreign_files_.insert(page))
+        segment_->AppendLine_Locked("foreign " % page % "\t" % mainFile % "\n");
+}
+
+bool ProjectManager::setFillIn(const std::string &missing, std::vector<std::string> &sources)
+{
+    std::ifstream in(missing);
+    if (!in)
+        return false;
+    std::set<std::string> translationUnits;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos)
+            continue;
+        fill_in_.insert(line.substr(0, tab));
+        translationUnits.insert(line.substr(tab + 1));
+    }
+    // Back from the html name of the translation unit to its file, in the project with the
+    // longest name it starts with
+    for (llvm::StringRef name : translationUnits) {
+        const ProjectInfo *found = nullptr;
+        for (const auto &project : projects) {
+            if (name.startswith(std::string(project.name % "/"))
+                && (!found || project.name.size() > found->name.size()))
+                found = &project;
+        }
+        if (found && found->type == ProjectInfo::Normal) {
+            sources.push_back(found->source_path % name.substr(found->name.size() + 1));
+        } else {
+            SPDLOG_ERROR("--fill-in: {} is not in any project", name.str());
+            std::cerr << "--fill-in: " << name.str() << " is not in any project" << std::endl;
+        }
+    }
+    return !in.bad() && !fill_in_.empty();
+}
+
+bool ProjectManager::claimFile(const std::string &file)
+{
+    // file always starts with outputPrefix (see shouldProcess)
+    std::string claim = outputPrefix % "/.claims" % file.substr(outputPrefix.size());
+    if (auto e = create_directories(llvm::sys::path::parent_path(claim))) {
+        SPDLOG_ERROR("Cannot create claim directory for {}: {}", claim, e.message());
+        return true; // better generate a file twice than not at all
+    }
+    int fd;
+    auto e = llvm::sys::fs::openFileForWrite(claim, fd, llvm::sys::fs::CD_CreateNew);
+    if (e == std::errc::file_exists) {
+        SPDLOG_DEBUG("File already claimed by another process: {}", file);
+        return false;
+    }
+    if (e) {
+        SPDLOG_ERROR("Cannot create claim file {}: {}", claim, e.message());
+        return true;
+    }
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    return true;
+}
+
 void ProjectManager::createDir()
 {
 	assert(false);
@@ -144,7 +304,29 @@ ProjectManager::DirCreator::DirCreator(const std::string& outputPrefix) {
 	SPDLOG_DEBUG("Create dir for prefix done:{}", outputPrefix);
 }
 
-ProjectManager::RefFile::RefFile(const std::string &p)
-	: path_(p), ofs_(p, error_code, llvm::sys::fs::OF_Append) {
-				assert(!ofs_.has_error());
+ProjectManager::RefFile::RefFile(const std::string &p, RefWriter &writer)
+	: path_(p), writer_(writer), lane_(writer.laneFor(p)) {
 			}
+
+bool ProjectManager::flush()
+{
+    bool ok = writePending();
+    // With a file index suffix, the refs are merged later; the merger writes the final files
+    if (ObjectStore::enabled() && getFileIndexSuffix().empty())
+        ok &= ObjectStore::ingestAll(ref_writer_.takeWritten());
+    return ok;
+}
+
+bool ProjectManager::writePending()
+{
+    file_index_.Flush_Locked();
+    file_index_meta_.Flush_Locked();
+    bool ok = file_index_.Good() && file_index_meta_.Good();
+    if (segment_) {
+        segment_->Flush_Locked();
+        ok &= segment_->Good();
+    }
+    if (!ok)
+        SPDLOG_ERROR("Cannot write the file index");
+    return ref_writer_.flush() && ok;
+}
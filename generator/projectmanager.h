@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
 #include <string>
 #include <unordered_map>
@@ -28,7 +29,11 @@
 #include <mutex>
 #include <unordered_set>
 #include <fstream>
+#include <memory>
 
+#include "compression.h"
+#include "concurrent.h"
+#include "refwriter.h"
 #include "logger.h"
 
 struct ProjectInfo
@@ -86,6 +91,17 @@ struct ProjectManager
     // the file name need to be canonicalized
     ProjectInfo *projectForFile(llvm::StringRef filename); // don't keep a cache
 
+    // What the name of a FileEntry refers to
+    struct ResolvedFile
+    {
+        std::string canonical; // the canonicalized name
+        ProjectInfo *project = nullptr; // projectForFile(canonical)
+        std::string htmlName; // the project name followed by the path in the project
+    };
+    // Cached for all the translation units, which include mostly the same files. All the
+    // projects must be added before.
+    const ResolvedFile &resolve(llvm::StringRef name);
+
     // return true if the filename should be proesseded.
     // 'project' is the value returned by projectForFile
     bool shouldProcess(llvm::StringRef filename, ProjectInfo *project);
@@ -105,43 +121,95 @@ struct ProjectManager
 			std::lock_guard lg(mutex_);
 			ofs_<<s;
 		}
+		void Flush_Locked() {
+			std::lock_guard lg(mutex_);
+			ofs_.flush();
+		}
+		bool Good() const { return ofs_.good(); }
 		private:
 		std::mutex mutex_;
 		std::string path_;
 		std::ofstream ofs_;
     };
+    // The data is queued to the RefWriter, which opens the file when writing it
     class RefFile {
     	public:
-		RefFile(const std::string &p);
-		RefFile(const FileIndex&) = delete;
+		RefFile(const std::string &p, RefWriter &writer);
+		RefFile(const RefFile&) = delete;
 		void AppendLine_Locked(const std::string& s) {
-			std::lock_guard lg(mutex_);
-			ofs_<<s;
+			writer_.append(lane_, path_, s);
 		}
 		private:
-		std::mutex mutex_;
-		static inline thread_local std::error_code error_code;
 		std::string path_;
-		//std::ofstream ofs_;
-		llvm::raw_fd_ostream ofs_;
+		RefWriter &writer_;
+		unsigned int lane_;
     };
 
     RefFile& GetRefFile(const std::string& s) {
-		std::lock_guard lg(mutex_);
-		auto [itr, _] = ref_files.try_emplace(s, s);
-		return itr->second;
+		return ref_files.getOrCreate(s, s + Compression::suffix(), ref_writer_);
     }
     RefFile& GetFuncIndexFile(const std::string& s) {
-		std::lock_guard lg(mutex_);
-		auto [itr, _] = func_index_files.try_emplace(s, s);
-		return itr->second;
+		return func_index_files.getOrCreate(s, s, ref_writer_);
     }
 	void AddFileIndex(const std::string &s) {
-		file_index_.AppendLine_Locked(s);
+		file_index_.AppendLine_Locked(s + '\n');
 	}
+    // fileIndexMeta lists the interesting definitions of the files in the fileIndex, so
+    // codebrowser_indexgenerator does not have to read them back from the HTML.
+    void AddFileIndexMeta(const std::string &line) {
+        file_index_meta_.AppendLine_Locked(line);
+    }
+    // Writes all the pending data. To be called once all the translation units are done.
+    // Returns false if some file could not be written.
+    bool flush();
+    // Writes the data pending so far to the files, so it is not lost if the process dies.
+    // Returns false if some file could not be written.
+    bool writePending();
+    // Records written to the refs are identical for every translation unit including the
+    // same header. Returns true the first time the fingerprint of a record is seen.
+    bool addRefRecord(uint64_t fingerprint) {
+        return ref_records_.insert(fingerprint);
+    }
+    // In incremental mode, the pages of the translation units that are not processed again
+    // are claimed before processing anything. 'page' is the full path of the html file.
+    void claimPage(const std::string &page) {
+        addFile_Locked(page);
+    }
+    void releasePage(const std::string &page) {
+        exists_files_.erase(page);
+    }
+    bool isPageClaimed(const std::string &page) {
+        return exists_files_.contains(page);
+    }
+
+    /* With --shard, this generator is the shard 'index' of 'count' (see codebrowser_merge): it
+     * only processes the translation units and generates the pages of the files whose path
+     * hashes to it, and describes its output in the 'segment' file. Returns false if the
+     * segment file cannot be written. */
+    bool setShard(unsigned int index, unsigned int count);
+    bool isSharded() const { return shard_count_ > 1; }
+    // 'project' is the value returned by projectForFile
+    bool isInShard(llvm::StringRef filename, ProjectInfo *project) const;
+    // Records that the translation unit 'mainFile' (its html name) includes a file whose page
+    // is generated by another shard, so the merge can tell if no shard generated it.
+    void addForeignFile(llvm::StringRef filename, ProjectInfo *project, llvm::StringRef mainFile);
+    /* With --fill-in, only the pages of the files listed in 'missing', the segment-missing file
+     * of codebrowser_merge --input, are generated, whatever their shard. The translation units
+     * listed with them are appended to 'sources'. Returns false if 'missing' cannot be read or
+     * is empty. */
+    bool setFillIn(const std::string &missing, std::vector<std::string> &sources);
 
 private:
     static std::vector<ProjectInfo> systemProjects();
+    // The source_path of the projects, by component, for projectForFile
+    struct ProjectTrieNode
+    {
+        llvm::StringMap<unsigned int> children; // component -> index in project_trie_
+        ProjectInfo *project = nullptr;
+    };
+    void buildProjectTrie();
+    std::vector<ProjectTrieNode> project_trie_ = std::vector<ProjectTrieNode>(1);
+    StripedMap<std::string, ResolvedFile> resolved_files_;
     /*
     bool hasFile_Locked(const std::string& file) {
 		std::lock_guard lg(mutex_);
@@ -149,17 +217,27 @@ private:
     }
     */
     bool addFile_Locked(const std::string& file) {
-		std::lock_guard lg(mutex_);
-		auto [_, suc] = exists_files_.insert(file);
-		return suc;
+		return exists_files_.insert(file);
     }
+    // In MULTIPROCESS_MODE the other generator processes of the same run do not share
+    // exists_files_, so a file is claimed by atomically creating a lock file under
+    // outputPrefix/.claims. Returns false if another process already claimed it.
+    bool claimFile(const std::string& file);
 	DirCreator dir_creator_;
-	std::mutex mutex_;
-	std::unordered_set<std::string> exists_files_;
+	StripedSet<std::string> exists_files_;
     std::unordered_multimap<std::string, std::string> includeRecoveryCache;
 
     FileIndex file_index_;
-	std::unordered_map<std::string, RefFile> ref_files;
-	std::unordered_map<std::string, RefFile> func_index_files;
+    FileIndex file_index_meta_;
+	RefWriter ref_writer_;
+	StripedMap<std::string, RefFile> ref_files;
+	StripedMap<std::string, RefFile> func_index_files;
+	StripedSet<uint64_t> ref_records_;
+    unsigned int shard_index_ = 0;
+    unsigned int shard_count_ = 1;
+    std::unique_ptr<FileIndex> segment_;
+    StripedSet<std::string> foreign_files_;
+    // Only read once set up by setFillIn
+    std::unordered_set<std::string> fill_in_;
 
 };
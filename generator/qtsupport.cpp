@@ -22,6 +22,7 @@
 /* This file handle the support of the SIGNAL and SLOT macro in QObject::connect */
 
 #include "qtsupport.h"
+#include "annotationpass.h"
 #include "annotator.h"
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/ExprCXX.h>
@@ -442,3 +443,31 @@ void QtSupport::visitCXXConstructExpr(clang::CXXConstructExpr *e)
         }
     }
 }
+
+namespace {
+
+struct QtPass : AnnotationPass
+{
+    Annotator &annotator;
+    explicit QtPass(Annotator &annotator)
+        : annotator(annotator)
+    {
+    }
+
+    void visitCallExpr(clang::CallExpr *e, clang::NamedDecl *currentContext) override
+    {
+        QtSupport { annotator, currentContext }.visitCallExpr(e);
+    }
+    void visitCXXConstructExpr(clang::CXXConstructExpr *e,
+                               clang::NamedDecl *currentContext) override
+    {
+        QtSupport { annotator, currentContext }.visitCXXConstructExpr(e);
+    }
+};
+
+}
+
+std::unique_ptr<AnnotationPass> createQtPass(Annotator &annotator)
+{
+    return std::make_unique<QtPass>(annotator);
+}
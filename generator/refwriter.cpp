@@ -0,0 +1,242 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "refwriter.h"
+#include "compression.h"
+#include "objectstore.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "spdlog/spdlog.h"
+
+// Above that amount of queued data, append() waits for the writer.
+static constexpr std::size_t MaxPendingBytesPerLane = 64 * 1024 * 1024;
+
+class RefWriter::Lane
+{
+public:
+    explicit Lane(std::size_t maxOpenFiles)
+        : maxOpenFiles(std::max<std::size_t>(maxOpenFiles, 1))
+        , thread([this] { run(); })
+    {
+    }
+    ~Lane()
+    {
+        {
+            std::lock_guard lg(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    void append(const std::string &path, const std::string &data)
+    {
+        {
+            std::unique_lock lock(mutex);
+            space.wait(lock, [&] { return pendingBytes < MaxPendingBytesPerLane; });
+            pending[path] += data;
+            pendingBytes += data.size();
+        }
+        wake.notify_one();
+    }
+
+    bool flush()
+    {
+        std::unique_lock lock(mutex);
+        closeRequested = true;
+        wake.notify_one();
+        idle.wait(lock, [&] { return !closeRequested; });
+        bool ok = !failed;
+        failed = false;
+        return ok;
+    }
+
+    std::vector<std::string> takeWritten()
+    {
+        std::lock_guard lg(mutex);
+        std::vector<std::string> result(written.begin(), written.end());
+        written.clear();
+        return result;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || closeRequested || !pending.empty(); });
+            if (!pending.empty()) {
+                // Everything queued for a file since the last batch is written at once
+                auto batch = std::move(pending);
+                pending.clear();
+                pendingBytes = 0;
+                lock.unlock();
+                space.notify_all();
+                bool ok = true;
+                for (const auto &it : batch)
+                    ok &= write(it.first, it.second);
+                lock.lock();
+                if (!ok)
+                    failed = true;
+                if (ObjectStore::enabled()) {
+                    for (const auto &it : batch)
+                        written.insert(it.first);
+                }
+                continue;
+            }
+            if (closeRequested) {
+                openFiles.clear();
+                lru.clear();
+                closeRequested = false;
+                idle.notify_all();
+                continue;
+            }
+            if (stopping)
+                break;
+        }
+        openFiles.clear();
+    }
+
+    // Only called from the lane's thread, without the lock
+    bool write(const std::string &path, const std::string &data)
+    {
+        auto it = openFiles.find(path);
+        if (it != openFiles.end()) {
+            lru.splice(lru.begin(), lru, it->second.second);
+        } else {
+            if (openFiles.size() >= maxOpenFiles) {
+                openFiles.erase(lru.back());
+                lru.pop_back();
+            }
+            // A file linked into the object store must not be appended through the link
+            if (ObjectStore::hasLinks())
+                ObjectStore::detach(path);
+            std::error_code ec;
+            auto os = std::make_unique<llvm::raw_fd_ostream>(path, ec, llvm::sys::fs::OF_Append);
+            if (ec) {
+                SPDLOG_ERROR("Cannot open {}: {}", path, ec.message());
+                std::cerr << "Error opening " << path << ": " << ec.message() << std::endl;
+                os->clear_error();
+                return false;
+            }
+            os->SetUnbuffered();
+            lru.push_front(path);
+            it = openFiles.emplace(path, std::make_pair(std::move(os), lru.begin())).first;
+        }
+        auto &os = *it->second.first;
+        if (llvm::StringRef(path).endswith(".gz"))
+            os << Compression::gzip(data);
+        else
+            os << data;
+        if (os.has_error()) {
+            SPDLOG_ERROR("Cannot write {}: {}", path, os.error().message());
+            std::cerr << "Error writing " << path << ": " << os.error().message() << std::endl;
+            os.clear_error();
+            return false;
+        }
+        return true;
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake; // work for the writer thread
+    std::condition_variable space; // pendingBytes went down
+    std::condition_variable idle; // requested close done
+    std::unordered_map<std::string, std::string> pending; // path -> coalesced data
+    std::size_t pendingBytes = 0;
+    bool closeRequested = false;
+    bool stopping = false;
+    bool failed = false;
+    std::unordered_set<std::string> written; // since takeWritten(), only with --cas
+
+    // only accessed by the writer thread
+    const std::size_t maxOpenFiles;
+    std::list<std::string> lru; // most recently used first
+    std::unordered_map<std::string,
+                       std::pair<std::unique_ptr<llvm::raw_fd_ostream>, std::list<std::string>::iterator>>
+        openFiles;
+
+    std::thread thread; // last, so it starts after everything else is initialized
+};
+
+RefWriter::RefWriter(unsigned int laneCount, std::size_t maxOpenFiles)
+{
+    laneCount = std::max(laneCount, 1u);
+    if (maxOpenFiles == 0) {
+        maxOpenFiles = 256;
+#ifndef _WIN32
+        // Leave half of the descriptors to clang and the rest of the generator
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+            maxOpenFiles = std::max<std::size_t>(rl.rlim_cur / 2, laneCount);
+#endif
+    }
+    for (unsigned int i = 0; i < laneCount; ++i)
+        lanes.push_back(std::make_unique<Lane>(maxOpenFiles / laneCount));
+}
+
+RefWriter::~RefWriter()
+{
+    flush();
+}
+
+unsigned int RefWriter::laneFor(const std::string &path) const
+{
+    return std::hash<std::string> {}(path) % lanes.size();
+}
+
+void RefWriter::append(unsigned int lane, const std::string &path, const std::string &data)
+{
+    lanes[lane]->append(path, data);
+}
+
+bool RefWriter::flush()
+{
+    bool ok = true;
+    for (auto &lane : lanes)
+        ok &= lane->flush();
+    return ok;
+}
+
+std::vector<std::string> RefWriter::takeWritten()
+{
+    std::vector<std::string> result;
+    for (auto &lane : lanes) {
+        auto paths = lane->takeWritten();
+        result.insert(result.end(), paths.begin(), paths.end());
+    }
+    return result;
+}
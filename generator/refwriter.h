@@ -0,0 +1,64 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Write-behind appender for the many small files of the refs and fnSearch directories.
+ *
+ * The translation unit threads only queue the data.  Each file is assigned to one writer
+ * thread (a lane), which coalesces everything queued for a file since its last batch and
+ * appends it with a single write.  The lanes keep a bounded number of files open and close
+ * the least recently used ones.  Queued data is bounded too: append() blocks while the lane
+ * has too much data pending.
+ * The files whose name ends with .gz are written compressed, one gzip member per batch.
+ */
+class RefWriter
+{
+public:
+    // maxOpenFiles == 0 means a limit derived from RLIMIT_NOFILE
+    explicit RefWriter(unsigned int lanes = 2, std::size_t maxOpenFiles = 0);
+    ~RefWriter();
+    RefWriter(const RefWriter &) = delete;
+    RefWriter &operator=(const RefWriter &) = delete;
+
+    // Each file must always be appended through the same lane
+    unsigned int laneFor(const std::string &path) const;
+    void append(unsigned int lane, const std::string &path, const std::string &data);
+
+    /**
+     * Waits until everything queued so far is written and closes all the files.
+     * Returns false if any write failed since the last flush.
+     */
+    bool flush();
+
+    // With --cas: the files written since the last call
+    std::vector<std::string> takeWritten();
+
+private:
+    class Lane;
+    std::vector<std::unique_ptr<Lane>> lanes;
+};
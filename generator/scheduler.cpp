@@ -0,0 +1,206 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+static uint64_t residentMemory()
+{
+#if defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    if (statm >> size >> resident)
+        return resident * sysconf(_SC_PAGESIZE);
+#endif
+    return 0; // unknown: only the expected memory of the tasks is checked
+}
+
+Scheduler::Scheduler(unsigned threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threadCount; ++i)
+        workers.push_back(std::make_unique<Worker>());
+    for (unsigned i = 0; i < threadCount; ++i)
+        threads.emplace_back([this, i] { work(i); });
+}
+
+Scheduler::~Scheduler()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+void Scheduler::schedule(double cost, std::string name, std::function<void()> task)
+{
+    queued.push_back({ cost, std::move(name), std::move(task) });
+}
+
+void Scheduler::dispatch()
+{
+    if (queued.empty())
+        return;
+    std::stable_sort(queued.begin(), queued.end(),
+                     [](const Task &a, const Task &b) { return a.cost > b.cost; });
+    double cost = 0;
+    for (const Task &task : queued)
+        cost += task.cost;
+    std::size_t count = queued.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total == 0)
+            start = std::chrono::steady_clock::now();
+        running += count;
+        total += count;
+        totalCost += cost;
+        // Counted before they are in the deques: a thread may pop one as soon as it is pushed,
+        // and available must not go below zero
+        available += count;
+    }
+    // Round robin, so every deque stays sorted and gets its share of the big tasks
+    for (Task &task : queued) {
+        Worker &w = *workers[nextWorker];
+        nextWorker = (nextWorker + 1) % workers.size();
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.tasks.push_back(std::move(task));
+    }
+    queued.clear();
+    wakeUp.notify_all();
+}
+
+void Scheduler::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    allDone.wait(lock, [this] { return running == 0; });
+}
+
+bool Scheduler::pop(std::size_t self, Task &task)
+{
+    {
+        Worker &w = *workers[self];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (!w.tasks.empty()) {
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            --available;
+            return true;
+        }
+    }
+    // Steal the most expensive task left: the front of the deque whose front costs the most
+    while (true) {
+        Worker *victim = nullptr;
+        double cost = 0;
+        for (std::size_t i = 1; i < workers.size(); ++i) {
+            Worker &w = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (!w.tasks.empty() && (!victim || w.tasks.front().cost > cost)) {
+                victim = &w;
+                cost = w.tasks.front().cost;
+            }
+        }
+        if (!victim)
+            return false;
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if (!victim->tasks.empty()) { // or another thread took it meanwhile: look again
+            task = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            --available;
+            return true;
+        }
+    }
+}
+
+void Scheduler::work(std::size_t self)
+{
+    while (true) {
+        Task task;
+        if (pop(self, task)) {
+            task.run();
+            finished(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeUp.wait(lock, [this] { return stopping || available > 0; });
+        if (stopping && available == 0)
+            return;
+    }
+}
+
+void Scheduler::finished(const Task &task)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ++done;
+    doneCost += task.cost;
+    double elapsed =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // The remaining time is extrapolated from the cost done so far, as the costs vary a lot
+    double eta = doneCost > 0 ? elapsed * (totalCost - doneCost) / doneCost : 0;
+    long etaSeconds = static_cast<long>(eta + 0.5);
+    std::fprintf(stderr, "[%zu/%zu] %.1f files/s, ETA %ld:%02ld  Processed %s\n", done, total,
+                 elapsed > 0 ? done / elapsed : 0., etaSeconds / 60, etaSeconds % 60,
+                 task.name.c_str());
+    if (--running == 0)
+        allDone.notify_all();
+}
+
+Scheduler::Admission Scheduler::admit(uint64_t memory)
+{
+    if (!memoryBudget)
+        return { nullptr, 0 };
+    std::unique_lock<std::mutex> lock(memoryMutex);
+    while (true) {
+        uint64_t rss = residentMemory();
+        if (admitted == 0) {
+            baseline = rss;
+            break;
+        }
+        if (std::max(rss, baseline + reserved) + memory <= memoryBudget)
+            break;
+        // The resident memory also goes down while the other tasks run: poll it
+        memoryReleased.wait_for(lock, std::chrono::milliseconds(200));
+    }
+    ++admitted;
+    reserved += memory;
+    return { this, memory };
+}
+
+void Scheduler::release(uint64_t memory)
+{
+    {
+        std::lock_guard<std::mutex> lock(memoryMutex);
+        --admitted;
+        reserved -= memory;
+    }
+    memoryReleased.notify_all();
+}
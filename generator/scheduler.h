@@ -0,0 +1,139 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs the translation units on a fixed number of threads, the most expensive ones first, so a
+ * few big translation units do not end up running alone at the end.
+ *
+ * Every thread has its own deque of tasks. dispatch() sorts the queued tasks by decreasing cost
+ * and deals them to the deques. A thread takes its tasks from the front of its deque, and once
+ * it is empty steals the front of the other deque whose front costs the most, so the tasks
+ * left at the end are the cheap ones.
+ *
+ * Within a deque, the tasks of a dispatch() all come before the ones of the next dispatch(), so
+ * the tasks of a dispatch() may wait for the ones of the previous dispatch() without deadlocking.
+ *
+ * With a memory budget, the tasks call admit() before allocating their memory, which holds them
+ * back while the resident memory, or the memory expected to be used by the admitted tasks, would
+ * exceed the budget. A task is always admitted when no other is, so it does not wait forever.
+ */
+class Scheduler
+{
+public:
+    explicit Scheduler(unsigned threads = 0); // 0 for one thread per core
+    ~Scheduler(); // waits for the dispatched tasks
+
+    // Queues a task. name is reported in the progress when the task is done.
+    void schedule(double cost, std::string name, std::function<void()> task);
+    // Starts the queued tasks
+    void dispatch();
+    // Waits until all the dispatched tasks are done
+    void wait();
+
+    void setMemoryBudget(uint64_t bytes) { memoryBudget = bytes; }
+
+    class Admission
+    {
+    public:
+        Admission(Scheduler *scheduler, uint64_t memory)
+            : scheduler(scheduler)
+            , memory(memory)
+        {
+        }
+        Admission(Admission &&other)
+            : scheduler(other.scheduler)
+            , memory(other.memory)
+        {
+            other.scheduler = nullptr;
+        }
+        ~Admission()
+        {
+            if (scheduler)
+                scheduler->release(memory);
+        }
+
+    private:
+        Scheduler *scheduler;
+        uint64_t memory;
+    };
+    // Waits until a task expected to use that much memory fits in the budget. It is accounted
+    // for until the Admission is destroyed.
+    Admission admit(uint64_t memory);
+
+private:
+    struct Task
+    {
+        double cost;
+        std::string name;
+        std::function<void()> run;
+    };
+    struct alignas(64) Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(std::size_t self, Task &task);
+    void work(std::size_t self);
+    void finished(const Task &task);
+    void release(uint64_t memory);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::vector<Task> queued;
+    std::size_t nextWorker = 0;
+
+    std::atomic<std::size_t> available { 0 }; // tasks in the deques
+    std::mutex mutex; // protects the members below
+    std::condition_variable wakeUp;
+    std::condition_variable allDone;
+    std::size_t running = 0; // dispatched and not finished
+    bool stopping = false;
+
+    uint64_t memoryBudget = 0; // 0 for none
+    std::mutex memoryMutex; // protects the members below
+    std::condition_variable memoryReleased;
+    std::size_t admitted = 0;
+    uint64_t reserved = 0; // expected memory of the admitted tasks
+    uint64_t baseline = 0; // resident memory when no task was admitted
+
+    // progress
+    std::chrono::steady_clock::time_point start;
+    std::size_t total = 0;
+    std::size_t done = 0;
+    double totalCost = 0;
+    double doneCost = 0;
+};
@@ -0,0 +1,157 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#include "stats.h"
+
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include "spdlog/spdlog.h"
+
+thread_local Stats *Stats::current = nullptr;
+
+static std::mutex statsMutex;
+static std::unique_ptr<std::ofstream> statsFile; // null when the statistics are disabled
+
+static const char *const phaseNames[Stats::PhaseCount] = {
+    "total_ms", "traverse_ms", "highlight_ms", "html_ms", "refs_ms",
+    // the annotation passes
+    "param_hints_ms", "designator_hints_ms", "qt_ms", "record_layout_ms"
+};
+static const char *const counterNames[Stats::CounterCount] = { "tags", "references",
+                                                               "bytes_written", "files_claimed",
+                                                               "memory_bytes" };
+
+bool Stats::open(const std::string &path)
+{
+    auto file = std::make_unique<std::ofstream>(path, std::ios::out | std::ios::trunc);
+    if (!file->is_open()) {
+        SPDLOG_ERROR("Could not open the stats file: {}", path);
+        std::cerr << "Could not open the stats file " << path << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(statsMutex);
+    statsFile = std::move(file);
+    return true;
+}
+
+std::unordered_map<std::string, Stats::Previous> Stats::readPrevious(const std::string &path)
+{
+    std::unordered_map<std::string, Previous> result;
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return result;
+    llvm::StringRef content = buffer.get()->getBuffer();
+    while (!content.empty()) {
+        llvm::StringRef line;
+        std::tie(line, content) = content.split('\n');
+        auto value = llvm::json::parse(line);
+        if (!value) {
+            llvm::consumeError(value.takeError());
+            continue;
+        }
+        const llvm::json::Object *object = value->getAsObject();
+        if (!object)
+            continue;
+        auto file = object->getString("file");
+        if (!file)
+            continue;
+        Previous &previous = result[file->str()];
+        if (auto total = object->getNumber(phaseNames[Total]))
+            previous.totalMs = *total;
+        if (auto memory = object->getInteger(counterNames[MemoryBytes]))
+            previous.memoryBytes = *memory;
+    }
+    return result;
+}
+
+Stats::TranslationUnit::TranslationUnit(llvm::StringRef file)
+{
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (!statsFile)
+            return;
+    }
+    stats = std::make_unique<Stats>();
+    stats->file = file.str();
+    current = stats.get();
+}
+
+Stats::TranslationUnit::~TranslationUnit()
+{
+    if (!stats)
+        return;
+    current = nullptr;
+    stats->write();
+}
+
+static void writeJsonString(std::ostream &out, llvm::StringRef str)
+{
+    out << '"';
+    for (char c : str) {
+        switch (c) {
+        case '"': out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n"; break;
+        case '\t': out << "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                static const char hex[] = "0123456789abcdef";
+                out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+            } else {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+}
+
+void Stats::write() const
+{
+    std::string line;
+    {
+        std::ostringstream out;
+        out << "{\"file\":";
+        writeJsonString(out, file);
+        if (failed)
+            out << ",\"failed\":true";
+        for (int i = 0; i < PhaseCount; ++i) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(phases[i]).count();
+            out << ",\"" << phaseNames[i] << "\":" << us / 1000 << '.' << (us / 100) % 10
+                << (us / 10) % 10 << us % 10;
+        }
+        for (int i = 0; i < CounterCount; ++i)
+            out << ",\"" << counterNames[i] << "\":" << counters[i];
+        out << "}\n";
+        line = out.str();
+    }
+    std::lock_guard<std::mutex> lock(statsMutex);
+    if (statsFile) {
+        *statsFile << line;
+        // So the lines of the finished translation units are there even if the generator crashes
+        statsFile->flush();
+    }
+}
@@ -0,0 +1,135 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Per translation unit timings and counters (--stats).
+ *
+ * The thread processing a translation unit collects them while a Stats::TranslationUnit
+ * exists, and they are written as one JSON object per line when it is destroyed.
+ * When the statistics are not enabled, or outside of a translation unit, the timers and
+ * counters do nothing.
+ */
+class Stats
+{
+public:
+    enum Phase {
+        Total, // proceedCommand()
+        Traverse, // BrowserASTVisitor::TraverseDecl
+        Highlight, // Annotator::syntaxHighlight
+        Html, // Generator::generate
+        Refs, // the refs and fnSearch records
+        // The annotation passes (AnnotationPipeline), part of Traverse
+        ParamHintsPass,
+        DesignatorHintsPass,
+        QtPass,
+        RecordLayoutPass,
+        PhaseCount
+    };
+    enum Counter {
+        Tags,
+        References,
+        BytesWritten,
+        FilesClaimed,
+        MemoryBytes, // used by the AST, the preprocessor and the source buffers
+        CounterCount
+    };
+
+    // Enables the statistics, written to path (truncated). Returns false on error.
+    static bool open(const std::string &path);
+
+    struct Previous
+    {
+        double totalMs = 0;
+        uint64_t memoryBytes = 0;
+    };
+    // Reads the stats file of a previous run
+    static std::unordered_map<std::string, Previous> readPrevious(const std::string &path);
+
+    static void add(Counter counter, uint64_t value = 1)
+    {
+        if (Stats *s = current)
+            s->counters[counter] += value;
+    }
+
+    class TranslationUnit
+    {
+    public:
+        explicit TranslationUnit(llvm::StringRef file);
+        ~TranslationUnit();
+        TranslationUnit(const TranslationUnit &) = delete;
+        TranslationUnit &operator=(const TranslationUnit &) = delete;
+
+        void setFailed()
+        {
+            if (stats)
+                stats->failed = true;
+        }
+
+    private:
+        std::unique_ptr<Stats> stats;
+    };
+
+    // Adds the time spent in its scope to phase
+    class Timer
+    {
+    public:
+        explicit Timer(Phase phase)
+            : phase(phase)
+            , stats(current)
+        {
+            if (stats)
+                start = std::chrono::steady_clock::now();
+        }
+        ~Timer()
+        {
+            if (stats)
+                stats->phases[phase] += std::chrono::steady_clock::now() - start;
+        }
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+    private:
+        Phase phase;
+        Stats *stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+private:
+    void write() const;
+
+    static thread_local Stats *current;
+
+    std::string file;
+    bool failed = false;
+    std::array<std::chrono::steady_clock::duration, PhaseCount> phases {};
+    std::array<uint64_t, CounterCount> counters {};
+};
@@ -0,0 +1,67 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+
+#include <algorithm>
+#include <vector>
+
+/* Gives a small id to every distinct string, so the tables can be keyed by the id instead of
+ * the (often long) string. The strings are stored once, in an arena, and the StringRef to them
+ * stay valid until the interner is destroyed.
+ * The empty string always has the id 0. */
+class StringInterner
+{
+public:
+    using Id = unsigned;
+
+    StringInterner() { intern(llvm::StringRef()); }
+
+    Id intern(llvm::StringRef str)
+    {
+        auto it = ids.try_emplace(str, static_cast<Id>(strings.size()));
+        if (it.second)
+            strings.push_back(it.first->getKey());
+        return it.first->second;
+    }
+    llvm::StringRef str(Id id) const { return strings[id]; }
+
+    // The keys of a map keyed by id, sorted by their string, for a deterministic output
+    template<typename Map>
+    std::vector<Id> sortedKeys(const Map &map) const
+    {
+        std::vector<Id> keys;
+        keys.reserve(map.size());
+        for (const auto &it : map)
+            keys.push_back(it.first);
+        std::sort(keys.begin(), keys.end(),
+                  [this](Id a, Id b) { return strings[a] < strings[b]; });
+        return keys;
+    }
+
+private:
+    llvm::StringMap<Id, llvm::BumpPtrAllocator> ids;
+    std::vector<llvm::StringRef> strings; // by id
+};
@@ -27,6 +27,13 @@
 #include <vector>
 #include <map>
 #include <ctime>
+#include <algorithm>
+#include <filesystem>
+#include <tuple>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "../global.h"
 
@@ -34,9 +41,77 @@ const char *data_url = "../data";
 
 std::map<std::string, std::string, std::greater<std::string> > project_map;
 
-struct FolderInfo {
-//    std::string name;
-    std::map<std::string, std::shared_ptr<FolderInfo>> subfolders;
+// The interesting definitions of the files, from the fileIndexMeta written by the generator.
+// Without it (output of an older generator), they are read from the generated HTML.
+bool has_file_meta = false;
+std::unordered_map<std::string, std::string> file_meta;
+
+std::string generation_date;
+std::mutex log_mutex;
+
+/* The files of the fileIndex, as a flat vector of nodes. The root is nodes[0], and a node
+ * always comes after its parent. The path components are only stored once in names. */
+struct FolderTree {
+    struct Node {
+        unsigned int name = 0;
+        unsigned int parent = 0;
+        unsigned int depth = 0;
+        bool isFolder = false;
+        std::vector<unsigned int> children; // sorted by name once the tree is built
+    };
+    std::vector<Node> nodes { 1 };
+    std::vector<std::string> names;
+
+    void add(const std::string &file) {
+        unsigned int parent = 0;
+        size_t pos = 0;
+        size_t next_pos;
+        while ((next_pos = file.find('/', pos)) != std::string::npos) {
+            parent = child(parent, file.substr(pos, next_pos - pos));
+            nodes[parent].isFolder = true;
+            pos = next_pos + 1;
+        }
+        child(parent, file.substr(pos));
+    }
+
+    void sort() {
+        for (auto &node : nodes) {
+            std::sort(node.children.begin(), node.children.end(), [&](unsigned a, unsigned b) {
+                return names[nodes[a].name] < names[nodes[b].name];
+            });
+        }
+    }
+
+    const std::string &nameOf(unsigned int node) const { return names[nodes[node].name]; }
+
+    // path of a folder relative to the root, ending with '/', or empty for the root
+    std::string pathOf(unsigned int node) const {
+        std::string path;
+        for (; node != 0; node = nodes[node].parent)
+            path.insert(0, nameOf(node) + "/");
+        return path;
+    }
+
+private:
+    std::unordered_map<std::string, unsigned int> nameIds;
+    std::unordered_map<uint64_t, unsigned int> childIds; // parent << 32 | name -> node
+
+    unsigned int child(unsigned int parent, const std::string &name) {
+        auto n = nameIds.emplace(name, names.size());
+        if (n.second)
+            names.push_back(name);
+        uint64_t key = uint64_t(parent) << 32 | n.first->second;
+        auto c = childIds.emplace(key, nodes.size());
+        if (c.second) {
+            Node node;
+            node.name = n.first->second;
+            node.parent = parent;
+            node.depth = nodes[parent].depth + 1;
+            nodes.push_back(std::move(node));
+            nodes[parent].children.push_back(c.first->second);
+        }
+        return c.first->second;
+    }
 };
 
 std::string extractMetaFromHTML(std::string metaName, std::string fullPath) {
@@ -59,7 +134,7 @@ std::string cutNameSpace(std::string &className) {
         return className;
 }
 
-void linkInterestingDefinitions(std::ofstream &myfile, std::string linkFile, std::string &interestingDefitions)
+void linkInterestingDefinitions(std::ostream &myfile, std::string linkFile, std::string &interestingDefitions)
 {
     if (interestingDefitions.length() == 0) {
         return;
@@ -82,15 +157,20 @@ void linkInterestingDefinitions(std::ofstream &myfile, std::string linkFile, std
 
 }
 
-void gererateRecursisively(FolderInfo *folder, const std::string &root, const std::string &path, const std::string &rel = "") {
-    std::ofstream myfile;
+// Writes the index.html of one folder. The folders are independent: they are generated in parallel.
+bool generateFolder(const FolderTree &tree, unsigned int folder, const std::string &root) {
+    const std::string path = tree.pathOf(folder);
+    std::string rel;
+    for (unsigned int i = 0; i < tree.nodes[folder].depth; ++i)
+        rel += "../";
     std::string filename = root + "/" + path + "index.html";
-    myfile.open(filename);
-    if (!myfile) {
-        std::cerr << "Error generating " << filename << std::endl;
-        return;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr << "Generating " << filename << '\n';
     }
-    std::cerr << "Generating " << filename << std::endl;
+
+    // The page is built in memory and written at once
+    std::ostringstream myfile;
 
     std::string data_path = data_url[0] == '.' ? (rel + data_url) : std::string(data_url);
 
@@ -131,6 +211,7 @@ void gererateRecursisively(FolderInfo *folder, const std::string &root, const st
               "<link rel=\"stylesheet\" href=\"" << data_path << "/indexstyle.css\"/>\n";
     myfile << "<script type=\"text/javascript\" src=\"" << data_path << "/jquery/jquery.min.js\"></script>\n";
     myfile << "<script type=\"text/javascript\" src=\"" << data_path << "/jquery/jquery-ui.min.js\"></script>\n";
+    myfile << "<script type=\"text/javascript\" src=\"" << data_path << "/refpack.js\"></script>\n";
     myfile << "<script>var path = '"<< path <<"'; var root_path = '"<< rel <<"'; var project='"<< project <<"'; var ecma_script_api_version = 2;</script>\n"
               "<script src='" << data_path << "/indexscript.js'></script>\n"
               "</head>\n<body>\n";
@@ -144,14 +225,20 @@ void gererateRecursisively(FolderInfo *folder, const std::string &root, const st
         myfile << " <tr><td class='parent'>    <a href='../'>../</a></td><td></td></tr>\n";
     }
 
-    for (auto it : folder->subfolders) {
-        const std::string &name = it.first;
-        if (it.second) {
-            gererateRecursisively(it.second.get(), root, path+name+"/", rel + "../");
+    for (unsigned int child : tree.nodes[folder].children) {
+        const std::string &name = tree.nameOf(child);
+        if (tree.nodes[child].isFolder) {
             myfile << "<tr><td class='folder'><a href='"<< name <<"/' class='opener' data-path='" << path << name << "'>[+]</a> "
                       "<a href='" << name << "/'>" << name << "/</a></td><td></td></tr>\n";
         } else {
-            std::string interestingDefintions = extractMetaFromHTML("woboq:interestingDefinitions", root + "/" + path + name + ".html");
+            std::string interestingDefintions;
+            if (has_file_meta) {
+                auto meta = file_meta.find(path + name);
+                if (meta != file_meta.end())
+                    interestingDefintions = meta->second;
+            } else {
+                interestingDefintions = extractMetaFromHTML("woboq:interestingDefinitions", root + "/" + path + name + ".html");
+            }
             myfile << "<tr><td class='file'>    <a href='" << name << ".html'>"
                    << name
                    << "</a>"
@@ -163,14 +250,9 @@ void gererateRecursisively(FolderInfo *folder, const std::string &root, const st
         }
     }
 
-    char timebuf[80];
-    auto now = std::time(0);
-    auto tm = std::localtime(&now);
-    std::strftime(timebuf, sizeof(timebuf), "%Y-%b-%d", tm);
-
     myfile << "</table>"
             "<hr/><p id='footer'>\n"
-            "Generated on <em>" << timebuf << "</em>";
+            "Generated on <em>" << generation_date << "</em>";
 
     auto it = project_map.lower_bound(path);
     if (it != project_map.end() && std::equal(it->first.begin(), it->first.end(), path.c_str())) {
@@ -181,12 +263,143 @@ void gererateRecursisively(FolderInfo *folder, const std::string &root, const st
     }
     myfile << "<br />Powered by <a href='https://woboq.com'><img alt='Woboq' src='https://code.woboq.org/woboq-16.png' width='41' height='16' /></a> <a href='https://code.woboq.org'>Code Browser</a> "
             CODEBROWSER_VERSION "\n<br/>Generator usage only permitted with license</p>\n</body></html>\n";
+
+    std::ofstream out(filename, std::ios::binary);
+    const std::string content = myfile.str();
+    out.write(content.data(), content.size());
+    out.close();
+    if (!out) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr << "Error generating " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* The function index (fnIndex/) read by the search box, built from the fnSearch/ buckets.
+ *
+ * Every function is listed under the keys starting at its last two name components, the same
+ * keys as the buckets use. The entries are sorted by key, case insensitively, and split in
+ * chunks of about ChunkSize bytes, written to fnIndex/<n>. fnIndex/dir lists the first key of
+ * every chunk in lower case, so a prefix search only fetches the chunks covering that prefix.
+ *
+ * The strings are stored as a varint size followed by the bytes. The keys are front coded:
+ * a varint with the size of the prefix shared with the previous key, then the rest of the key.
+ * A chunk entry is the key, the part of the qualified name in front of the key, and the ref.
+ * A directory entry is just the key.
+ */
+struct FunctionEntry {
+    std::string sortKey; // key in lower case
+    std::string key;
+    std::string namePrefix;
+    std::string ref;
+    bool operator<(const FunctionEntry &o) const {
+        return std::tie(sortKey, key, namePrefix, ref) < std::tie(o.sortKey, o.key, o.namePrefix, o.ref);
+    }
+    bool operator==(const FunctionEntry &o) const {
+        return std::tie(key, namePrefix, ref) == std::tie(o.key, o.namePrefix, o.ref);
+    }
+};
+
+static void appendNumber(std::string &out, size_t value) {
+    while (value >= 0x80) {
+        out += char(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+static void appendString(std::string &out, const std::string &str) {
+    appendNumber(out, str.size());
+    out += str;
+}
+
+static void appendKey(std::string &out, const std::string &key, const std::string &previous) {
+    size_t shared = 0;
+    while (shared < key.size() && shared < previous.size() && key[shared] == previous[shared])
+        shared++;
+    appendNumber(out, shared);
+    appendString(out, key.substr(shared));
+}
+
+static bool writeFile(const std::string &filename, const std::string &content) {
+    std::ofstream out(filename, std::ios::binary);
+    out << content;
+    if (!out) {
+        std::cerr << "Error generating " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void generateFunctionIndex(const std::string &root) {
+    namespace fs = std::filesystem;
+    const size_t ChunkSize = 8 * 1024;
+    std::error_code ec;
+    fs::path fnSearch = fs::path(root) / "fnSearch";
+    if (!fs::is_directory(fnSearch, ec))
+        return;
+
+    std::vector<FunctionEntry> entries;
+    for (const auto &file : fs::directory_iterator(fnSearch, ec)) {
+        std::ifstream in(file.path());
+        for (std::string line; std::getline(in, line); ) {
+            // "ref|qualified::name", keyed like the buckets: from the last two components
+            auto sep = line.find('|');
+            if (sep == std::string::npos)
+                continue;
+            std::string ref = line.substr(0, sep);
+            std::string name = line.substr(sep + 1);
+            size_t pos = name.size() + 2;
+            for (int count = 0; count < 2 && pos >= 4; ++count) {
+                pos = name.rfind("::", pos - 4);
+                pos = pos >= name.size() ? 0 : pos + 2;
+                FunctionEntry entry;
+                entry.key = name.substr(pos);
+                entry.namePrefix = name.substr(0, pos);
+                entry.ref = ref;
+                entry.sortKey = entry.key;
+                std::transform(entry.sortKey.begin(), entry.sortKey.end(), entry.sortKey.begin(),
+                               [](unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; });
+                entries.push_back(std::move(entry));
+            }
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+    fs::path fnIndex = fs::path(root) / "fnIndex";
+    fs::remove_all(fnIndex, ec);
+    fs::create_directories(fnIndex, ec);
+    std::cerr << "Generating " << fnIndex.string() << "/" << std::endl;
+
+    std::string dir, chunk, previousKey, previousFirstKey;
+    int chunks = 0;
+    for (const auto &entry : entries) {
+        if (chunk.empty()) {
+            appendKey(dir, entry.sortKey, previousFirstKey);
+            previousFirstKey = entry.sortKey;
+            previousKey.clear();
+        }
+        appendKey(chunk, entry.key, previousKey);
+        appendString(chunk, entry.namePrefix);
+        appendString(chunk, entry.ref);
+        previousKey = entry.key;
+        if (chunk.size() >= ChunkSize) {
+            writeFile((fnIndex / std::to_string(chunks++)).string(), chunk);
+            chunk.clear();
+        }
+    }
+    if (!chunk.empty())
+        writeFile((fnIndex / std::to_string(chunks++)).string(), chunk);
+    writeFile((fnIndex / "dir").string(), dir);
 }
 
 int main(int argc, char **argv) {
 
     std::string root;
     bool skipOptions = false;
+    unsigned int jobs = std::thread::hardware_concurrency();
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -211,6 +424,10 @@ int main(int argc, char **argv) {
                         project_map[s.substr(0, colonPos)] = s.substr(secondColonPos + 1);
                     }
                 }
+            } else if (arg=="-j") {
+                i++;
+                if (i < argc)
+                    jobs = std::atoi(argv[i]);
             } else if (arg=="-e") {
                 i++;
                 // ignore -e XXX  for compatibility with the generator project definitions
@@ -226,27 +443,56 @@ int main(int argc, char **argv) {
     }
 
     if (root.empty()) {
-        std::cerr << "Usage: " << argv[0] << " <path> [-d data_url] [-p project_definition]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <path> [-d data_url] [-p project_definition] [-j jobs]" << std::endl;
         return -1;
     }
+    if (jobs == 0)
+        jobs = 1;
+
+    // The function index does not depend on the folders: build it meanwhile
+    std::thread functionIndex(generateFunctionIndex, root);
+
     std::ifstream fileIndex(root + "/" + "fileIndex");
     std::string line;
 
-    FolderInfo rootInfo;
+    FolderTree tree;
     while (std::getline(fileIndex, line))
-    {
-        FolderInfo *parent = &rootInfo;
-
-        unsigned int pos = 0;
-        unsigned int next_pos;
-        while ((next_pos = line.find('/', pos)) < line.size()) {
-            auto &sub = parent->subfolders[line.substr(pos, next_pos - pos)];
-            if (!sub) sub = std::make_shared<FolderInfo>();
-            parent = sub.get();
-            pos = next_pos + 1;
-        }
-        parent->subfolders[line.substr(pos)]; //make sure it exists;
+        tree.add(line);
+    tree.sort();
+
+    // "<file>\t<definitions>" lines
+    std::ifstream fileIndexMeta(root + "/" + "fileIndexMeta");
+    has_file_meta = fileIndexMeta.is_open();
+    while (std::getline(fileIndexMeta, line)) {
+        auto tab = line.rfind('\t');
+        if (tab != std::string::npos)
+            file_meta[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+
+    char timebuf[80];
+    auto now = std::time(0);
+    auto tm = std::localtime(&now);
+    std::strftime(timebuf, sizeof(timebuf), "%Y-%b-%d", tm);
+    generation_date = timebuf;
+
+    std::vector<unsigned int> folders;
+    for (unsigned int i = 0; i < tree.nodes.size(); ++i) {
+        if (i == 0 || tree.nodes[i].isFolder)
+            folders.push_back(i);
+    }
+    std::atomic<size_t> next { 0 };
+    std::atomic<bool> success { true };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < std::min<size_t>(jobs, folders.size()); ++t) {
+        threads.emplace_back([&] {
+            for (size_t i; (i = next++) < folders.size();) {
+                if (!generateFolder(tree, folders[i], root))
+                    success = false;
+            }
+        });
     }
-    gererateRecursisively(&rootInfo, root, "");
-    return 0;
+    for (auto &t : threads)
+        t.join();
+    functionIndex.join();
+    return success ? 0 : 1;
 }
@@ -0,0 +1,1049 @@
+/****************************************************************************
+ * Copyright (C) 2012-2016 Woboq GmbH
+ * Olivier Goffart <contact at woboq.com>
+ * https://woboq.com/codebrowser.html
+ *
+ * This file is part of the Woboq Code Browser.
+ *
+ * Commercial License Usage:
+ * Licensees holding valid commercial licenses provided by Woboq may use
+ * this file in accordance with the terms contained in a written agreement
+ * between the licensee and Woboq.
+ * For further information see https://woboq.com/codebrowser.html
+ *
+ * Alternatively, this work may be used under a Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 (CC-BY-NC-SA 3.0) License.
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/deed.en_US
+ * This license does not allow you to use the code browser to assist the
+ * development of your commercial software. If you intent to do so, consider
+ * purchasing a commercial licence.
+ ****************************************************************************/
+
+/* Merges the files written by the generators started by scripts/runner.py.
+ *
+ * In MULTIPROCESS_MODE, every generator appends to 'file___sufN' instead of 'file'
+ * (see getFileIndexSuffix() in the generator).  For every such group, this tool writes
+ * 'file' with the lines of all the shards in order of N, without duplicates, then removes
+ * the shards.  This is the same as runner.py's do_merge, but done in parallel.  stats.jsonl
+ * is merged by translation unit instead, into the stats of the previous runs.
+ *
+ * With --paginate N, the refs files with more than N uses are then split: refs/<ref> only keeps
+ * the other records and one <uses f='file' n='count' p='page'/> per file, and the uses move to
+ * refs/_P/<ref>.<page>, which codebrowser.js only fetches when the uses are shown. The uses of
+ * a file are never split over several pages. A ref paginated by a previous run which got new
+ * uses since is paginated again, with the uses read back from its old pages.
+ *
+ * With --input, the output directories of the generators run with --shard on different
+ * machines are combined into the output directory: every page comes from one of them, the
+ * shared files are merged, and the 'segment' files describing them are checked.
+ *
+ * With --pack, the refs files, which are many small files, are moved to a few segments in
+ * refs/_pack/. codebrowser.js (refpack.js) looks them up with range requests, in:
+ *  - meta: "woboq-refpack 1", "buckets <B>", "segments <S>" and "compressed <0|1>" lines
+ *  - index: B fixed width entries "<offset: 10 hex digits><size: 6 hex digits>" locating, after
+ *    the entries, the "<name>\t<segment>\t<offset>\t<size>\n" lines of the bucket: the refs
+ *    whose FNV-1a hash of the name (relative to refs/, without .gz) modulo B is that bucket
+ *  - 0, 1, ...: the segments, with the content of the refs one after the other, decompressed
+ * --unpack writes the refs files back from the segments, and removes refs/_pack/.
+ *
+ * The files written by the generator with --compress end with .gz and are sequences of gzip
+ * members: they are decompressed to be merged, and the result is compressed again.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+// ATTENTION: Keep in sync with `suffix` in scripts/runner.py
+static const std::string suffix = "___suf";
+
+struct MergeGroup
+{
+    fs::path target;
+    // shard number -> file; the shards are merged in that order
+    std::map<long, fs::path> shards;
+    std::vector<fs::path> otherShards; // shards with a non numeric suffix, merged last
+    bool keepShards = false; // the inputs of --input are not removed
+};
+
+// FNV-1a. Only the 64 bit hash of the lines already written is kept in memory.
+static uint64_t hashLine(const std::string &line)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : line) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static bool isCompressed(const std::string &name)
+{
+    return name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0;
+}
+
+// Decompresses all the gzip members of data
+static bool gunzip(const std::string &data, std::string &result)
+{
+    z_stream stream = {};
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+        return false;
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = data.size();
+    char buffer[64 * 1024];
+    int ret = Z_OK;
+    while (stream.avail_in > 0) {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        result.append(buffer, sizeof(buffer) - stream.avail_out);
+        if (ret == Z_STREAM_END)
+            ret = inflateReset(&stream); // next member
+        else if (ret != Z_OK)
+            break;
+    }
+    inflateEnd(&stream);
+    return ret == Z_OK;
+}
+
+static std::string gzip(const std::string &data)
+{
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY)
+        != Z_OK)
+        return {};
+    std::string result(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&result[0]);
+    stream.avail_out = result.size();
+    deflate(&stream, Z_FINISH);
+    result.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result;
+}
+
+// Reads the whole file, decompressed if it ends with .gz
+static bool readFile(const fs::path &path, std::string &content)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Error reading " << path << std::endl;
+        return false;
+    }
+    content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (!isCompressed(path.filename().string()))
+        return true;
+    std::string data = std::move(content);
+    content.clear();
+    if (!gunzip(data, content)) {
+        std::cerr << "Error decompressing " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The logs of the generators, <name>.log or <name>.log___sufN, are only about their own process
+// and are never merged
+static bool isLog(const std::string &name)
+{
+    std::string base = name.substr(0, name.find(suffix));
+    return base.size() > 4 && base.compare(base.size() - 4, 4, ".log") == 0;
+}
+
+static void listGroups(const fs::path &dir, std::vector<MergeGroup> &groups)
+{
+    std::map<std::string, MergeGroup> byName;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec))
+            continue;
+        std::string name = it->path().filename().string();
+        // file___sufN.gz is merged to file.gz
+        std::string extension = isCompressed(name) ? ".gz" : "";
+        name.resize(name.size() - extension.size());
+        auto pos = name.find(suffix);
+        if (pos == std::string::npos)
+            continue;
+        if (isLog(name))
+            continue;
+        auto &group = byName[name.substr(0, pos) + extension];
+        std::string num = name.substr(pos + suffix.size());
+        // Less than 10 digits, so that it fits the key; the other files are merged after the shards
+        bool digits = !num.empty() && num.size() < 10
+            && std::all_of(num.begin(), num.end(), [](unsigned char c) { return std::isdigit(c); });
+        if (digits) {
+            group.shards[std::strtoul(num.c_str(), nullptr, 10)] = it->path();
+        } else {
+            group.otherShards.push_back(it->path());
+        }
+    }
+    if (ec) {
+        std::cerr << "Error listing " << dir << ": " << ec.message() << std::endl;
+        return;
+    }
+    for (auto &it : byName) {
+        it.second.target = dir / it.first;
+        std::sort(it.second.otherShards.begin(), it.second.otherShards.end());
+        groups.push_back(std::move(it.second));
+    }
+}
+
+static bool mergeGroup(const MergeGroup &group)
+{
+    std::vector<fs::path> inputs;
+    for (auto &it : group.shards)
+        inputs.push_back(it.second);
+    inputs.insert(inputs.end(), group.otherShards.begin(), group.otherShards.end());
+
+    fs::path tmp = group.target;
+    tmp += ".merging";
+    const bool compressed = isCompressed(group.target.filename().string());
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "Error creating " << tmp << std::endl;
+            return false;
+        }
+        // The compressed files are merged in memory
+        std::ostringstream buffer;
+        std::ostream &out = compressed ? static_cast<std::ostream &>(buffer) : file;
+        std::unordered_set<uint64_t> seen;
+        std::string line;
+        bool first = true;
+        for (auto &input : inputs) {
+            std::unique_ptr<std::istream> in;
+            if (compressed) {
+                std::string content;
+                if (!readFile(input, content))
+                    return false;
+                in = std::make_unique<std::istringstream>(std::move(content));
+            } else {
+                in = std::make_unique<std::ifstream>(input, std::ios::binary);
+                if (!*in) {
+                    std::cerr << "Error reading " << input << std::endl;
+                    return false;
+                }
+            }
+            while (std::getline(*in, line)) {
+                if (!seen.insert(hashLine(line)).second)
+                    continue;
+                if (!first)
+                    out << '\n';
+                out << line;
+                first = false;
+            }
+        }
+        if (compressed)
+            file << gzip(buffer.str());
+        file.close();
+        if (!file) {
+            std::cerr << "Error writing " << tmp << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, group.target, ec);
+    if (ec) {
+        std::cerr << "Error renaming " << tmp << ": " << ec.message() << std::endl;
+        return false;
+    }
+    if (!group.keepShards) {
+        for (auto &input : inputs)
+            fs::remove(input, ec);
+    }
+    return true;
+}
+
+// Compresses the content if the name ends with .gz
+static bool writeFile(const fs::path &path, const std::string &content)
+{
+    fs::path tmp = path;
+    tmp += ".merging";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << (isCompressed(path.filename().string()) ? gzip(content) : content);
+        out.close();
+        if (!out) {
+            std::cerr << "Error writing " << tmp << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::cerr << "Error renaming " << tmp << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// name is relative to refs/, the pages go to refs/_P/<name>.<page> (<name>.<page>.gz for <name>.gz)
+static bool paginateRefs(const fs::path &refs, const std::string &name, size_t maxUses)
+{
+    std::string content;
+    if (!readFile(refs / name, content))
+        return false;
+    std::string extension = isCompressed(name) ? ".gz" : "";
+    std::string base = name.substr(0, name.size() - extension.size());
+
+    // The records are lines, except the <doc> which may span several lines
+    // (A line of a <doc> cannot start with '<' because the content is escaped)
+    auto forEachRecord = [](const std::string &content, auto &&f) {
+        for (size_t begin = 0; begin < content.size();) {
+            size_t end = content.find('\n', begin);
+            while (end != std::string::npos && end + 1 < content.size() && content[end + 1] != '<')
+                end = content.find('\n', end + 1);
+            end = end == std::string::npos ? content.size() : end + 1;
+            std::string record = content.substr(begin, end - begin);
+            begin = end;
+            if (!record.empty() && record.back() != '\n')
+                record += '\n';
+            f(std::move(record));
+        }
+    };
+    std::string head;
+    std::vector<std::string> newUses;
+    std::set<std::string> oldPages; // of a previous run, with the <uses> records pointing to them
+    forEachRecord(content, [&](std::string record) {
+        if (record.compare(0, 5, "<use ") == 0) {
+            newUses.push_back(std::move(record));
+        } else if (record.compare(0, 6, "<uses ") == 0) {
+            size_t p = record.find("p='");
+            if (p != std::string::npos)
+                oldPages.insert(record.substr(p + 3, record.find('\'', p + 3) - p - 3));
+        } else {
+            head += record;
+        }
+    });
+    // Paginated by a previous run and not regenerated since: its pages are still the right ones
+    if (newUses.empty())
+        return true;
+
+    // The uses of the pages of a previous run come first, then the ones added since, without
+    // the duplicates
+    std::vector<std::string> files;
+    std::unordered_map<std::string, std::string> usesOfFile;
+    std::unordered_set<std::string> seen;
+    size_t uses = 0;
+    auto addUse = [&](std::string record) {
+        if (record.compare(0, 5, "<use ") != 0 || !seen.insert(record).second)
+            return;
+        // f is always the first attribute
+        size_t f = record.find("f='");
+        size_t fEnd = f == std::string::npos ? f : record.find('\'', f + 3);
+        std::string file = fEnd == std::string::npos ? "" : record.substr(f + 3, fEnd - f - 3);
+        auto it = usesOfFile.find(file);
+        if (it == usesOfFile.end()) {
+            files.push_back(file);
+            it = usesOfFile.emplace(file, std::string()).first;
+        }
+        it->second += record;
+        uses++;
+    };
+    // A page which cannot be read is reported, the others are still kept
+    fs::path pages = refs / "_P";
+    bool complete = true;
+    for (const auto &page : oldPages) {
+        std::string old;
+        if (readFile(pages / (base + "." + page + extension), old))
+            forEachRecord(old, addUse);
+        else
+            complete = false;
+    }
+    for (auto &record : newUses)
+        addUse(std::move(record));
+
+    // The pages of a previous run are all in usesOfFile now. Once the ref is written, the ones
+    // past the new pages are stale, as is another compression of the new ones.
+    std::error_code ec;
+    auto removeStalePages = [&](int pageCount) {
+        for (int n = 0;; ++n) {
+            fs::path stale = pages / (base + "." + std::to_string(n));
+            bool removed = n >= pageCount && fs::remove(stale.string() + extension, ec);
+            removed |= fs::remove(stale.string() + (extension.empty() ? ".gz" : ""), ec);
+            if (!removed && n >= pageCount)
+                break;
+        }
+    };
+    if (uses <= maxUses) {
+        for (const auto &file : files)
+            head += usesOfFile[file];
+        if (!writeFile(refs / name, head))
+            return false;
+        removeStalePages(0);
+        return complete;
+    }
+
+    fs::create_directories(fs::path(pages / base).parent_path(), ec);
+    bool ok = true;
+    std::string page;
+    size_t pageUses = 0;
+    int pageNumber = 0;
+    auto flushPage = [&] {
+        ok &= writeFile(pages / (base + "." + std::to_string(pageNumber) + extension), page);
+        page.clear();
+        pageUses = 0;
+        pageNumber++;
+    };
+    for (const auto &file : files) {
+        const std::string &records = usesOfFile[file];
+        size_t n = std::count(records.begin(), records.end(), '\n');
+        if (pageUses && pageUses + n > maxUses)
+            flushPage();
+        head += "<uses f='" + file + "' n='" + std::to_string(n) + "' p='"
+            + std::to_string(pageNumber) + "'/>\n";
+        page += records;
+        pageUses += n;
+    }
+    if (pageUses)
+        flushPage();
+    if (!ok || !writeFile(refs / name, head))
+        return false;
+    removeStalePages(pageNumber);
+    return complete;
+}
+
+// stats.jsonl (see the generator's --stats) has one line per translation unit, keyed by "file".
+// The lines of the processes replace the ones of the same translation units in the stats of
+// the previous runs, which are kept for the others, so the next run can estimate them all.
+static bool mergeStats(const MergeGroup &group)
+{
+    std::vector<fs::path> inputs;
+    std::error_code ec;
+    if (fs::exists(group.target, ec))
+        inputs.push_back(group.target);
+    for (auto &it : group.shards)
+        inputs.push_back(it.second);
+    inputs.insert(inputs.end(), group.otherShards.begin(), group.otherShards.end());
+
+    std::vector<std::string> files;
+    std::unordered_map<std::string, std::string> lineOfFile;
+    for (auto &input : inputs) {
+        std::string content;
+        if (!readFile(input, content))
+            return false;
+        std::istringstream in(content);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty())
+                continue;
+            // {"file":"<the path, escaped the same way in every line>",...
+            std::string file = line;
+            if (line.compare(0, 9, "{\"file\":\"") == 0) {
+                size_t end = 9;
+                while (end < line.size() && line[end] != '"')
+                    end += line[end] == '\\' ? 2 : 1;
+                file = line.substr(9, end - 9);
+            }
+            auto it = lineOfFile.find(file);
+            if (it == lineOfFile.end()) {
+                files.push_back(file);
+                lineOfFile.emplace(std::move(file), std::move(line));
+            } else {
+                it->second = std::move(line);
+            }
+        }
+    }
+    std::string content;
+    for (const auto &file : files)
+        content += lineOfFile[file] + '\n';
+    if (!writeFile(group.target, content))
+        return false;
+    if (!group.keepShards) {
+        for (auto &input : inputs) {
+            if (input != group.target)
+                fs::remove(input, ec);
+        }
+    }
+    return true;
+}
+
+static const char packMagic[] = "woboq-refpack 1";
+// The refs are packed in segments of about that size
+static constexpr uintmax_t PackSegmentSize = 64 * 1024 * 1024;
+// The number of refs in a bucket of the index, on average
+static constexpr size_t PackBucketRefs = 64;
+
+struct PackedRef
+{
+    std::string name; // relative to refs/, without .gz
+    size_t offset;
+    size_t size;
+};
+
+// FNV-1a, 32 bit. ATTENTION: Keep in sync with hashRef in data/refpack.js
+static uint32_t hashRef(const std::string &name)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Runs work(i) for i in [0, count), on jobs threads
+template<typename F>
+static void parallelFor(size_t count, unsigned int jobs, F work)
+{
+    std::atomic<size_t> next { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < std::min<size_t>(jobs, count); ++t) {
+        threads.emplace_back([&] {
+            for (size_t i; (i = next++) < count;)
+                work(i);
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+}
+
+static bool unpackRefs(const fs::path &refs, unsigned int jobs)
+{
+    fs::path packDir = refs / "_pack";
+    std::string meta, index;
+    if (!readFile(packDir / "meta", meta) || !readFile(packDir / "index", index))
+        return false;
+    std::istringstream metaLines(meta);
+    std::string line;
+    size_t buckets = 0, segments = 0;
+    bool compressed = false;
+    std::getline(metaLines, line);
+    if (line != packMagic) {
+        std::cerr << "Error: " << (packDir / "meta") << " is not a pack of this version"
+                  << std::endl;
+        return false;
+    }
+    while (std::getline(metaLines, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        size_t value = 0;
+        fields >> key >> value;
+        if (key == "buckets")
+            buckets = value;
+        else if (key == "segments")
+            segments = value;
+        else if (key == "compressed")
+            compressed = value;
+    }
+
+    // The lines of all the buckets follow each other after the entries
+    std::vector<std::vector<PackedRef>> refsOfSegment(segments);
+    std::istringstream lines(index.size() > buckets * 16 ? index.substr(buckets * 16) : "");
+    while (std::getline(lines, line)) {
+        auto tab1 = line.find('\t');
+        auto tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+        auto tab3 = tab2 == std::string::npos ? tab2 : line.find('\t', tab2 + 1);
+        size_t segment = tab3 == std::string::npos ? segments : std::stoul(line.substr(tab1 + 1));
+        if (segment >= segments) {
+            std::cerr << "Error: corrupted " << (packDir / "index") << std::endl;
+            return false;
+        }
+        refsOfSegment[segment].push_back({ line.substr(0, tab1), std::stoul(line.substr(tab2 + 1)),
+                                           std::stoul(line.substr(tab3 + 1)) });
+    }
+
+    std::atomic<bool> ok { true };
+    parallelFor(segments, jobs, [&](size_t s) {
+        std::string content;
+        if (!readFile(packDir / std::to_string(s), content)) {
+            ok = false;
+            return;
+        }
+        std::error_code ec;
+        for (const auto &ref : refsOfSegment[s]) {
+            if (ref.offset + ref.size > content.size()) {
+                std::cerr << "Error: " << ref.name << " is not in its segment" << std::endl;
+                ok = false;
+                continue;
+            }
+            fs::path path = refs / (ref.name + (compressed ? ".gz" : ""));
+            fs::create_directories(path.parent_path(), ec);
+            if (!writeFile(path, content.substr(ref.offset, ref.size)))
+                ok = false;
+        }
+    });
+    if (!ok)
+        return false;
+    std::error_code ec;
+    fs::remove_all(packDir, ec);
+    return true;
+}
+
+static bool packRefs(const fs::path &refs, unsigned int jobs)
+{
+    fs::path packDir = refs / "_pack";
+    std::error_code ec;
+    // The refs generated since the previous --pack are packed with the ones already packed
+    if (fs::exists(packDir / "meta", ec) && !unpackRefs(refs, jobs))
+        return false;
+
+    std::vector<std::pair<fs::path, uintmax_t>> files; // relative to refs/, size
+    bool compressed = false;
+    for (fs::recursive_directory_iterator it(refs, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec)) {
+            if (it->path() == packDir)
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (!it->is_regular_file(ec))
+            continue;
+        std::string name = it->path().filename().string();
+        if (name.find(suffix) != std::string::npos) {
+            std::cerr << "Error: " << it->path() << " is not merged" << std::endl;
+            return false;
+        }
+        compressed |= isCompressed(name);
+        uintmax_t size = it->file_size(ec);
+        files.emplace_back(it->path().lexically_relative(refs), ec ? 0 : size);
+    }
+    if (ec) {
+        std::cerr << "Error listing " << refs << ": " << ec.message() << std::endl;
+        return false;
+    }
+    std::sort(files.begin(), files.end());
+
+    // The files of a segment are consecutive; the segments are written in parallel
+    std::vector<size_t> segmentBegin = { 0 };
+    uintmax_t segmentSize = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (segmentSize && segmentSize + files[i].second > PackSegmentSize) {
+            segmentBegin.push_back(i);
+            segmentSize = 0;
+        }
+        segmentSize += files[i].second;
+    }
+    segmentBegin.push_back(files.size());
+    const size_t segments = segmentBegin.size() - 1;
+
+    fs::create_directories(packDir, ec);
+    std::vector<std::vector<PackedRef>> refsOfSegment(segments);
+    std::atomic<bool> ok { true };
+    parallelFor(segments, jobs, [&](size_t s) {
+        std::string segment, content;
+        for (size_t i = segmentBegin[s]; i < segmentBegin[s + 1]; ++i) {
+            if (!readFile(refs / files[i].first, content)) {
+                ok = false;
+                continue;
+            }
+            std::string name = files[i].first.generic_string();
+            if (isCompressed(name))
+                name.resize(name.size() - 3);
+            refsOfSegment[s].push_back({ std::move(name), segment.size(), content.size() });
+            segment += content;
+        }
+        if (!writeFile(packDir / std::to_string(s), segment))
+            ok = false;
+    });
+    if (!ok)
+        return false;
+
+    size_t buckets = 1;
+    while (buckets * PackBucketRefs < files.size())
+        buckets *= 2;
+    std::vector<std::string> bucketLines(buckets);
+    for (size_t s = 0; s < segments; ++s) {
+        for (const auto &ref : refsOfSegment[s]) {
+            bucketLines[hashRef(ref.name) % buckets] += ref.name + '\t' + std::to_string(s) + '\t'
+                + std::to_string(ref.offset) + '\t' + std::to_string(ref.size) + '\n';
+        }
+    }
+    std::string index, lines;
+    for (const auto &bucket : bucketLines) {
+        if (bucket.size() >= (1u << 24)) {
+            std::cerr << "Error: a bucket of the index of the refs is too big" << std::endl;
+            return false;
+        }
+        char entry[17];
+        std::snprintf(entry, sizeof(entry), "%010llx%06llx",
+                      static_cast<unsigned long long>(lines.size()),
+                      static_cast<unsigned long long>(bucket.size()));
+        index += entry;
+        lines += bucket;
+    }
+    index += lines;
+    // The meta last: the pack is only used once it is complete
+    std::string meta = std::string(packMagic) + "\nbuckets " + std::to_string(buckets)
+        + "\nsegments " + std::to_string(segments) + "\ncompressed " + (compressed ? "1" : "0")
+        + "\n";
+    if (!writeFile(packDir / "index", index) || !writeFile(packDir / "meta", meta))
+        return false;
+
+    for (const auto &file : files)
+        fs::remove(refs / file.first, ec);
+    // and the directories left empty, such as refs/_P/ (fs::remove does not remove the others)
+    std::vector<fs::path> dirs;
+    for (fs::recursive_directory_iterator it(refs, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec) && it->path() != packDir)
+            dirs.push_back(it->path());
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+        fs::remove(*it, ec);
+    std::cerr << "Packed " << files.size() << " refs files in " << segments << " segments"
+              << std::endl;
+    return true;
+}
+
+// The files shared by the translation units, which are merged line by line. The other files
+// (the pages) come from a single generator.
+static bool isSharedFile(const fs::path &relative)
+{
+    std::string dir = relative.parent_path().generic_string();
+    std::string name = relative.filename().string();
+    if (dir.empty())
+        return name == "fileIndex" || name == "fileIndexMeta" || name == "segment";
+    return dir == "fnSearch" || dir == "refs" || dir == "refs/_M";
+}
+
+struct Segment
+{
+    fs::path dir;
+    long shard = -1; // -1 if the generator did not use --shard
+    long shards = 0;
+    std::string compress;
+    std::vector<std::pair<std::string, std::string>> foreign; // page -> translation unit
+};
+
+// Reads the 'segment' file the generator writes with --shard
+static bool readSegment(Segment &segment, std::map<std::string, std::string> &revisions)
+{
+    fs::path path = segment.dir / "segment";
+    std::error_code ec;
+    if (!fs::exists(path, ec))
+        return true;
+    std::ifstream in(path);
+    std::string line;
+    bool valid = std::getline(in, line) && line == "segment 1";
+    while (valid && std::getline(in, line)) {
+        auto space = line.find(' ');
+        std::string key = line.substr(0, space);
+        std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+        auto tab = value.find('\t');
+        if (key == "shard") {
+            auto slash = value.find('/');
+            if (slash == std::string::npos) {
+                valid = false;
+                break;
+            }
+            long shard = std::atol(value.c_str());
+            long shards = std::atol(value.c_str() + slash + 1);
+            if (segment.shards && (shard != segment.shard || shards != segment.shards)) {
+                std::cerr << "Error: " << path << " has lines of several shards" << std::endl;
+                return false;
+            }
+            segment.shard = shard;
+            segment.shards = shards;
+        } else if (key == "compress") {
+            segment.compress = value;
+        } else if (key == "project" && tab != std::string::npos) {
+            auto it = revisions.emplace(value.substr(0, tab), value.substr(tab + 1)).first;
+            if (it->second != value.substr(tab + 1))
+                std::cerr << "Warning: the segments were generated from different revisions of "
+                          << it->first << std::endl;
+        } else if (key == "foreign" && tab != std::string::npos) {
+            segment.foreign.emplace_back(value.substr(0, tab), value.substr(tab + 1));
+        }
+    }
+    if (!valid || segment.shards <= 0) {
+        std::cerr << "Error: " << path << " is not a valid segment file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Merges the output directories of generators run with --shard, usually on different
+ * machines, into root. Each page was generated by a single shard and is copied, the shared
+ * files are merged like the files of the MULTIPROCESS_MODE generators. */
+static bool mergeSegments(const fs::path &root, std::vector<Segment> &segments, unsigned int jobs)
+{
+    std::map<std::string, std::string> revisions;
+    std::map<long, fs::path> shardDirs;
+    long shards = 0;
+    std::string compress;
+    for (auto &segment : segments) {
+        if (!readSegment(segment, revisions))
+            return false;
+        if (segment.shard < 0)
+            continue;
+        if ((shards && shards != segment.shards)
+            || (!compress.empty() && compress != segment.compress)) {
+            std::cerr << "Error: " << segment.dir
+                      << " was generated with another --shard count or --compress" << std::endl;
+            return false;
+        }
+        shards = segment.shards;
+        compress = segment.compress;
+        auto it = shardDirs.emplace(segment.shard, segment.dir);
+        if (!it.second) {
+            std::cerr << "Error: " << segment.dir << " and " << it.first->second
+                      << " are both the shard " << segment.shard << std::endl;
+            return false;
+        }
+    }
+    if (shards && shardDirs.size() != std::size_t(shards))
+        std::cerr << "Warning: only " << shardDirs.size() << " of the " << shards
+                  << " shards are merged" << std::endl;
+
+    // relative path -> input; a page generated by several inputs is taken from the first one
+    std::map<fs::path, fs::path> pages;
+    std::map<fs::path, MergeGroup> shared;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const fs::path &dir = segments[i].dir;
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end;
+             it.increment(ec)) {
+            fs::path relative = it->path().lexically_relative(dir);
+            std::string top = relative.begin()->string();
+            if (it->is_directory(ec)) {
+                // Not part of the output; the pages of --paginate are made after the merge
+                if (top == ".claims" || top == ".incremental" || top == ".objects"
+                    || top == ".logs" || relative == "refs/_P")
+                    it.disable_recursion_pending();
+                if (relative == "refs/_pack") {
+                    std::cerr << "Error: the refs of " << dir << " are packed, run "
+                              << "codebrowser_merge " << dir << " --unpack first" << std::endl;
+                    return false;
+                }
+                continue;
+            }
+            std::string name = relative.filename().string();
+            // The logs and the stats of the generators are only about their own run
+            if (relative == name
+                && (isLog(name) || name.compare(0, 11, "stats.jsonl") == 0
+                    || name == "segment-missing" || name == ".cas"))
+                continue;
+            if (name.find(suffix) != std::string::npos) {
+                std::cerr << "Error: " << it->path() << " is not merged, run codebrowser_merge "
+                          << dir << " first" << std::endl;
+                return false;
+            }
+            if (isSharedFile(relative)) {
+                auto &group = shared[relative];
+                group.target = root / relative;
+                group.shards[i] = it->path();
+                group.keepShards = true;
+            } else {
+                pages.emplace(relative, it->path());
+            }
+        }
+        if (ec) {
+            std::cerr << "Error listing " << dir << ": " << ec.message() << std::endl;
+            return false;
+        }
+    }
+    // The merged output is not a segment anymore
+    shared.erase("segment");
+    std::error_code ec;
+    fs::create_directories(root / "refs/_M", ec);
+    fs::create_directories(root / "fnSearch", ec);
+
+    std::vector<std::pair<fs::path, fs::path>> copies(pages.begin(), pages.end());
+    std::vector<MergeGroup> groups;
+    for (auto &it : shared)
+        groups.push_back(std::move(it.second));
+    std::cerr << "Copying " << copies.size() << " files and merging " << groups.size()
+              << " files from " << segments.size() << " segments" << std::endl;
+
+    std::atomic<size_t> next { 0 };
+    std::atomic<bool> success { true };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < jobs; ++t) {
+        threads.emplace_back([&] {
+            std::error_code ec;
+            for (size_t i; (i = next++) < copies.size() + groups.size();) {
+                if (i >= copies.size()) {
+                    const MergeGroup &group = groups[i - copies.size()];
+                    fs::create_directories(group.target.parent_path(), ec);
+                    if (!mergeGroup(group))
+                        success = false;
+                    continue;
+                }
+                fs::path target = root / copies[i].first;
+                fs::create_directories(target.parent_path(), ec);
+                // Not written through a link of --cas
+                fs::remove(target, ec);
+                fs::copy_file(copies[i].second, target, fs::copy_options::overwrite_existing, ec);
+                if (ec) {
+                    std::cerr << "Error copying " << copies[i].second << ": " << ec.message()
+                              << std::endl;
+                    success = false;
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    // The headers are generated by the shard their path hashes to, which might not have
+    // processed any translation unit including them: codebrowser_generator --fill-in
+    // generates them from this list
+    std::map<std::string, std::string> missing;
+    const std::string extension = compress == "1" ? ".html.gz" : ".html";
+    for (const auto &segment : segments) {
+        for (const auto &foreign : segment.foreign) {
+            if (!pages.count(foreign.first + extension))
+                missing.insert(foreign);
+        }
+    }
+    fs::remove(root / "segment-missing", ec);
+    if (!missing.empty()) {
+        std::ofstream out(root / "segment-missing");
+        for (const auto &it : missing)
+            out << it.first << '\t' << it.second << '\n';
+        std::cerr << "Warning: no shard generated " << missing.size() << " included files, "
+                  << "generate them with codebrowser_generator --fill-in "
+                  << (root / "segment-missing") << " and merge again with that --input"
+                  << std::endl;
+    }
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    std::string root;
+    unsigned int jobs = std::thread::hardware_concurrency();
+    size_t paginate = 0;
+    bool pack = false;
+    bool unpack = false;
+    std::vector<Segment> segments;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j") {
+            i++;
+            if (i < argc)
+                jobs = std::atoi(argv[i]);
+        } else if (arg == "--paginate") {
+            i++;
+            if (i < argc)
+                paginate = std::atol(argv[i]);
+        } else if (arg == "--pack") {
+            pack = true;
+        } else if (arg == "--unpack") {
+            unpack = true;
+        } else if (arg == "--input") {
+            i++;
+            if (i < argc) {
+                segments.emplace_back();
+                segments.back().dir = argv[i];
+            }
+        } else if (root.empty() && arg[0] != '-') {
+            root = arg;
+        } else {
+            root = "";
+            break;
+        }
+    }
+
+    if (root.empty() || (pack && unpack)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <output_dir> [-j jobs] [--paginate uses] [--pack | --unpack]"
+                     " [--input segment_dir]..."
+                  << std::endl;
+        return -1;
+    }
+    if (jobs == 0)
+        jobs = 1;
+
+    // Before anything else, which would need the refs files
+    if (unpack && fs::exists(fs::path(root) / "refs/_pack/meta")) {
+        std::cerr << "Unpacking the refs" << std::endl;
+        if (!unpackRefs(fs::path(root) / "refs", jobs))
+            return 1;
+    }
+
+    if (!segments.empty() && !mergeSegments(root, segments, jobs))
+        return 1;
+
+    // Same directories as runner.py's do_merge, listed in parallel
+    const std::vector<std::string> dirs = { "fnSearch", "refs", "refs/_M", "" };
+    std::vector<std::vector<MergeGroup>> listed(dirs.size());
+    {
+        std::vector<std::thread> listers;
+        for (size_t d = 0; d < dirs.size(); ++d)
+            listers.emplace_back([&, d] { listGroups(fs::path(root) / dirs[d], listed[d]); });
+        for (auto &t : listers)
+            t.join();
+    }
+    std::vector<MergeGroup> groups;
+    for (auto &l : listed)
+        std::move(l.begin(), l.end(), std::back_inserter(groups));
+
+    std::cerr << "Merging " << groups.size() << " files" << std::endl;
+
+    std::atomic<size_t> next { 0 };
+    std::atomic<bool> success { true };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < std::min<size_t>(jobs, groups.size()); ++t) {
+        threads.emplace_back([&] {
+            for (size_t i; (i = next++) < groups.size();) {
+                const MergeGroup &group = groups[i];
+                if (!(group.target.filename() == "stats.jsonl" ? mergeStats(group)
+                                                               : mergeGroup(group)))
+                    success = false;
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    if (paginate) {
+        // All the refs, not only the merged ones: the generator may have run in one process
+        std::vector<std::pair<fs::path, std::string>> refs;
+        for (const std::string dir : { "", "_M" }) {
+            std::error_code ec;
+            fs::path refsDir = fs::path(root) / "refs" / dir;
+            for (fs::directory_iterator it(refsDir, ec), end; !ec && it != end; it.increment(ec)) {
+                if (!it->is_regular_file(ec))
+                    continue;
+                std::string name = it->path().filename().string();
+                if (name.find(suffix) == std::string::npos)
+                    refs.emplace_back(fs::path(root) / "refs",
+                                      dir.empty() ? name : dir + "/" + name);
+            }
+        }
+        std::cerr << "Paginating the refs with more than " << paginate << " uses" << std::endl;
+        next = 0;
+        threads.clear();
+        for (unsigned int t = 0; t < std::min<size_t>(jobs, refs.size()); ++t) {
+            threads.emplace_back([&] {
+                for (size_t i; (i = next++) < refs.size();) {
+                    if (!paginateRefs(refs[i].first, refs[i].second, paginate))
+                        success = false;
+                }
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+    }
+
+    if (pack && success) {
+        std::cerr << "Packing the refs" << std::endl;
+        if (!packRefs(fs::path(root) / "refs", jobs))
+            success = false;
+    }
+
+    return success ? 0 : 1;
+}
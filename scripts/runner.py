@@ -5,6 +5,7 @@
 # the original file
 #
 import argparse
+import gzip
 import json
 import multiprocessing
 import os
@@ -18,6 +19,9 @@ from collections import OrderedDict
 import time
 
 suffix = "___suf"
+# Generators in MULTIPROCESS_MODE claim each output file by creating a lock file in this
+# directory (see ProjectManager::claimFile), so a header is only generated once per run.
+claims_dir = ".claims"
 
 
 def make_absolute(f, directory):
@@ -26,36 +30,73 @@ def make_absolute(f, directory):
     return os.path.normpath(os.path.join(directory, f))
 
 
+def start_generator(args, tid):
+    cmd = [args.gen, "--server", "-j", "1", "-b", args.compile_commands, "-o", args.out_dir]
+    for project in args.projects:
+        cmd.append("-p")
+        cmd.append(project)
+    if args.externalprojects is not None:
+        for p in args.externalprojects:
+            cmd.append("-e")
+            cmd.append(p)
+    if args.compress:
+        cmd.append("--compress")
+    if args.shard is not None:
+        cmd.append("--shard=" + args.shard)
+    if args.stats:
+        cmd.append("--stats")
+
+    my_env = os.environ.copy()
+    my_env["MULTIPROCESS_MODE"] = suffix + str(tid)
+    return subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=my_env,
+                            universal_newlines=True, bufsize=1)
+
+
 def generate(args, queue, lock, tid):
+    # Each worker keeps one generator running in --server mode and sends it the files one by one.
+    # A None in the queue tells the worker to stop it, which writes everything it has pending.
+    proc = None
+    # The files the running generator answered done: if it dies, they may be incomplete too
+    acknowledged = []
+
+    def report_lost(reason):
+        with lock:
+            for done in acknowledged:
+                sys.stdout.write("failed %s: %s\n" % (done, reason))
+        del acknowledged[:]
+
     while True:
         name = queue.get()
-        cmd = [args.gen, "-b", args.compile_commands, "-o", args.out_dir]
-        for project in args.projects:
-            cmd.append("-p")
-            cmd.append(project)
-        if args.externalprojects is not None:
-            for p in args.externalprojects:
-                cmd.append("-e")
-                cmd.append(p)
-
-        cmd.append(name)
-
-        my_env = os.environ.copy()
-        my_env["MULTIPROCESS_MODE"] = suffix + str(tid)
-        proc = subprocess.Popen(
-            cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=my_env)
-        output, err = proc.communicate()
-        if proc.returncode != 0:
-            if proc.returncode < 0:
-                msg = "%s: terminated by signal %d\n" % (
-                    name, -proc.returncode)
-                err += msg.encode("utf-8")
+        if name is None:
+            break
+        if proc is None:
+            proc = start_generator(args, tid)
+        try:
+            proc.stdin.write(name + "\n")
+            proc.stdin.flush()
+            status = proc.stdout.readline().strip()
+        except BrokenPipeError:
+            status = ""
+        if not status:
+            # The generator died on that file, the next files get a new one
+            returncode = proc.wait()
+            status = "failed " + name
+            if returncode < 0:
+                status += ": terminated by signal %d" % -returncode
+            report_lost("the generator died afterwards, on " + name)
+            proc = None
+        elif status.startswith("done "):
+            acknowledged.append(name)
         with lock:
-            sys.stdout.write(" ".join(cmd) + "\n" + output.decode("utf-8"))
-            if len(err) > 0:
-                sys.stdout.flush()
-                sys.stderr.write(err.decode("utf-8"))
+            sys.stdout.write(status + "\n")
         queue.task_done()
+    if proc is not None:
+        proc.stdin.close()
+        if proc.wait() != 0:
+            with lock:
+                sys.stderr.write("Error: generator %d exited with %d\n" % (tid, proc.returncode))
+            report_lost("the generator exited with %d" % proc.returncode)
+    queue.task_done()
 
 
 def do_file(directory, f, max_task):
@@ -63,27 +104,82 @@ def do_file(directory, f, max_task):
     # look for all f___suf[0 - max_task]
     # then merge them into one file and delete them
     # leaving only the merged file behind
+    # (with the generator's --compress, f ends with .gz and so do the shards)
+    compressed = f.endswith(".gz")
+    ext = ".gz" if compressed else ""
+    base = f[:-len(ext)] if compressed else f
     possible_files = list()
     for i in range(max_task):
-        filepath = directory.joinpath(f + suffix + str(i))
+        filepath = directory.joinpath(base + suffix + str(i) + ext)
         if filepath.exists():
             possible_files.append(filepath)
 
     txtlines = OrderedDict()
     for fil in possible_files:
-        lines = str(fil.read_text()).splitlines()
+        if compressed:
+            lines = gzip.decompress(fil.read_bytes()).decode().splitlines()
+        else:
+            lines = str(fil.read_text()).splitlines()
         for line in lines:
             txtlines[line] = None
 
     txt = '\n'.join(txtlines.keys())
     new_file = directory.joinpath(f)
     # print("create new file: {}".format(str(new_file)))
-    new_file.write_text(txt)
+    if compressed:
+        new_file.write_bytes(gzip.compress(txt.encode()))
+    else:
+        new_file.write_text(txt)
     # remove old ones
     for fil in possible_files:
         fil.unlink()
 
 
+def stats_key(line):
+    # the "file" of the line of a translation unit in stats.jsonl, see the generator's --stats
+    try:
+        return json.loads(line).get("file", line)
+    except ValueError:
+        return line
+
+
+def do_stats(out, max_task):
+    # The lines of the generators replace the ones of the same translation units in the
+    # stats.jsonl of the previous runs, which are kept for the others (like codebrowser_merge)
+    directory = Path(out)
+    target = directory.joinpath("stats.jsonl")
+    inputs = [target] if target.exists() else []
+    shards = [directory.joinpath("stats.jsonl" + suffix + str(i)) for i in range(max_task)]
+    shards = [f for f in shards if f.exists()]
+    if not shards:
+        return
+    lines = OrderedDict()
+    for fil in inputs + shards:
+        for line in fil.read_text().splitlines():
+            if line:
+                lines[stats_key(line)] = line
+    target.write_text("".join(line + "\n" for line in lines.values()))
+    for fil in shards:
+        fil.unlink()
+
+
+def previous_costs(out):
+    # total_ms of the translation units in the stats.jsonl of the previous runs
+    costs = {}
+    try:
+        with open(os.path.join(out, "stats.jsonl")) as f:
+            for line in f:
+                try:
+                    stats = json.loads(line)
+                except ValueError:
+                    continue
+                if "file" in stats and stats.get("total_ms", 0) > 0:
+                    costs[stats["file"]] = stats["total_ms"]
+    except OSError:
+        pass
+    return costs
+
+
 def do_merge_dir(d, max_task):
     dirPath = Path(d)
     files = set()
@@ -91,9 +187,12 @@ def do_merge_dir(d, max_task):
         fn = os.fsdecode(f)
         try:
             if fn.index(suffix) != -1:
-                files.add(fn.split(suffix)[0])
+                files.add(fn.split(suffix)[0] + (".gz" if fn.endswith(".gz") else ""))
         except ValueError:
             continue
+    # merged by translation unit by do_stats; the logs are only about their own process
+    files.discard("stats.jsonl")
+    files = [f for f in files if not f.endswith(".log")]
 
     for f in files:
         do_file(dirPath, f, max_task)
@@ -114,16 +213,29 @@ def do_merge(out, max_task):
 
     print("Merging fileIndex")
     do_merge_dir(out, max_task)
+    do_stats(out, max_task)
 
 
 def main():
-    usage = "python runner.py -p compile_commands.json -o output/ -e ./generator/codebrowser_generator -a project_name -x external_project"
+    usage = "python runner.py -p compile_commands.json -o output/ -e ./generator/codebrowser_generator [-m ./merger/codebrowser_merge] -a project_name -x external_project"
     parser = argparse.ArgumentParser(
         description="Runs codebrowser over all files in a compile_commands.json in parallel.", usage=usage)
     parser.add_argument("-j", type=int, default=0,
                         help="number of generators to be run in parallel.")
     parser.add_argument(
         "-e", dest="gen", help="Path to codebrowser_generator.")
+    parser.add_argument(
+        "-m", dest="merge", help="Path to codebrowser_merge. If not given, the files are merged in python.")
+    parser.add_argument("--compress", action="store_true",
+                        help="write the HTML pages and the refs gzip compressed (see the generator's --compress).")
+    parser.add_argument("--shard", metavar="i/N",
+                        help="only generate the shard i of N, to be merged with the other shards by codebrowser_merge --input.")
+    parser.add_argument("--stats", action="store_true",
+                        help="write the stats of the translation units to stats.jsonl (see the generator's --stats). The most expensive ones of the previous run are sent first.")
+    parser.add_argument("--paginate", type=int, default=0,
+                        help="split the refs with more uses than that (requires -m).")
+    parser.add_argument("--pack", action="store_true",
+                        help="pack the refs in a few segment files once merged (requires -m).")
     parser.add_argument("-p", dest="compile_commands",
                         help="Path to a compile_commands.json file.")
     parser.add_argument("-o", dest="out_dir",
@@ -170,24 +282,37 @@ def main():
     if max_task == 0:
         max_task = multiprocessing.cpu_count()
 
+    # Claims of a previous run would prevent regenerating the files
+    claims = os.path.join(args.out_dir, claims_dir)
+    shutil.rmtree(claims, ignore_errors=True)
+
     try:
         task_queue = queue.Queue(max_task)
         # List of files with a non-zero return code.
         lock = threading.Lock()
         idx = 0
+        threads = []
         for _ in range(max_task):
             t = threading.Thread(
                 target=generate, args=(args, task_queue, lock, idx))
             t.daemon = True
             t.start()
+            threads.append(t)
             idx = idx + 1
 
-        # Fill the queue with files.
-        for name in files:
+        # Fill the queue with files, the ones which took the longest in the previous run first,
+        # as the generator orders them (the new ones are expected to be like the average)
+        costs = previous_costs(args.out_dir)
+        average = sum(costs.values()) / len(costs) if costs else 0
+        for name in sorted(files, key=lambda f: -costs.get(f, average)):
             task_queue.put(name)
 
-        # Wait for all threads to be done.
+        # Wait for all the files, then stop the generators.
         task_queue.join()
+        for _ in threads:
+            task_queue.put(None)
+        for t in threads:
+            t.join()
 
     except KeyboardInterrupt:
         print("\nCtrl-C detected, goodbye.")
@@ -198,7 +323,19 @@ def main():
     print("Merging files...")
     start = time.time()
 
-    do_merge(args.out_dir, max_task)
+    if args.merge is not None:
+        cmd = [args.merge, "-j", str(max_task), args.out_dir]
+        if args.paginate:
+            cmd += ["--paginate", str(args.paginate)]
+        if args.pack:
+            cmd += ["--pack"]
+        ret = subprocess.call(cmd)
+        if ret != 0:
+            print("Error: codebrowser_merge failed, merging the remaining files in python")
+            do_merge(args.out_dir, max_task)
+    else:
+        do_merge(args.out_dir, max_task)
+    shutil.rmtree(claims, ignore_errors=True)
 
     end = time.time()
     print("Merged all files in: %.2F seconds" % (end - start))